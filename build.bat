@@ -10,7 +10,9 @@ echo Building with MSVC
 
 if not exist "build" mkdir build
 pushd build
-call cl -I../src -nologo -FC -Oi -O2 -EHsc -std:c++14 -arch:AVX2 %* ..\src\main.cpp ..\src\portable-memory-mapping\MemoryMapped.cpp -Fevsign.exe
+call cl -I../src -nologo -FC -Oi -O2 -EHsc -std:c++14 -arch:AVX2 %* -c ..\src\vsign.cpp ..\src\vsign_c.cpp ..\src\pool.cpp ..\src\tune.cpp ..\src\watch.cpp ..\src\cache.cpp ..\src\key.cpp ..\src\checkpoint.cpp ..\src\throttle.cpp ..\src\delta.cpp ..\src\dedup.cpp ..\src\bloom.cpp ..\src\merge.cpp ..\src\hashers.cpp ..\src\portable-memory-mapping\MemoryMapped.cpp
+call lib -nologo vsign.obj vsign_c.obj pool.obj tune.obj watch.obj cache.obj key.obj checkpoint.obj throttle.obj delta.obj dedup.obj bloom.obj merge.obj hashers.obj MemoryMapped.obj -OUT:vsign.lib
+call cl -I../src -nologo -FC -Oi -O2 -EHsc -std:c++14 -arch:AVX2 %* ..\src\main.cpp vsign.lib -Fevsign.exe
 popd
 
 :SkipMSVC
@@ -3,7 +3,20 @@
 set -eu
 
 CXX=${CXX:-clang++}
+AR=${AR:-ar}
 
-mkdir -p build
-${CXX} $* src/main.cpp src/portable-memory-mapping/MemoryMapped.cpp -O3 -std=c++14 -mavx2 -maes -pthread -fstack-protector -fstack-protector-all -Wall -Wpedantic -Wextra -Werror -Weffc++ -Wswitch-default -Wstack-protector -Wpadded -Wno-unused-function -Wdisabled-optimization -o build/vsign
+FLAGS="-O3 -std=c++14 -mavx2 -maes -pthread -fPIC -fstack-protector -fstack-protector-all -Wall -Wpedantic -Wextra -Werror -Weffc++ -Wswitch-default -Wstack-protector -Wpadded -Wno-unused-function -Wdisabled-optimization"
+LIBRARY_SOURCES="src/vsign.cpp src/vsign_c.cpp src/pool.cpp src/tune.cpp src/watch.cpp src/cache.cpp src/key.cpp src/checkpoint.cpp src/throttle.cpp src/delta.cpp src/dedup.cpp src/bloom.cpp src/merge.cpp src/hashers.cpp src/portable-memory-mapping/MemoryMapped.cpp"
 
+mkdir -p build/obj
+OBJECTS=""
+for SOURCE in ${LIBRARY_SOURCES}; do
+  OBJECT=build/obj/$(basename ${SOURCE} .cpp).o
+  ${CXX} $* -Isrc -c ${SOURCE} ${FLAGS} -o ${OBJECT}
+  OBJECTS="${OBJECTS} ${OBJECT}"
+done
+
+rm -f build/libvsign.a
+${AR} rcs build/libvsign.a ${OBJECTS}
+${CXX} $* -shared ${OBJECTS} -pthread -o build/libvsign.so
+${CXX} $* -Isrc src/main.cpp build/libvsign.a ${FLAGS} -o build/vsign
@@ -0,0 +1,511 @@
+// Blocked Bloom filters over hashes of blocks.
+//
+// Every line of the filter is a cache line of 16 words of 32 bits. A hash
+// picks a line with its first eight bytes and sets one bit in every word of
+// it with all sixteen: each half of 64 bits of them is multiplied by eight
+// odd constants and the top five bits of the products say which bit. Both
+// are mixed first (see mix_bits), so CRC32C hashes spread as well as any.
+// A probe is one cache line read and two AVX2 tests, and with the line in
+// hand it costs about as much as a plain lookup in a table of bits.
+
+#include <algorithm>
+#include <bitset>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <immintrin.h>
+#include <mutex>
+#include <vector>
+
+#include "vsign_internal.h"
+
+namespace vsign {
+
+namespace {
+
+// Lines are split into stripes, each filled by one thread at a time
+constexpr uint64_t STRIPE_COUNT = 1024;
+// Hashes read in one round, and by one step of sorting them into stripes
+constexpr uint64_t ROUND_HASHES = 1ull << 20;
+constexpr uint64_t SLICE_HASHES = 1ull << 16;
+// Hashes between a prefetch of a line and the probe of it
+constexpr size_t PREFETCH_DISTANCE = 16;
+// Line indices are 32 bits
+constexpr uint64_t MAX_LINES = 1ull << 32;
+
+// Where a hash goes
+struct Probe {
+  uint64_t line;
+  uint64_t bits; // picks one bit of every word
+};
+
+Probe probe_of(const uint8_t *hash, uint64_t line_count) {
+  uint64_t low, high;
+  memcpy(&low, hash, sizeof(low));
+  memcpy(&high, hash + sizeof(low), sizeof(high));
+  const uint64_t key = mix_bits(low);
+  Probe probe;
+  probe.line = ((key >> 32) * line_count) >> 32;
+  // not a function of the line alone, even if high half is all zeros
+  probe.bits = mix_bits(high + low * 0x9e3779b97f4a7c15ull);
+  return probe;
+}
+
+// Bit of every word that `bits` sets, in words 0..7 and 8..15
+void line_masks(uint64_t bits, __m256i &low, __m256i &high) {
+  const __m256i salts_low =
+      _mm256_setr_epi32(0x47b6137b, 0x44974d91, static_cast<int>(0x8824ad5b),
+                        static_cast<int>(0xa2b7289d), 0x705495c7, 0x2df1424b,
+                        static_cast<int>(0x9efc4947), 0x5c6bfb31);
+  const __m256i salts_high =
+      _mm256_setr_epi32(static_cast<int>(0x9e3779b1), 0x7f4a7c15,
+                        static_cast<int>(0xf39cc061), 0x6a09e667,
+                        static_cast<int>(0xbb67ae85), 0x3c6ef373,
+                        static_cast<int>(0xa54ff53b), 0x510e527f);
+  const __m256i one = _mm256_set1_epi32(1);
+  const __m256i word_low = _mm256_set1_epi32(static_cast<int>(bits));
+  const __m256i word_high = _mm256_set1_epi32(static_cast<int>(bits >> 32));
+  low = _mm256_sllv_epi32(
+      one, _mm256_srli_epi32(_mm256_mullo_epi32(word_low, salts_low), 27));
+  high = _mm256_sllv_epi32(
+      one, _mm256_srli_epi32(_mm256_mullo_epi32(word_high, salts_high), 27));
+}
+
+void set_bits(uint8_t *line, uint64_t bits) {
+  __m256i low, high;
+  line_masks(bits, low, high);
+  __m256i *words = reinterpret_cast<__m256i *>(line);
+  _mm256_store_si256(words, _mm256_or_si256(_mm256_load_si256(words), low));
+  _mm256_store_si256(words + 1,
+                     _mm256_or_si256(_mm256_load_si256(words + 1), high));
+}
+
+bool has_bits(const uint8_t *line, uint64_t bits) {
+  __m256i low, high;
+  line_masks(bits, low, high);
+  const __m256i *words = reinterpret_cast<const __m256i *>(line);
+  return _mm256_testc_si256(_mm256_load_si256(words), low) &
+         _mm256_testc_si256(_mm256_load_si256(words + 1), high);
+}
+
+// Expected false positive rate of a filter with `load` hashes per line:
+// lines hold a Poisson distributed number of them, and a line holding i
+// hashes has a bit of a word set with chance 1 - (31/32)^i
+double expected_rate(double load) {
+  const uint64_t end = static_cast<uint64_t>(load + 12 * std::sqrt(load)) + 64;
+  double probability = std::exp(-load); // of a line holding i hashes
+  double rate = 0;
+  for (uint64_t i = 0; i <= end; ++i) {
+    if (i) {
+      probability *= load / static_cast<double>(i);
+    }
+    rate += probability *
+            std::pow(1 - std::pow(31.0 / 32, static_cast<double>(i)), 16);
+  }
+  return rate;
+}
+
+// Calls body for units [0, count), one unit per step
+class ForEach : public Task {
+public:
+  ForEach(uint64_t count, const std::function<void(uint64_t)> &body)
+      : count_(count), body_(body), error_mutex_(), error_() {}
+
+  bool step() override {
+    const uint64_t unit = next_++;
+    if (unit >= count_ || failed_.load()) {
+      return false;
+    }
+    try {
+      body_(unit);
+    } catch (const std::exception &error) {
+      std::lock_guard<std::mutex> lock(error_mutex_);
+      error_ = std::string("Sorry, something went wrong: ") + error.what();
+      failed_ = 1;
+      return false;
+    }
+    return true;
+  }
+
+  void complete() override {}
+
+  // Empty if every unit is done
+  std::string error() const {
+    std::lock_guard<std::mutex> lock(error_mutex_);
+    return error_;
+  }
+
+private:
+  const uint64_t count_;
+  std::function<void(uint64_t)> body_;
+  std::atomic<uint64_t> next_{0};
+  std::atomic<int> failed_{0};
+  int reserved_ = 0;
+  mutable std::mutex error_mutex_;
+  std::string error_;
+};
+
+bool same_signing(const BloomHeader &filter, const SignatureHeader &header) {
+  return filter.flags == header.flags &&
+         filter.algorithm == header.algorithm &&
+         filter.block_size == header.block_size &&
+         filter.chunk_size == tree_chunk_size(header) &&
+         filter.key_id == header.key_id;
+}
+
+// Signature header that blocks of a filter are signed like
+SignatureHeader signed_like(const BloomHeader &filter) {
+  SignatureHeader header{};
+  header.flags = filter.flags;
+  header.algorithm = filter.algorithm;
+  header.block_size = filter.block_size;
+  header.chunk_size = filter.chunk_size;
+  header.key_id = filter.key_id;
+  return header;
+}
+
+bool is_filter(const char *path) {
+  char magic[sizeof(BLOOM_MAGIC)] = {};
+  std::ifstream file(path, std::ios::binary);
+  return file.read(magic, sizeof(magic)) &&
+         !memcmp(magic, BLOOM_MAGIC, sizeof(magic));
+}
+
+} // namespace
+
+BloomFilter::BloomFilter() : header_(), memory_(), lines_(nullptr) {}
+
+void BloomFilter::allocate(uint64_t line_count) {
+  memory_.assign(line_count * BLOOM_LINE + BLOOM_LINE, 0);
+  const uintptr_t address = reinterpret_cast<uintptr_t>(memory_.data());
+  lines_ = memory_.data() + (BLOOM_LINE - 1) -
+           (address + BLOOM_LINE - 1) % BLOOM_LINE;
+  header_.line_count = line_count;
+}
+
+Status BloomFilter::create(const SignatureHeader &signed_like,
+                           uint64_t capacity, double false_positive_rate,
+                           std::string &error) {
+  if (!(false_positive_rate > 0 && false_positive_rate < 1)) {
+    error = "False positive rate must be between 0 and 1";
+    return Status::invalid_argument;
+  }
+  // the rate only grows with load, so bisect for the highest one that fits
+  double low = 0, high = 256;
+  for (int i = 0; i < 64; ++i) {
+    const double load = (low + high) / 2;
+    (expected_rate(load) <= false_positive_rate ? low : high) = load;
+  }
+  const double lines =
+      low > 0 ? std::ceil(static_cast<double>(capacity) / low) : 0;
+  if (!(lines < static_cast<double>(MAX_LINES))) {
+    error = "Filter for " + std::to_string(capacity) +
+            " hashes at this false positive rate would be too large";
+    return Status::invalid_argument;
+  }
+  header_ = BloomHeader();
+  memcpy(header_.magic, BLOOM_MAGIC, sizeof(BLOOM_MAGIC));
+  header_.version = BLOOM_VERSION;
+  header_.header_size = sizeof(BloomHeader);
+  header_.flags = signed_like.flags;
+  header_.algorithm = signed_like.algorithm;
+  header_.block_size = signed_like.block_size;
+  header_.chunk_size = tree_chunk_size(signed_like);
+  header_.key_id = signed_like.key_id;
+  try {
+    allocate(std::max<uint64_t>(static_cast<uint64_t>(lines), 1));
+  } catch (const std::bad_alloc &) {
+    error = "Not enough memory for filter of " +
+            std::to_string(static_cast<uint64_t>(lines) * BLOOM_LINE) +
+            " bytes";
+    return Status::invalid_argument;
+  }
+  return Status::ok;
+}
+
+Status BloomFilter::load(const char *path, std::string &error) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    error = std::string("Can't open filter ") + path + ": " + strerror(errno);
+    return Status::io_error;
+  }
+  BloomHeader header;
+  if (!file.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+      memcmp(header.magic, BLOOM_MAGIC, sizeof(BLOOM_MAGIC)) ||
+      header.version != BLOOM_VERSION ||
+      header.header_size != sizeof(header) ||
+      (header.flags & ~SIGNATURE_FLAG_TREE) || !header.block_size ||
+      !header.line_count || header.line_count >= MAX_LINES) {
+    error = std::string("File ") + path + " is not a valid filter";
+    return Status::invalid_argument;
+  }
+  try {
+    allocate(header.line_count);
+  } catch (const std::bad_alloc &) {
+    error = std::string("Not enough memory for filter ") + path;
+    return Status::invalid_argument;
+  }
+  header_ = header;
+  if (!file.read(reinterpret_cast<char *>(lines_),
+                 static_cast<std::streamsize>(header.line_count *
+                                              BLOOM_LINE)) ||
+      file.peek() != std::ifstream::traits_type::eof()) {
+    error = std::string("Filter ") + path + " is truncated or too long";
+    return Status::invalid_argument;
+  }
+  return Status::ok;
+}
+
+Status BloomFilter::save(const char *path, std::string &error) const {
+  const std::string temporary = std::string(path) + ".partial";
+  {
+    std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char *>(&header_), sizeof(header_));
+    file.write(reinterpret_cast<const char *>(lines_),
+               static_cast<std::streamsize>(header_.line_count * BLOOM_LINE));
+    file.flush();
+    if (!file) {
+      error = "Can't write " + temporary + ": " + strerror(errno);
+      file.close();
+      std::remove(temporary.c_str());
+      return Status::io_error;
+    }
+  }
+#ifdef _MSC_VER
+  std::remove(path);
+#endif
+  if (std::rename(temporary.c_str(), path) != 0) {
+    error = "Can't rename " + temporary + " to " + path + ": " +
+            strerror(errno);
+    std::remove(temporary.c_str());
+    return Status::io_error;
+  }
+  return Status::ok;
+}
+
+void BloomFilter::add(const uint8_t *hashes, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    const Probe probe = probe_of(hashes + i * HASH_SIZE, header_.line_count);
+    set_bits(lines_ + probe.line * BLOOM_LINE, probe.bits);
+  }
+  header_.hash_count += count;
+}
+
+bool BloomFilter::contains(const uint8_t *hash) const {
+  const Probe probe = probe_of(hash, header_.line_count);
+  return has_bits(lines_ + probe.line * BLOOM_LINE, probe.bits);
+}
+
+size_t BloomFilter::contains(const uint8_t *hashes, size_t count,
+                             uint8_t *found) const {
+  size_t result = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (i + PREFETCH_DISTANCE < count) {
+      const Probe ahead = probe_of(hashes + (i + PREFETCH_DISTANCE) * HASH_SIZE,
+                                   header_.line_count);
+      _mm_prefetch(reinterpret_cast<const char *>(lines_) +
+                       ahead.line * BLOOM_LINE,
+                   _MM_HINT_T0);
+    }
+    const Probe probe = probe_of(hashes + i * HASH_SIZE, header_.line_count);
+    found[i] = has_bits(lines_ + probe.line * BLOOM_LINE, probe.bits);
+    result += found[i];
+  }
+  return result;
+}
+
+Status BloomFilter::merge(const BloomFilter &other, std::string &error) {
+  const BloomHeader &theirs = other.header_;
+  if (!same_signing(header_, signed_like(theirs))) {
+    error = "Filters are made of blocks signed in different ways";
+    return Status::invalid_argument;
+  }
+  if (theirs.line_count != header_.line_count) {
+    error = "Filters of different sizes can't be merged";
+    return Status::invalid_argument;
+  }
+  __m256i *words = reinterpret_cast<__m256i *>(lines_);
+  const __m256i *their_words = reinterpret_cast<const __m256i *>(other.lines_);
+  for (uint64_t i = 0; i < header_.line_count * 2; ++i) {
+    _mm256_store_si256(words + i,
+                       _mm256_or_si256(_mm256_load_si256(words + i),
+                                       _mm256_load_si256(their_words + i)));
+  }
+  header_.hash_count += theirs.hash_count;
+  return Status::ok;
+}
+
+double BloomFilter::false_positive_rate() const {
+  double rate = 0;
+  for (uint64_t line = 0; line < header_.line_count; ++line) {
+    uint32_t words[BLOOM_LINE / sizeof(uint32_t)];
+    memcpy(words, lines_ + line * BLOOM_LINE, BLOOM_LINE);
+    double chance = 1;
+    for (const uint32_t word : words) {
+      chance *= static_cast<double>(std::bitset<32>(word).count()) / 32;
+    }
+    rate += chance;
+  }
+  return header_.line_count ? rate / static_cast<double>(header_.line_count)
+                            : 0;
+}
+
+Status build_bloom_filter(const char *const *files, size_t count,
+                          const Options &options, const BloomOptions &bloom,
+                          BloomFilter &filter, std::string &error) {
+  if (!count) {
+    error = "No signatures or filters to build a filter of";
+    return Status::invalid_argument;
+  }
+  // the filter is sized once all headers are known
+  std::vector<int> filters(count);
+  SignatureHeader first{};
+  uint64_t hashes = 0;
+  int sized = 0;
+  for (size_t index = 0; index < count; ++index) {
+    const char *path = files[index];
+    SignatureHeader header{};
+    filters[index] = is_filter(path);
+    if (filters[index]) {
+      BloomFilter other;
+      const Status status = other.load(path, error);
+      if (status != Status::ok) {
+        return status;
+      }
+      header = signed_like(other.header());
+      if (!sized) {
+        filter.header_ = other.header();
+        filter.header_.hash_count = 0;
+        sized = 1;
+      }
+    } else if (!read_signature_header(path, header)) {
+      error = std::string("Signature ") + path + " has no header";
+      return Status::invalid_argument;
+    } else {
+      hashes += block_count(header.file_size, header.block_size);
+    }
+    if (!index) {
+      first = header;
+    } else if (header.flags != first.flags ||
+               header.algorithm != first.algorithm ||
+               header.block_size != first.block_size ||
+               tree_chunk_size(header) != tree_chunk_size(first) ||
+               header.key_id != first.key_id) {
+      error = std::string(path) + " is made of blocks signed in another " +
+              "way (block size, algorithm, mode or key) than " + files[0];
+      return Status::invalid_argument;
+    }
+  }
+  Status status = Status::ok;
+  if (sized) {
+    const BloomHeader header = filter.header_;
+    try {
+      filter.allocate(header.line_count);
+    } catch (const std::bad_alloc &) {
+      error = "Not enough memory for filter";
+      return Status::invalid_argument;
+    }
+    filter.header_ = header;
+  } else {
+    status = filter.create(first, bloom.capacity ? bloom.capacity : hashes,
+                           bloom.false_positive_rate, error);
+    if (status != Status::ok) {
+      return status;
+    }
+  }
+
+  const Options resolved = resolve_options(options);
+  ThreadPool pool(resolved.threads - 1, resolved.verbose);
+  const uint64_t line_count = filter.header_.line_count;
+  uint8_t *const lines = filter.lines_;
+  // hashes of a round sorted by stripe, [slice * STRIPE_COUNT + stripe]
+  std::vector<std::vector<Probe>> buckets;
+  std::vector<std::pair<const uint8_t *, uint64_t>> slices;
+  std::vector<std::shared_ptr<Source>> round; // mapped until it's done
+  uint64_t round_hashes = 0;
+  auto run = [&](uint64_t units, const std::function<void(uint64_t)> &body) {
+    const std::shared_ptr<ForEach> task =
+        std::make_shared<ForEach>(units, body);
+    pool.run(task);
+    error = task->error();
+    return error.empty() ? Status::ok : Status::internal_error;
+  };
+  auto flush_round = [&]() {
+    if (buckets.size() < slices.size() * STRIPE_COUNT) {
+      buckets.resize(slices.size() * STRIPE_COUNT);
+    }
+    Status result = run(slices.size(), [&](uint64_t index) {
+      const uint8_t *slice = slices[index].first;
+      std::vector<Probe> *bucket = &buckets[index * STRIPE_COUNT];
+      for (uint64_t i = 0; i < slices[index].second; ++i) {
+        const Probe probe = probe_of(slice + i * HASH_SIZE, line_count);
+        bucket[probe.line * STRIPE_COUNT / line_count].push_back(probe);
+      }
+    });
+    if (result == Status::ok) {
+      result = run(STRIPE_COUNT, [&](uint64_t stripe) {
+        for (size_t index = 0; index < slices.size(); ++index) {
+          std::vector<Probe> &bucket = buckets[index * STRIPE_COUNT + stripe];
+          for (const Probe &probe : bucket) {
+            set_bits(lines + probe.line * BLOOM_LINE, probe.bits);
+          }
+          bucket.clear();
+        }
+      });
+    }
+    round.clear();
+    slices.clear();
+    round_hashes = 0;
+    return result;
+  };
+
+  for (size_t index = 0; index < count && status == Status::ok; ++index) {
+    const char *path = files[index];
+    if (filters[index]) {
+      BloomFilter other;
+      status = other.load(path, error);
+      if (status == Status::ok) {
+        status = filter.merge(other, error);
+      }
+      continue;
+    }
+    std::shared_ptr<Source> source(new Source());
+    SignatureHeader header;
+    status = source->open(path, Engine::mmap, 0, error);
+    if (status != Status::ok) {
+      break;
+    }
+    if (!parse_signature_header(source->memory(), source->size(), header) ||
+        (source->size() - header.header_size) / HASH_SIZE <
+            block_count(header.file_size, header.block_size)) {
+      error = std::string("Signature ") + path + " is truncated";
+      status = Status::invalid_argument;
+      break;
+    }
+    const uint64_t blocks = block_count(header.file_size, header.block_size);
+    const uint8_t *memory = source->memory() + header.header_size;
+    round.push_back(source);
+    for (uint64_t done = 0; done < blocks && status == Status::ok;) {
+      const uint64_t size = std::min(
+          {SLICE_HASHES, blocks - done, ROUND_HASHES - round_hashes});
+      slices.emplace_back(memory + done * HASH_SIZE, size);
+      done += size;
+      round_hashes += size;
+      filter.header_.hash_count += size;
+      if (round_hashes == ROUND_HASHES) {
+        status = flush_round();
+        if (done < blocks) {
+          round.push_back(source);
+        }
+      }
+    }
+  }
+  if (status == Status::ok) {
+    status = flush_round();
+  }
+  return status;
+}
+
+} // namespace vsign
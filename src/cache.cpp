@@ -0,0 +1,292 @@
+// Database of signed files, to skip unchanged ones. Not available on
+// Windows.
+//
+// One memory-mapped file: a header and an open addressing hash table of
+// fixed size entries keyed by device and inode of the input and the path of
+// its signature (one input may have several). Processes take flock() on
+// it for every operation; the table only grows, and whoever sees the file
+// grown maps it again.
+
+#include <cstring>
+#include <vector>
+
+#ifndef _MSC_VER
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "vsign_internal.h"
+
+namespace vsign {
+
+#ifndef _MSC_VER
+
+namespace {
+
+struct CacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t entry_size;
+  uint64_t capacity; // entries, power of two
+  uint64_t count;
+  uint64_t reserved[4];
+};
+
+constexpr char CACHE_MAGIC[8] = {'V', 'S', 'I', 'G', 'N', 'D', 'B', '\n'};
+constexpr uint32_t CACHE_VERSION = 3;
+constexpr uint64_t INITIAL_CAPACITY = 1024;
+
+} // namespace
+
+static uint64_t mix(uint64_t value) {
+  // splitmix64 finalizer
+  value ^= value >> 30;
+  value *= 0xbf58476d1ce4e5b9ull;
+  value ^= value >> 27;
+  value *= 0x94d049bb133111ebull;
+  return value ^ (value >> 31);
+}
+
+// FNV-1a, never 0 as that marks free slots
+static uint64_t path_hash(const char *path) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (; *path; ++path) {
+    hash = (hash ^ static_cast<uint8_t>(*path)) * 0x100000001b3ull;
+  }
+  return hash | 1;
+}
+
+static uint64_t table_size(uint64_t capacity) {
+  return sizeof(CacheHeader) + capacity * sizeof(SignatureCache::Entry);
+}
+
+SignatureCache::SignatureCache() {}
+
+SignatureCache::~SignatureCache() {
+  if (memory_) {
+    ::munmap(memory_, mapped_size_);
+  }
+  if (file_ != -1) {
+    ::close(file_);
+  }
+}
+
+Status SignatureCache::open(const std::string &path, std::string &error) {
+  const size_t slash = path.rfind('/');
+  if (slash != std::string::npos && slash > 0) {
+    make_directories(path.substr(0, slash));
+  }
+  file_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (file_ == -1 || !lock(LOCK_EX)) {
+    error = "Can't open signature cache " + path + ": " + strerror(errno);
+    return Status::io_error;
+  }
+  const CacheHeader *header = reinterpret_cast<const CacheHeader *>(memory_);
+  if (!memory_ || memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) ||
+      header->version != CACHE_VERSION ||
+      header->entry_size != sizeof(Entry)) {
+    // new, or written by another version: start over
+    CacheHeader empty{};
+    memcpy(empty.magic, CACHE_MAGIC, sizeof(empty.magic));
+    empty.version = CACHE_VERSION;
+    empty.entry_size = sizeof(Entry);
+    empty.capacity = INITIAL_CAPACITY;
+    if (::ftruncate(file_, 0) != 0 ||
+        ::ftruncate(file_, static_cast<off_t>(table_size(empty.capacity))) !=
+            0 ||
+        ::pwrite(file_, &empty, sizeof(empty), 0) !=
+            static_cast<ssize_t>(sizeof(empty)) ||
+        !map()) {
+      error = "Can't initialize signature cache " + path + ": " +
+              strerror(errno);
+      unlock();
+      return Status::io_error;
+    }
+  }
+  unlock();
+  return Status::ok;
+}
+
+// Maps the whole file again if another process has grown it
+bool SignatureCache::map() {
+  struct stat info;
+  if (::fstat(file_, &info) != 0) {
+    return false;
+  }
+  const uint64_t size = static_cast<uint64_t>(info.st_size);
+  if (size == mapped_size_ && memory_) {
+    return true;
+  }
+  if (memory_) {
+    ::munmap(memory_, mapped_size_);
+    memory_ = nullptr;
+    mapped_size_ = 0;
+  }
+  if (size < sizeof(CacheHeader)) {
+    return true; // not initialized yet
+  }
+  void *memory =
+      ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file_, 0);
+  if (memory == MAP_FAILED) {
+    return false;
+  }
+  memory_ = static_cast<uint8_t *>(memory);
+  mapped_size_ = size;
+  return true;
+}
+
+bool SignatureCache::lock(int operation) {
+  while (::flock(file_, operation) != 0) {
+    if (errno != EINTR) {
+      return false;
+    }
+  }
+  if (!map()) {
+    unlock();
+    return false;
+  }
+  return true;
+}
+
+void SignatureCache::unlock() { ::flock(file_, LOCK_UN); }
+
+// Slot of the file and signature, or the free one where they would go
+SignatureCache::Entry *SignatureCache::slot(const Entry &entry) {
+  const CacheHeader *header = reinterpret_cast<const CacheHeader *>(memory_);
+  if (!memory_ || mapped_size_ < table_size(header->capacity)) {
+    return nullptr;
+  }
+  Entry *entries = reinterpret_cast<Entry *>(memory_ + sizeof(CacheHeader));
+  const uint64_t mask = header->capacity - 1;
+  const uint64_t key =
+      mix((entry.file.device * 31 + entry.file.inode) ^ entry.signature);
+  for (uint64_t index = key & mask;; index = (index + 1) & mask) {
+    Entry &candidate = entries[index];
+    if (!candidate.signature || (candidate.file.device == entry.file.device &&
+                                 candidate.file.inode == entry.file.inode &&
+                                 candidate.signature == entry.signature)) {
+      return &candidate;
+    }
+  }
+}
+
+bool SignatureCache::find(const Entry &entry) {
+  if (file_ == -1 || !lock(LOCK_SH)) {
+    return false;
+  }
+  const Entry *found = slot(entry);
+  const bool same =
+      found && found->signature &&
+      found->file.size == entry.file.size &&
+      found->file.mtime_ns == entry.file.mtime_ns &&
+      found->file.ctime_ns == entry.file.ctime_ns &&
+      found->block_size == entry.block_size &&
+      found->key_id == entry.key_id && found->version == entry.version &&
+      found->algorithm == entry.algorithm &&
+      found->chunk_size == entry.chunk_size &&
+      found->output.device == entry.output.device &&
+      found->output.inode == entry.output.inode &&
+      found->output.size == entry.output.size &&
+      found->output.mtime_ns == entry.output.mtime_ns &&
+      found->output.ctime_ns == entry.output.ctime_ns;
+  unlock();
+  return same;
+}
+
+// Doubles the table, rehashing every entry
+bool SignatureCache::grow() {
+  CacheHeader *header = reinterpret_cast<CacheHeader *>(memory_);
+  const Entry *entries =
+      reinterpret_cast<const Entry *>(memory_ + sizeof(CacheHeader));
+  std::vector<Entry> used;
+  used.reserve(header->count);
+  for (uint64_t index = 0; index < header->capacity; ++index) {
+    if (entries[index].signature) {
+      used.push_back(entries[index]);
+    }
+  }
+  const uint64_t capacity = header->capacity * 2;
+  if (::ftruncate(file_, static_cast<off_t>(table_size(capacity))) != 0 ||
+      !map()) {
+    return false;
+  }
+  header = reinterpret_cast<CacheHeader *>(memory_);
+  header->capacity = capacity;
+  memset(memory_ + sizeof(CacheHeader), 0, capacity * sizeof(Entry));
+  for (const Entry &entry : used) {
+    *slot(entry) = entry;
+  }
+  return true;
+}
+
+void SignatureCache::store(const Entry &entry) {
+  if (file_ == -1 || !lock(LOCK_EX)) {
+    return;
+  }
+  CacheHeader *header = reinterpret_cast<CacheHeader *>(memory_);
+  Entry *found = slot(entry);
+  if (found && !found->signature &&
+      (header->count + 1) * 4 > header->capacity * 3) {
+    found = grow() ? slot(entry) : nullptr;
+    header = reinterpret_cast<CacheHeader *>(memory_);
+  }
+  if (found) {
+    if (!found->signature) {
+      ++header->count;
+    }
+    *found = entry;
+  }
+  unlock();
+}
+
+bool SignatureCache::make_entry(const FileIdentity &input, const char *output,
+                                uint64_t block_size, uint64_t chunk_size,
+                                uint64_t key_id, Algorithm algorithm,
+                                Entry &entry) {
+  char signature[PATH_MAX];
+  // writes to block devices don't touch their times, only files can be
+  // trusted to be unchanged
+  if (!S_ISREG(input.type) || !::realpath(output, signature) ||
+      !file_identity(signature, entry.output) ||
+      !S_ISREG(entry.output.type)) {
+    return false;
+  }
+  entry.file = input;
+  entry.block_size = block_size;
+  entry.signature = path_hash(signature);
+  entry.key_id = key_id;
+  entry.version = SIGNATURE_VERSION;
+  entry.algorithm = static_cast<uint32_t>(algorithm);
+  entry.chunk_size = chunk_size;
+  return true;
+}
+
+#else
+
+SignatureCache::SignatureCache() {}
+
+SignatureCache::~SignatureCache() {}
+
+Status SignatureCache::open(const std::string &, std::string &error) {
+  error = "Signature cache is not supported on Windows";
+  return Status::invalid_argument;
+}
+
+bool SignatureCache::find(const Entry &) { return false; }
+
+void SignatureCache::store(const Entry &) {}
+
+bool SignatureCache::make_entry(const FileIdentity &, const char *, uint64_t,
+                                uint64_t, uint64_t, Algorithm, Entry &) {
+  return false;
+}
+
+#endif
+
+} // namespace vsign
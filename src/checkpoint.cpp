@@ -0,0 +1,200 @@
+// Checkpoints of signing into files. Not available on Windows.
+//
+// OUTPUT.checkpoint is a Record followed by a bitmap of hashed blocks, bit
+// N % 64 of word N / 64 for block N. It's saved only after the hashes it
+// marks are flushed, into a temporary file that is renamed over the old
+// one, so it never claims more than what is on disk.
+
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#ifndef _MSC_VER
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "vsign_internal.h"
+
+namespace vsign {
+
+Checkpoint::Checkpoint()
+    : path_(), record_(), bits_(), save_mutex_() {}
+
+#ifndef _MSC_VER
+
+namespace {
+
+constexpr char CHECKPOINT_MAGIC[8] = {'V', 'S', 'I', 'G', 'N', 'C', 'P', '\n'};
+constexpr uint32_t CHECKPOINT_VERSION = 1;
+
+} // namespace
+
+static int64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static uint64_t bitmap_words(uint64_t block_count) {
+  return (block_count + 63) / 64;
+}
+
+static bool write_fully(int file, const void *data, uint64_t size) {
+  const char *memory = static_cast<const char *>(data);
+  while (size) {
+    const ssize_t written = ::write(file, memory, size);
+    if (written <= 0) {
+      return false;
+    }
+    memory += written;
+    size -= static_cast<uint64_t>(written);
+  }
+  return true;
+}
+
+bool Checkpoint::open(const char *output, const FileIdentity &input,
+                      uint64_t block_size, uint64_t chunk_size,
+                      uint64_t key_id, Algorithm algorithm,
+                      uint64_t block_count, unsigned interval, bool resume) {
+  path_ = std::string(output) + ".checkpoint";
+  memcpy(record_.magic, CHECKPOINT_MAGIC, sizeof(record_.magic));
+  record_.version = CHECKPOINT_VERSION;
+  record_.record_size = sizeof(record_);
+  record_.input = input;
+  record_.block_size = block_size;
+  record_.chunk_size = chunk_size;
+  record_.key_id = key_id;
+  record_.algorithm = static_cast<uint32_t>(algorithm);
+  record_.block_count = block_count;
+  const uint64_t words = bitmap_words(block_count);
+  bits_.reset(new (std::nothrow) std::atomic<uint64_t>[words]());
+  if (!bits_) {
+    return false; // signing still works without checkpoints
+  }
+  interval_ = static_cast<int64_t>(interval) * 1000000000;
+  next_save_ = interval ? now_ns() + interval_ : INT64_MAX;
+  // writes to block devices don't change their times, old hashes of them
+  // can't be trusted
+  if (!resume || !S_ISREG(input.type)) {
+    return false;
+  }
+
+  std::ifstream file(path_, std::ios::binary);
+  Record saved;
+  if (!file.read(reinterpret_cast<char *>(&saved), sizeof(saved)) ||
+      memcmp(saved.magic, record_.magic, sizeof(saved.magic)) ||
+      saved.version != record_.version ||
+      saved.record_size != record_.record_size ||
+      saved.input.device != input.device || saved.input.inode != input.inode ||
+      saved.input.size != input.size ||
+      saved.input.mtime_ns != input.mtime_ns ||
+      saved.input.type != input.type || saved.block_size != block_size ||
+      saved.chunk_size != chunk_size || saved.key_id != key_id ||
+      saved.algorithm != record_.algorithm ||
+      saved.block_count != block_count) {
+    return false;
+  }
+  // hashes are in the output, it must be the one that was written to
+  struct stat info;
+  if (::stat(output, &info) != 0 ||
+      static_cast<uint64_t>(info.st_size) !=
+          sizeof(SignatureHeader) + block_count * HASH_SIZE) {
+    return false;
+  }
+  std::vector<uint64_t> bits(words);
+  if (!file.read(reinterpret_cast<char *>(bits.data()),
+                 static_cast<std::streamsize>(words * sizeof(uint64_t)))) {
+    return false;
+  }
+  for (uint64_t word = 0; word < words; ++word) {
+    bits_[word] = bits[word];
+  }
+  return true;
+}
+
+bool Checkpoint::done(uint64_t first, uint64_t end) const {
+  if (!bits_) {
+    return false;
+  }
+  for (uint64_t block = first; block < end; ++block) {
+    if (!(bits_[block / 64].load(std::memory_order_relaxed) &
+          (1ull << (block % 64)))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void Checkpoint::mark(uint64_t first, uint64_t end, SignatureWriter &writer) {
+  if (!bits_) {
+    return;
+  }
+  // hashes are stored before their bits, save() sees both or neither
+  for (uint64_t block = first; block < end; ++block) {
+    bits_[block / 64].fetch_or(1ull << (block % 64),
+                               std::memory_order_release);
+  }
+  const int64_t now = now_ns();
+  int64_t due = next_save_.load(std::memory_order_relaxed);
+  // one thread saves, the others keep hashing
+  if (now >= due && next_save_.compare_exchange_strong(due, now + interval_)) {
+    save(writer);
+  }
+}
+
+void Checkpoint::save(SignatureWriter &writer) {
+  if (!bits_) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(save_mutex_);
+  const uint64_t words = bitmap_words(record_.block_count);
+  std::vector<uint64_t> bits(words);
+  for (uint64_t word = 0; word < words; ++word) {
+    bits[word] = bits_[word].load(std::memory_order_acquire);
+  }
+  if (!writer.flush()) {
+    return;
+  }
+  const std::string temporary = path_ + "." + std::to_string(::getpid());
+  const int file =
+      ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (file == -1) {
+    return;
+  }
+  const bool written =
+      write_fully(file, &record_, sizeof(record_)) &&
+      write_fully(file, bits.data(), words * sizeof(uint64_t)) &&
+      ::fdatasync(file) == 0;
+  ::close(file);
+  if (!written || ::rename(temporary.c_str(), path_.c_str()) != 0) {
+    ::unlink(temporary.c_str());
+  }
+}
+
+void Checkpoint::remove() {
+  if (!path_.empty()) {
+    ::unlink(path_.c_str());
+  }
+}
+
+#else
+
+bool Checkpoint::open(const char *, const FileIdentity &, uint64_t, uint64_t,
+                      uint64_t, Algorithm, uint64_t, unsigned, bool) {
+  return false;
+}
+
+bool Checkpoint::done(uint64_t, uint64_t) const { return false; }
+
+void Checkpoint::mark(uint64_t, uint64_t, SignatureWriter &) {}
+
+void Checkpoint::save(SignatureWriter &) {}
+
+void Checkpoint::remove() {}
+
+#endif
+
+} // namespace vsign
@@ -0,0 +1,624 @@
+// Duplicate blocks across signature files. Not available on Windows.
+//
+// Hashes go into an open addressing table split into shards by their top
+// bits. The first bytes of hashes, mixed, pick the shard and the slot.
+// Signatures are read in rounds: threads first sort hashes of a
+// round by shard, then every shard is filled by one thread, so shards need
+// no locks. A shard that can't grow within the memory budget is spilled:
+// its entries and every later hash of it go to an unlinked temporary file.
+// Spilled shards are aggregated at the end one after another, each in a
+// table charged to the budget; a file whose entries wouldn't fit is split
+// again by the next bits of their keys, until the pieces do.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#ifndef _MSC_VER
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "vsign_internal.h"
+
+namespace vsign {
+
+#ifndef _MSC_VER
+
+namespace {
+
+constexpr unsigned SHARD_BITS = 10;
+constexpr uint64_t SHARD_COUNT = 1ull << SHARD_BITS;
+// Hashes read in one round, and by one step of sorting them into shards
+constexpr uint64_t ROUND_HASHES = 1ull << 20;
+constexpr uint64_t SLICE_HASHES = 1ull << 16;
+constexpr uint64_t INITIAL_CAPACITY = 64; // entries of a shard's table
+// Entries of a spilled shard written at once
+constexpr uint64_t SPILL_BUFFER = 4096;
+// A spill file too large for the budget is split into at most 2^PIECE_BITS
+// pieces at once, written PIECE_BUFFER entries at a time
+constexpr unsigned PIECE_BITS = 8;
+constexpr uint64_t PIECE_BUFFER = 256;
+
+// Distinct block, or occurrences of it
+struct Entry {
+  uint8_t hash[HASH_SIZE];
+  uint64_t size;  // bytes of the block
+  uint64_t count; // 0 = free slot
+};
+
+uint64_t hash_key(const uint8_t *hash) {
+  uint64_t key;
+  memcpy(&key, hash, sizeof(key));
+  return mix_bits(key);
+}
+
+uint64_t saved_bytes(const Entry &entry) {
+  return (entry.count - 1) * entry.size;
+}
+
+bool more_saved(const Entry &left, const Entry &right) {
+  return saved_bytes(left) > saved_bytes(right);
+}
+
+// Shared by all shards of one run
+struct Budget {
+  Budget() : spill_directory(), mutex(), error() {}
+
+  uint64_t limit = 0; // bytes of all tables
+  std::atomic<uint64_t> used{0};
+  std::string spill_directory;
+  std::mutex mutex; // of what follows
+  Status status = Status::ok;
+  int reserved = 0;
+  std::string error;
+
+  void fail(Status failure, const std::string &message) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (status == Status::ok) {
+      status = failure;
+      error = message;
+    }
+  }
+};
+
+// Temporary file of spilled entries, deleted once closed, or -1
+int create_spill_file(Budget &budget) {
+  std::string path = budget.spill_directory + "/vsign-dedup-XXXXXX";
+  const int file = ::mkstemp(&path[0]);
+  if (file == -1) {
+    // hashes that would go there are dropped, but the run fails anyway
+    budget.fail(Status::io_error, "Can't create " + path + ": " +
+                                      strerror(errno));
+  } else {
+    ::unlink(path.c_str());
+  }
+  return file;
+}
+
+// Appends buffered entries to a spill file, and empties the buffer
+void write_entries(int file, std::vector<Entry> &buffer, Budget &budget) {
+  const char *data = reinterpret_cast<const char *>(buffer.data());
+  uint64_t size = file != -1 ? buffer.size() * sizeof(Entry) : 0;
+  while (size) {
+    const ssize_t written = ::write(file, data, size);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      budget.fail(Status::io_error, std::string("Can't spill hashes to ") +
+                                        budget.spill_directory + ": " +
+                                        strerror(errno));
+      break;
+    }
+    data += written;
+    size -= static_cast<uint64_t>(written);
+  }
+  buffer.clear();
+}
+
+// Calls use for every entry of a spill file
+template <typename Use>
+void read_entries(int file, Budget &budget, Use use) {
+  std::vector<Entry> buffer(SPILL_BUFFER);
+  for (uint64_t offset = 0;;) {
+    const ssize_t bytes =
+        ::pread(file, buffer.data(), buffer.size() * sizeof(Entry),
+                static_cast<off_t>(offset));
+    if (bytes < 0 && errno == EINTR) {
+      continue;
+    }
+    if (bytes < 0) {
+      budget.fail(Status::io_error,
+                  std::string("Can't read spilled hashes: ") +
+                      strerror(errno));
+      return;
+    }
+    if (!bytes) {
+      return;
+    }
+    offset += static_cast<uint64_t>(bytes);
+    for (size_t i = 0; i < static_cast<size_t>(bytes) / sizeof(Entry); ++i) {
+      use(buffer[i]);
+    }
+  }
+}
+
+// Part of the table, only touched by one thread at a time
+class Shard {
+public:
+  Shard() : table_(), spill_buffer_() {}
+  ~Shard() {
+    if (spill_file_ != -1) {
+      ::close(spill_file_);
+    }
+  }
+  Shard(const Shard &) = delete;
+  Shard &operator=(const Shard &) = delete;
+
+  void add(const Entry &entry, Budget &budget) {
+    if (spilled_) {
+      spill_buffer_.push_back(entry);
+      if (spill_buffer_.size() >= SPILL_BUFFER) {
+        flush(budget);
+      }
+      return;
+    }
+    if ((used_ + 1) * 4 > table_.size() * 3 && !grow(budget)) {
+      spill(budget);
+      add(entry, budget);
+      return;
+    }
+    insert(entry);
+  }
+
+  // Counts what's in the table, or aggregates what is spilled
+  void finish(Budget &budget, uint64_t top, DedupReport &report,
+              std::vector<Entry> &largest) {
+    if (spilled_) {
+      flush(budget);
+      std::vector<Entry>().swap(spill_buffer_);
+      aggregate(spill_file_, SHARD_BITS, budget, top, report, largest);
+      ++report.spilled_shards;
+      return;
+    }
+    for (const Entry &entry : table_) {
+      if (!entry.count) {
+        continue;
+      }
+      ++report.unique_blocks;
+      report.duplicate_blocks += entry.count - 1;
+      report.duplicate_bytes += saved_bytes(entry);
+      if (entry.count > 1 && top) {
+        largest.push_back(entry);
+        std::push_heap(largest.begin(), largest.end(), more_saved);
+        if (largest.size() > top) {
+          std::pop_heap(largest.begin(), largest.end(), more_saved);
+          largest.pop_back();
+        }
+      }
+    }
+    budget.used -= charged_;
+    charged_ = 0;
+    std::vector<Entry>().swap(table_);
+  }
+
+  bool spilled() const { return spilled_; }
+
+private:
+  void insert(const Entry &entry) {
+    const uint64_t mask = table_.size() - 1;
+    for (uint64_t slot = hash_key(entry.hash) & mask;;
+         slot = (slot + 1) & mask) {
+      Entry &existing = table_[slot];
+      if (!existing.count) {
+        existing = entry;
+        ++used_;
+        return;
+      }
+      if (!memcmp(existing.hash, entry.hash, HASH_SIZE)) {
+        existing.count += entry.count;
+        return;
+      }
+    }
+  }
+
+  void rehash(uint64_t capacity) {
+    std::vector<Entry> old(capacity);
+    old.swap(table_);
+    used_ = 0;
+    for (const Entry &entry : old) {
+      if (entry.count) {
+        insert(entry);
+      }
+    }
+  }
+
+  // Doubles the table if the budget allows it
+  bool grow(Budget &budget) {
+    const uint64_t capacity =
+        table_.empty() ? INITIAL_CAPACITY : table_.size() * 2;
+    const uint64_t added = (capacity - table_.size()) * sizeof(Entry);
+    if (budget.used.fetch_add(added) + added > budget.limit) {
+      budget.used -= added;
+      return false;
+    }
+    charged_ += added;
+    rehash(capacity);
+    return true;
+  }
+
+  // Table goes to a temporary file, and so will the rest of the shard
+  void spill(Budget &budget) {
+    spilled_ = 1;
+    spill_file_ = create_spill_file(budget);
+    for (const Entry &entry : table_) {
+      if (entry.count) {
+        spill_buffer_.push_back(entry);
+      }
+    }
+    budget.used -= charged_;
+    charged_ = 0;
+    std::vector<Entry>().swap(table_);
+    used_ = 0;
+    flush(budget);
+  }
+
+  void flush(Budget &budget) {
+    write_entries(spill_file_, spill_buffer_, budget);
+  }
+
+  // Counts the entries of a spilled file in a table that fits the budget,
+  // or else splits them by the next bits of their keys into pieces that
+  // are counted one after another. Bits before are the same for all.
+  static void aggregate(int file, unsigned same_bits, Budget &budget,
+                        uint64_t top, DedupReport &report,
+                        std::vector<Entry> &largest) {
+    struct stat status;
+    if (file == -1 || ::fstat(file, &status)) {
+      return; // the run has failed already, or fails now
+    }
+    const uint64_t entries = static_cast<uint64_t>(status.st_size) /
+                             sizeof(Entry);
+    if (!entries) {
+      return;
+    }
+    uint64_t capacity = INITIAL_CAPACITY;
+    while (entries * 4 > capacity * 3) {
+      capacity *= 2;
+    }
+    const uint64_t bytes = capacity * sizeof(Entry);
+    const uint64_t used = budget.used;
+    const uint64_t available = budget.limit > used ? budget.limit - used : 0;
+    if (bytes > available && entries > SPILL_BUFFER && same_bits < 64) {
+      split(file, same_bits, bytes, available, budget, top, report, largest);
+      return;
+    }
+
+    // over the budget only if the hashes have too few bits left to split
+    // them, or it's small anyway
+    Shard piece;
+    budget.used += bytes;
+    piece.charged_ = bytes;
+    piece.table_.assign(capacity, Entry());
+    read_entries(file, budget,
+                 [&piece](const Entry &entry) { piece.insert(entry); });
+    piece.finish(budget, top, report, largest);
+  }
+
+  static void split(int file, unsigned same_bits, uint64_t bytes,
+                    uint64_t available, Budget &budget, uint64_t top,
+                    DedupReport &report, std::vector<Entry> &largest) {
+    unsigned bits = 1;
+    while (bits < PIECE_BITS && bits < 64 - same_bits &&
+           bytes >> bits > available) {
+      ++bits;
+    }
+    std::vector<int> files(1ull << bits, -1);
+    std::vector<std::vector<Entry>> buffers(files.size());
+    for (int &piece : files) {
+      piece = create_spill_file(budget);
+    }
+    read_entries(file, budget, [&](const Entry &entry) {
+      const uint64_t piece = (hash_key(entry.hash) << same_bits) >> (64 - bits);
+      buffers[piece].push_back(entry);
+      if (buffers[piece].size() >= PIECE_BUFFER) {
+        write_entries(files[piece], buffers[piece], budget);
+      }
+    });
+    for (size_t piece = 0; piece < files.size(); ++piece) {
+      write_entries(files[piece], buffers[piece], budget);
+    }
+    std::vector<std::vector<Entry>>().swap(buffers);
+    for (int piece : files) {
+      if (budget.status == Status::ok) {
+        aggregate(piece, same_bits + bits, budget, top, report, largest);
+      }
+      if (piece != -1) {
+        ::close(piece);
+      }
+    }
+  }
+
+  std::vector<Entry> table_; // capacity is a power of two
+  std::vector<Entry> spill_buffer_;
+  uint64_t used_ = 0;    // entries
+  uint64_t charged_ = 0; // bytes of the budget
+  int spilled_ = 0;
+  int spill_file_ = -1;
+};
+
+// Calls body for units [0, count), one unit per step
+class ForEach : public Task {
+public:
+  ForEach(uint64_t count, const std::function<void(uint64_t)> &body,
+          Budget &budget)
+      : count_(count), body_(body), budget_(budget) {}
+
+  bool step() override {
+    const uint64_t unit = next_++;
+    if (unit >= count_) {
+      return false;
+    }
+    try {
+      body_(unit);
+    } catch (const std::exception &error) {
+      budget_.fail(Status::internal_error,
+                   std::string("Sorry, something went wrong: ") +
+                       error.what());
+      return false;
+    }
+    return true;
+  }
+
+  void complete() override {}
+
+private:
+  const uint64_t count_;
+  std::function<void(uint64_t)> body_;
+  Budget &budget_;
+  std::atomic<uint64_t> next_{0};
+};
+
+// Hashes of one signature file in a round
+struct Slice {
+  const uint8_t *hashes;
+  uint64_t count;
+  uint64_t block_size;
+  uint64_t last_size; // of the last hash, which may end the file
+};
+
+// Signature file to read, with what its hashes can be compared with
+struct SignatureFile {
+  SignatureFile() : source(), header() {}
+
+  std::shared_ptr<Source> source;
+  SignatureHeader header;
+};
+
+} // namespace
+
+static Status open_signature(const char *path, SignatureFile &file,
+                             std::string &error) {
+  file.source.reset(new Source());
+  Status status = file.source->open(path, Engine::mmap, 0, error);
+  if (status != Status::ok) {
+    return status;
+  }
+  const Source &source = *file.source;
+  if (!parse_signature_header(source.memory(), source.size(), file.header)) {
+    error = std::string("Signature ") + path + " has no header";
+    return Status::invalid_argument;
+  }
+  const SignatureHeader &header = file.header;
+  if ((source.size() - header.header_size) / HASH_SIZE <
+      block_count(header.file_size, header.block_size)) {
+    error = std::string("Signature ") + path + " is truncated";
+    return Status::invalid_argument;
+  }
+  return Status::ok;
+}
+
+Status find_duplicates(const char *const *signature_files, size_t count,
+                       const Options &options, const DedupOptions &dedup,
+                       DedupReport &report, std::string &error) {
+  report = DedupReport();
+  const Options resolved = resolve_options(options);
+  ThreadPool pool(resolved.threads - 1, resolved.verbose);
+  Budget budget;
+  budget.limit = dedup.memory_budget;
+  budget.spill_directory = dedup.spill_directory;
+  if (budget.spill_directory.empty()) {
+    const char *temporary = getenv("TMPDIR");
+    budget.spill_directory = temporary && *temporary ? temporary : "/tmp";
+  }
+  std::vector<Shard> shards(SHARD_COUNT);
+  auto run = [&](uint64_t units, const std::function<void(uint64_t)> &body) {
+    pool.run(std::make_shared<ForEach>(units, body, budget));
+    return budget.status;
+  };
+
+  // hashes of the first signature can only be compared with those made
+  // with the same key and mode
+  SignatureHeader first{};
+  std::vector<std::shared_ptr<Source>> round; // mapped until it's done
+  std::vector<Slice> slices;
+  std::vector<std::vector<Entry>> buckets; // [slice * SHARD_COUNT + shard]
+  uint64_t round_hashes = 0;
+  auto flush_round = [&]() {
+    if (buckets.size() < slices.size() * SHARD_COUNT) {
+      buckets.resize(slices.size() * SHARD_COUNT);
+    }
+    Status status = run(slices.size(), [&](uint64_t index) {
+      const Slice &slice = slices[index];
+      std::vector<Entry> *bucket = &buckets[index * SHARD_COUNT];
+      Entry entry{};
+      entry.count = 1;
+      for (uint64_t i = 0; i < slice.count; ++i) {
+        const uint8_t *hash = slice.hashes + i * HASH_SIZE;
+        memcpy(entry.hash, hash, HASH_SIZE);
+        entry.size = i + 1 < slice.count ? slice.block_size : slice.last_size;
+        bucket[hash_key(hash) >> (64 - SHARD_BITS)].push_back(entry);
+      }
+    });
+    if (status == Status::ok) {
+      status = run(SHARD_COUNT, [&](uint64_t shard) {
+        for (size_t index = 0; index < slices.size(); ++index) {
+          std::vector<Entry> &bucket = buckets[index * SHARD_COUNT + shard];
+          for (const Entry &entry : bucket) {
+            shards[shard].add(entry, budget);
+          }
+          bucket.clear();
+        }
+      });
+    }
+    round.clear();
+    slices.clear();
+    round_hashes = 0;
+    return status;
+  };
+
+  for (size_t index = 0; index < count; ++index) {
+    const char *path = signature_files[index];
+    SignatureFile file;
+    Status status = open_signature(path, file, error);
+    if (status != Status::ok) {
+      return status;
+    }
+    const SignatureHeader &header = file.header;
+    if (!index) {
+      first = header;
+    } else if (header.key_id != first.key_id ||
+               header.algorithm != first.algorithm ||
+               tree_chunk_size(header) != tree_chunk_size(first)) {
+      error = std::string("Signature ") + path + " is made with another " +
+              "key, algorithm or tree mode than " + signature_files[0] +
+              ", their hashes can't be compared";
+      return Status::invalid_argument;
+    }
+    const uint64_t blocks = block_count(header.file_size, header.block_size);
+    const uint8_t *hashes = file.source->memory() + header.header_size;
+    ++report.files;
+    report.blocks += blocks;
+    report.bytes += header.file_size;
+    for (uint64_t done = 0; done < blocks;) {
+      const uint64_t size = std::min(
+          {SLICE_HASHES, blocks - done, ROUND_HASHES - round_hashes});
+      const bool last = done + size == blocks;
+      slices.push_back(Slice{hashes + done * HASH_SIZE, size,
+                             header.block_size,
+                             last ? header.file_size -
+                                        (blocks - 1) * header.block_size
+                                  : header.block_size});
+      done += size;
+      round_hashes += size;
+      if (round_hashes == ROUND_HASHES) {
+        status = flush_round();
+        if (status != Status::ok) {
+          error = budget.error;
+          return status;
+        }
+      }
+    }
+    round.push_back(file.source);
+  }
+  Status status = flush_round();
+
+  // every shard counts on its own, then the largest sets of all of them.
+  // Shards in memory go first, at once, spilled ones get the whole budget
+  // after them, one at a time.
+  std::vector<DedupReport> counts(SHARD_COUNT);
+  std::vector<std::vector<Entry>> largest(SHARD_COUNT);
+  if (status == Status::ok) {
+    status = run(SHARD_COUNT, [&](uint64_t shard) {
+      if (!shards[shard].spilled()) {
+        shards[shard].finish(budget, dedup.top, counts[shard],
+                             largest[shard]);
+      }
+    });
+  }
+  for (uint64_t shard = 0; shard < SHARD_COUNT && status == Status::ok;
+       ++shard) {
+    if (shards[shard].spilled()) {
+      status = run(1, [&](uint64_t) {
+        shards[shard].finish(budget, dedup.top, counts[shard],
+                             largest[shard]);
+      });
+    }
+  }
+  if (status != Status::ok) {
+    error = budget.error;
+    return status;
+  }
+  std::vector<Entry> top;
+  for (uint64_t shard = 0; shard < SHARD_COUNT; ++shard) {
+    report.unique_blocks += counts[shard].unique_blocks;
+    report.duplicate_blocks += counts[shard].duplicate_blocks;
+    report.duplicate_bytes += counts[shard].duplicate_bytes;
+    report.spilled_shards += counts[shard].spilled_shards;
+    top.insert(top.end(), largest[shard].begin(), largest[shard].end());
+  }
+  std::sort(top.begin(), top.end(), more_saved);
+  if (top.size() > dedup.top) {
+    top.resize(dedup.top);
+  }
+  if (top.empty()) {
+    return Status::ok;
+  }
+
+  // where sets are first found takes another pass over signatures, but
+  // only for the few largest of them
+  std::unordered_map<uint64_t, size_t> wanted;
+  for (const Entry &entry : top) {
+    DuplicateSet set;
+    memcpy(set.hash, entry.hash, HASH_SIZE);
+    set.size = entry.size;
+    set.count = entry.count;
+    wanted[hash_key(entry.hash)] = report.top.size();
+    report.top.push_back(set);
+  }
+  size_t found = 0;
+  for (size_t index = 0; index < count && found < top.size(); ++index) {
+    SignatureFile file;
+    status = open_signature(signature_files[index], file, error);
+    if (status != Status::ok) {
+      return status;
+    }
+    const uint64_t blocks =
+        block_count(file.header.file_size, file.header.block_size);
+    const uint8_t *hashes = file.source->memory() + file.header.header_size;
+    for (uint64_t block = 0; block < blocks && found < top.size(); ++block) {
+      const auto match = wanted.find(hash_key(hashes + block * HASH_SIZE));
+      if (match == wanted.end()) {
+        continue;
+      }
+      DuplicateSet &set = report.top[match->second];
+      if (set.first_file == UINT64_MAX &&
+          !memcmp(set.hash, hashes + block * HASH_SIZE, HASH_SIZE)) {
+        set.first_file = index;
+        set.first_block = block;
+        ++found;
+      }
+    }
+  }
+  return Status::ok;
+}
+
+#else
+
+Status find_duplicates(const char *const *, size_t, const Options &,
+                       const DedupOptions &, DedupReport &,
+                       std::string &error) {
+  error = "Finding duplicates is not available on Windows";
+  return Status::invalid_argument;
+}
+
+#endif
+
+} // namespace vsign
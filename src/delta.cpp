@@ -0,0 +1,626 @@
+// Deltas between a signed old file and a new one, and patching the old file
+// with them. Not available on Windows.
+//
+// Signatures have no rolling checksum, so blocks of the new file are matched
+// at block offsets only: against the old block after the previous copy
+// first, so that runs go on, then against the one at the same offset, then
+// anywhere in the old file. Adjacent blocks of the same kind are merged
+// into one op, so literal runs are written out in large pieces straight
+// from input memory.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+#ifndef _MSC_VER
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "vsign_internal.h"
+
+namespace vsign {
+
+#ifndef _MSC_VER
+
+// Literal data is written out in pieces of about this size
+constexpr uint64_t LITERAL_PIECE = 8 * 1024 * 1024;
+
+static bool write_fully(int file, const void *data, uint64_t size) {
+  const char *memory = static_cast<const char *>(data);
+  while (size) {
+    const ssize_t written = ::write(file, memory, size);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return false;
+    }
+    memory += written;
+    size -= static_cast<uint64_t>(written);
+  }
+  return true;
+}
+
+namespace {
+
+// Open addressing table of full-size blocks of the old file, keyed by their
+// hashes. Hashes are uniform already, so their first bytes are the slot.
+class BlockIndex {
+public:
+  BlockIndex(const uint8_t *hashes, uint64_t count)
+      : hashes_(hashes), slots_(), mask_(0) {
+    uint64_t size = 16;
+    while (size < 2 * count) {
+      size *= 2;
+    }
+    slots_.assign(size, 0);
+    mask_ = size - 1;
+    for (uint64_t block = 0; block < count; ++block) {
+      const uint64_t slot = find(hashes + block * HASH_SIZE);
+      if (!slots_[slot]) {
+        slots_[slot] = block + 1; // the first of equal blocks
+      }
+    }
+  }
+  BlockIndex(const BlockIndex &) = delete;
+  BlockIndex &operator=(const BlockIndex &) = delete;
+
+  // Block with this hash, UINT64_MAX if there is none
+  uint64_t lookup(const uint8_t *hash) const {
+    const uint64_t found = slots_[find(hash)];
+    return found ? found - 1 : UINT64_MAX;
+  }
+
+private:
+  // Slot holding the hash, or the free one where it would go
+  uint64_t find(const uint8_t *hash) const {
+    uint64_t key;
+    memcpy(&key, hash, sizeof(key));
+    for (uint64_t slot = key & mask_;; slot = (slot + 1) & mask_) {
+      if (!slots_[slot] ||
+          !memcmp(hashes_ + (slots_[slot] - 1) * HASH_SIZE, hash,
+                  HASH_SIZE)) {
+        return slot;
+      }
+    }
+  }
+
+  const uint8_t *hashes_;
+  std::vector<uint64_t> slots_; // block + 1, 0 = free
+  uint64_t mask_;
+};
+
+} // namespace
+
+Status Signer::delta(const char *old_signature, const char *input,
+                     int output, DeltaReport *report) {
+  Source signature;
+  Status status = signature.open(old_signature, Engine::mmap, 0, error_);
+  if (status != Status::ok)
+    return status;
+  SignatureHeader old;
+  if (!parse_signature_header(signature.memory(), signature.size(), old)) {
+    error_ = std::string("Signature ") + old_signature +
+             " has no header, sign the old file again";
+    return Status::invalid_argument;
+  }
+  const uint64_t old_count = vsign::block_count(old.file_size, old.block_size);
+  if (signature.size() - old.header_size < old_count * HASH_SIZE) {
+    error_ = std::string("Signature ") + old_signature + " is truncated";
+    return Status::invalid_argument;
+  }
+  const uint8_t *old_hashes = signature.memory() + old.header_size;
+
+  // signature of the new file, made the same way as the old one
+  auto job = std::make_shared<Job>(old.block_size, options_.batch);
+  job->bypass_cache = options_.bypass_cache;
+  job->throttle = options_.throttle;
+  job->chunk_size = tree_chunk_size(old);
+  job->algorithm = static_cast<Algorithm>(old.algorithm);
+  status = signature_key(options_, old.key_id, job->key, error_);
+  if (status != Status::ok)
+    return status;
+  status = job->source.open(input, options_.engine, 0, error_);
+  if (status != Status::ok)
+    return status;
+  const Source &source = job->source;
+  const uint64_t count = vsign::block_count(source.size(), old.block_size);
+  std::vector<uint8_t> hashes(count * HASH_SIZE);
+  job->output = hashes.data();
+  status = run_job(*pool_, job, hashes.size(), error_);
+  if (status != Status::ok)
+    return status;
+
+  // blocks of both files of other than full size are the last ones
+  auto old_block_size = [&](uint64_t block) {
+    return block + 1 < old_count ? old.block_size
+                                 : old.file_size - block * old.block_size;
+  };
+  auto same = [&](uint64_t block, uint64_t old_block, uint64_t size) {
+    return old_block < old_count && old_block_size(old_block) == size &&
+           !memcmp(hashes.data() + block * HASH_SIZE,
+                   old_hashes + old_block * HASH_SIZE, HASH_SIZE);
+  };
+  const BlockIndex index(old_hashes,
+                         old_count && old_block_size(old_count - 1) !=
+                                          old.block_size
+                             ? old_count - 1
+                             : old_count);
+  std::vector<DeltaOp> ops;
+  uint64_t next_old = UINT64_MAX; // old block after the last copy
+  for (uint64_t block = 0; block < count; ++block) {
+    const uint64_t offset = block * old.block_size;
+    const uint64_t size = std::min(old.block_size, source.size() - offset);
+    uint64_t old_block = UINT64_MAX;
+    if (same(block, next_old, size)) {
+      old_block = next_old;
+    } else if (same(block, block, size)) {
+      old_block = block;
+    } else if (size == old.block_size) {
+      old_block = index.lookup(hashes.data() + block * HASH_SIZE);
+    }
+    const uint32_t type = old_block == UINT64_MAX ? DELTA_LITERAL : DELTA_COPY;
+    const uint64_t from = old_block * old.block_size;
+    DeltaOp *last = ops.empty() ? nullptr : &ops.back();
+    if (last && last->type == type &&
+        (type == DELTA_LITERAL || last->offset + last->length == from)) {
+      last->length += size;
+    } else {
+      ops.push_back(DeltaOp{type, 0, type == DELTA_COPY ? from : 0, size});
+    }
+    next_old = old_block == UINT64_MAX ? UINT64_MAX : old_block + 1;
+  }
+
+  DeltaHeader header{};
+  memcpy(header.magic, DELTA_MAGIC, sizeof(header.magic));
+  header.version = DELTA_VERSION;
+  header.header_size = sizeof(header);
+  header.flags = old.flags;
+  header.algorithm = old.algorithm;
+  header.block_size = old.block_size;
+  header.chunk_size = tree_chunk_size(old);
+  header.key_id = old.key_id;
+  header.old_size = old.file_size;
+  header.old_mtime_ns = old.mtime_ns;
+  header.new_size = source.size();
+  header.block_count = count;
+  header.op_count = ops.size();
+  for (const DeltaOp &op : ops) {
+    header.literal_bytes += op.type == DELTA_LITERAL ? op.length : 0;
+  }
+  if (report) {
+    report->new_size = header.new_size;
+    report->literal_bytes = header.literal_bytes;
+    report->copied_bytes = header.new_size - header.literal_bytes;
+    report->op_count = header.op_count;
+  }
+
+  if (!write_fully(output, &header, sizeof(header)) ||
+      !write_fully(output, hashes.data(), hashes.size())) {
+    error_ = std::string("Can't write delta: ") + strerror(errno);
+    return Status::io_error;
+  }
+  // whole blocks, so that direct reads stay aligned
+  const uint64_t piece =
+      std::max(LITERAL_PIECE / old.block_size, uint64_t(1)) * old.block_size;
+  std::vector<uint8_t> buffer;
+  uint64_t position = 0; // in new file
+  for (const DeltaOp &op : ops) {
+    if (!write_fully(output, &op, sizeof(op))) {
+      error_ = std::string("Can't write delta: ") + strerror(errno);
+      return Status::io_error;
+    }
+    for (uint64_t done = 0; op.type == DELTA_LITERAL && done < op.length;) {
+      const uint64_t size = std::min(piece, op.length - done);
+      const uint8_t *data = nullptr;
+      if (source.engine() == Engine::mmap) {
+        data = source.memory() + position + done;
+      } else {
+        uint8_t *memory = read_buffer(buffer, piece);
+        if (!source.read(memory, position + done, size)) {
+          error_ = "Can't read input at offset " +
+                   std::to_string(position + done) + ": " + strerror(errno);
+          return Status::io_error;
+        }
+        data = memory;
+      }
+      if (!write_fully(output, data, size)) {
+        error_ = std::string("Can't write delta: ") + strerror(errno);
+        return Status::io_error;
+      }
+      done += size;
+    }
+    position += op.length;
+  }
+  return Status::ok;
+}
+
+// Ops are verified and written in pieces of about this size, so that
+// threads share big ones
+constexpr uint64_t SEGMENT_SIZE = 8 * 1024 * 1024;
+
+bool write_fully_at(int file, const uint8_t *data, uint64_t size,
+                    uint64_t offset) {
+  while (size) {
+    const ssize_t written =
+        ::pwrite(file, data, size, static_cast<off_t>(offset));
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return false;
+    }
+    data += written;
+    offset += static_cast<uint64_t>(written);
+    size -= static_cast<uint64_t>(written);
+  }
+  return true;
+}
+
+bool copy_range(int from, uint64_t source, int to, uint64_t offset,
+                uint64_t size) {
+#ifdef __linux__
+  loff_t input = static_cast<loff_t>(source);
+  loff_t output = static_cast<loff_t>(offset);
+  while (size) {
+    const ssize_t copied =
+        ::copy_file_range(from, &input, to, &output, size, 0);
+    if (copied < 0 && errno == EINTR) {
+      continue;
+    }
+    if (copied <= 0) {
+      return false;
+    }
+    size -= static_cast<uint64_t>(copied);
+  }
+  return true;
+#else
+  (void)from;
+  (void)source;
+  (void)to;
+  (void)offset;
+  return !size;
+#endif
+}
+
+static bool parse_delta_header(const uint8_t *memory, uint64_t size,
+                               DeltaHeader &header) {
+  if (size < sizeof(header)) {
+    return false;
+  }
+  memcpy(&header, memory, sizeof(header));
+  return !memcmp(header.magic, DELTA_MAGIC, sizeof(header.magic)) &&
+         header.version == DELTA_VERSION &&
+         !(header.flags & ~SIGNATURE_FLAG_TREE) &&
+         header.algorithm < ALGORITHM_COUNT &&
+         header.header_size >= sizeof(header) && header.header_size <= size &&
+         header.block_size >= HASH_SIZE &&
+         header.block_count ==
+             vsign::block_count(header.new_size, header.block_size) &&
+         (size - header.header_size) / HASH_SIZE >= header.block_count;
+}
+
+namespace {
+
+// Piece of a delta op
+struct Segment {
+  const uint8_t *data; // in old file or delta
+  uint64_t source;     // offset in old file, copies only
+  uint64_t offset;     // in new file, at a block
+  uint64_t length;
+  uint32_t type; // DELTA_COPY or DELTA_LITERAL
+  uint32_t reserved;
+};
+
+// True if no copy that moves data reads what ops write, so that they can
+// be applied to the old file itself in any order
+bool fits_in_place(const std::vector<Segment> &segments) {
+  std::vector<std::pair<uint64_t, uint64_t>> reads, writes; // [begin, end)
+  for (const Segment &segment : segments) {
+    if (segment.type == DELTA_COPY && segment.source == segment.offset) {
+      continue; // stays where it is
+    }
+    writes.emplace_back(segment.offset, segment.offset + segment.length);
+    if (segment.type == DELTA_COPY) {
+      reads.emplace_back(segment.source, segment.source + segment.length);
+    }
+  }
+  // writes are sorted already, segments go in order of the new file
+  std::sort(reads.begin(), reads.end());
+  auto write = writes.begin();
+  for (const auto &read : reads) {
+    while (write != writes.end() && write->second <= read.first) {
+      ++write;
+    }
+    if (write != writes.end() && write->first < read.second) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Verifies segments against signature of the new file and writes them,
+// a segment per step. Patching in place verifies all of them first.
+class Patch : public Task {
+public:
+  explicit Patch(const std::vector<Segment> &patch_segments)
+      : segments(patch_segments), key(), throttle(), error_mutex_(),
+        error_() {}
+  Patch(const Patch &) = delete;
+  Patch &operator=(const Patch &) = delete;
+
+  bool step() override {
+    const uint64_t index = next.fetch_add(1);
+    if (index >= segments.size() || status_ != 0) {
+      return false;
+    }
+    const Segment &segment = segments[index];
+    return (!verify || verify_segment(segment)) &&
+           (!write || write_segment(segment));
+  }
+
+  // pool.run() returns once it's done, nothing to do
+  void complete() override {}
+
+  Status status(std::string &error) const {
+    std::lock_guard<std::mutex> lock(error_mutex_);
+    error = error_;
+    return static_cast<Status>(status_.load());
+  }
+
+  const std::vector<Segment> &segments;
+  const uint8_t *hashes = nullptr; // of the new file
+  std::shared_ptr<const Key> key;
+  std::shared_ptr<Throttle> throttle;
+  uint64_t block_size = 0;
+  uint64_t chunk_size = 0;
+  uint64_t batch = 0;
+  int old_file = -1;
+  int output = -1; // the old file too if in place
+  int in_place = 0;
+  int verify = 0;
+  int write = 0;
+  int bypass_cache = 0;
+  std::atomic<uint64_t> next{0};
+  std::atomic<uint64_t> written{0};
+  std::atomic<uint64_t> copied{0};
+  std::atomic<uint64_t> unchanged{0};
+  Algorithm algorithm = Algorithm::meow;
+
+private:
+  void fail(Status failure, const std::string &message) {
+    std::lock_guard<std::mutex> lock(error_mutex_);
+    if (status_ == 0) {
+      error_ = message;
+      status_ = static_cast<int>(failure);
+    }
+  }
+
+  // Hashes it like the new file was signed, one thread per segment
+  bool verify_segment(const Segment &segment) {
+    Job job(block_size, batch);
+    job.key = key;
+    job.throttle = throttle;
+    job.chunk_size = chunk_size;
+    job.algorithm = algorithm;
+    job.bypass_cache = bypass_cache;
+    job.first_block = segment.offset / block_size;
+    job.source.open_memory(segment.data, segment.length);
+    job.expected = hashes + job.first_block * HASH_SIZE;
+    if (job.plan(vsign::block_count(segment.length, block_size) *
+                 HASH_SIZE)) {
+      while (job.step()) {
+      }
+    }
+    const Result result = job.result();
+    if (result.status == Status::mismatch && result.mismatched_blocks) {
+      fail(Status::mismatch,
+           "Block " + std::to_string(result.first_mismatch) +
+               " of new file doesn't match signature in delta, " +
+               (segment.type == DELTA_COPY
+                    ? "old file is not the one delta was made against"
+                    : "delta is damaged"));
+    } else if (result.status != Status::ok) {
+      fail(result.status, result.error);
+    }
+    return result.status == Status::ok;
+  }
+
+  bool write_segment(const Segment &segment) {
+    if (segment.type == DELTA_COPY) {
+      if (in_place && segment.source == segment.offset) {
+        unchanged += segment.length;
+        return true;
+      }
+      if (copy_range(old_file, segment.source, output, segment.offset,
+                     segment.length)) {
+        copied += segment.length;
+        return true;
+      }
+    }
+    if (!write_fully_at(output, segment.data, segment.length,
+                        segment.offset)) {
+      fail(Status::io_error, "Can't write output at offset " +
+                                 std::to_string(segment.offset) + ": " +
+                                 strerror(errno));
+      return false;
+    }
+    written += segment.length;
+    return true;
+  }
+
+  std::atomic<int> status_{0};
+  mutable std::mutex error_mutex_;
+  std::string error_;
+};
+
+} // namespace
+
+Status Signer::patch(const char *old_file, const char *delta_file,
+                     const char *output, PatchReport *report) {
+  Source delta;
+  Status status = delta.open(delta_file, Engine::mmap, 0, error_);
+  if (status != Status::ok)
+    return status;
+  DeltaHeader header;
+  if (!parse_delta_header(delta.memory(), delta.size(), header)) {
+    error_ = std::string(delta_file) + " is not a delta";
+    return Status::invalid_argument;
+  }
+  Source old;
+  status = old.open(old_file, Engine::mmap, 0, error_);
+  if (status != Status::ok)
+    return status;
+  if (old.size() != header.old_size) {
+    error_ = std::string("Old file ") + old_file + " has " +
+             std::to_string(old.size()) + " bytes, delta was made against " +
+             std::to_string(header.old_size);
+    return Status::mismatch;
+  }
+  std::shared_ptr<const Key> key;
+  status = signature_key(options_, header.key_id, key, error_);
+  if (status != Status::ok)
+    return status;
+
+  // ops in pieces, checked to fit both files
+  const uint64_t block_size = header.block_size;
+  const uint64_t piece =
+      std::max(SEGMENT_SIZE / block_size, uint64_t(1)) * block_size;
+  const uint8_t *cursor =
+      delta.memory() + header.header_size + header.block_count * HASH_SIZE;
+  const uint8_t *end = delta.memory() + delta.size();
+  std::vector<Segment> segments;
+  uint64_t position = 0; // in new file
+  for (uint64_t index = 0; index < header.op_count; ++index) {
+    DeltaOp op;
+    if (static_cast<uint64_t>(end - cursor) < sizeof(op)) {
+      break;
+    }
+    memcpy(&op, cursor, sizeof(op));
+    cursor += sizeof(op);
+    const uint8_t *data = nullptr;
+    if (op.type == DELTA_LITERAL &&
+        op.length <= static_cast<uint64_t>(end - cursor)) {
+      data = cursor;
+      cursor += op.length;
+    } else if (op.type == DELTA_COPY && op.offset <= old.size() &&
+               op.length <= old.size() - op.offset) {
+      data = old.memory() + op.offset;
+    }
+    if (!data || !op.length || position % block_size ||
+        op.length > header.new_size - position) {
+      break;
+    }
+    for (uint64_t done = 0; done < op.length; done += piece) {
+      segments.push_back(Segment{data + done, op.offset + done,
+                                 position + done,
+                                 std::min(piece, op.length - done), op.type,
+                                 0});
+    }
+    position += op.length;
+  }
+  if (position != header.new_size || cursor != end) {
+    error_ = std::string("Delta ") + delta_file + " is damaged";
+    return Status::invalid_argument;
+  }
+
+  const bool in_place = !output && fits_in_place(segments);
+  const std::string target = output ? output : old_file;
+  const std::string temporary = target + ".patching";
+  const int old_descriptor =
+      ::open(old_file, (in_place ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+  if (old_descriptor == -1) {
+    error_ = std::string("Can't open old file ") + old_file + ": " +
+             strerror(errno);
+    return Status::io_error;
+  }
+  struct stat info;
+  const int mode = ::fstat(old_descriptor, &info) == 0
+                       ? static_cast<int>(info.st_mode & 07777)
+                       : 0644;
+  const int descriptor =
+      in_place ? old_descriptor
+               : ::open(temporary.c_str(),
+                        O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                        output ? 0666 : mode);
+  if (descriptor == -1 ||
+      (!in_place && ::ftruncate(descriptor,
+                                static_cast<off_t>(header.new_size)))) {
+    error_ = "Can't create " + temporary + ": " + strerror(errno);
+    ::close(old_descriptor);
+    if (descriptor != -1) {
+      ::close(descriptor);
+      ::unlink(temporary.c_str());
+    }
+    return Status::io_error;
+  }
+
+  // in place nothing is written unless all of it is verified
+  PatchReport done;
+  done.new_size = header.new_size;
+  done.in_place = in_place;
+  for (int phase = in_place ? 0 : 1; phase < 2 && status == Status::ok;
+       ++phase) {
+    auto task = std::make_shared<Patch>(segments);
+    task->hashes = delta.memory() + header.header_size;
+    task->key = key;
+    task->throttle = options_.throttle;
+    task->block_size = block_size;
+    task->chunk_size = header.flags & SIGNATURE_FLAG_TREE ? header.chunk_size
+                                                          : 0;
+    task->batch = options_.batch;
+    task->old_file = old_descriptor;
+    task->output = descriptor;
+    task->in_place = in_place;
+    task->verify = !in_place || phase == 0;
+    task->write = phase == 1;
+    task->bypass_cache = options_.bypass_cache;
+    task->algorithm = static_cast<Algorithm>(header.algorithm);
+    pool_->run(task);
+    status = task->status(error_);
+    done.written_bytes += task->written;
+    done.copied_bytes += task->copied;
+    done.unchanged_bytes += task->unchanged;
+  }
+  // the old file is gone once the new one replaces it, so that one has to
+  // be on disk first
+  if (status == Status::ok &&
+      ((in_place &&
+        ::ftruncate(descriptor, static_cast<off_t>(header.new_size))) ||
+       (!output && ::fsync(descriptor)) ||
+       (!in_place && ::rename(temporary.c_str(), target.c_str())))) {
+    error_ = "Can't finish " + target + ": " + strerror(errno);
+    status = Status::io_error;
+  }
+  if (!in_place) {
+    ::close(descriptor);
+    if (status != Status::ok) {
+      ::unlink(temporary.c_str());
+    }
+  }
+  ::close(old_descriptor);
+  if (report) {
+    *report = done;
+  }
+  return status;
+}
+
+#else
+
+Status Signer::delta(const char *, const char *, int, DeltaReport *) {
+  error_ = "Deltas are not available on Windows";
+  return Status::invalid_argument;
+}
+
+Status Signer::patch(const char *, const char *, const char *,
+                     PatchReport *) {
+  error_ = "Deltas are not available on Windows";
+  return Status::invalid_argument;
+}
+
+#endif
+
+} // namespace vsign
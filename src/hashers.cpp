@@ -0,0 +1,457 @@
+// Hashers of hashers.h that are not header-only: CRC32C, BLAKE3, and the
+// implementation of xxHash.
+
+#include <cstring>
+
+#include <immintrin.h>
+
+#define XXH_IMPLEMENTATION
+#include "hashers.h"
+
+namespace vsign {
+
+namespace {
+
+// CRC32C is computed in its register form, without the inversions before
+// and after. That is linear: register of A and then B is register of A
+// followed by zeros as long as B, xor register of B alone. So streams can be
+// hashed from zero at once and combined, shifting the earlier ones over
+// the length of the later ones with tables.
+class Crc32cShift {
+public:
+  explicit Crc32cShift(uint64_t length) : table_() {
+    // register of every single bit, followed by `length` zeros
+    uint32_t columns[32];
+    for (int bit = 0; bit < 32; ++bit) {
+      uint64_t crc = uint32_t(1) << bit;
+      for (uint64_t done = 0; done < length; done += 8) {
+        crc = _mm_crc32_u64(crc, 0);
+      }
+      columns[bit] = static_cast<uint32_t>(crc);
+    }
+    for (int byte = 0; byte < 4; ++byte) {
+      for (uint32_t value = 0; value < 256; ++value) {
+        uint32_t shifted = 0;
+        for (int bit = 0; bit < 8; ++bit) {
+          if (value & (1u << bit)) {
+            shifted ^= columns[byte * 8 + bit];
+          }
+        }
+        table_[byte][value] = shifted;
+      }
+    }
+  }
+
+  uint64_t operator()(uint64_t crc) const {
+    return table_[0][crc & 0xff] ^ table_[1][(crc >> 8) & 0xff] ^
+           table_[2][(crc >> 16) & 0xff] ^ table_[3][(crc >> 24) & 0xff];
+  }
+
+private:
+  uint32_t table_[4][256];
+};
+
+uint64_t load64(const uint8_t *memory) {
+  uint64_t value;
+  memcpy(&value, memory, sizeof(value));
+  return value;
+}
+
+// Registers of three streams of `stripe` bytes each, one after another at
+// `memory`, combined into one that continues from `crc`
+template <uint64_t stripe>
+uint64_t crc32c_stripes(uint64_t crc, const uint8_t *memory,
+                        bool non_temporal, const Crc32cShift &shift) {
+  uint64_t first = crc, second = 0, third = 0;
+  for (uint64_t offset = 0; offset < stripe; offset += 64) {
+    if (non_temporal) {
+      for (uint64_t lane = 0; lane < 3; ++lane) {
+        _mm_prefetch(reinterpret_cast<const char *>(memory) + lane * stripe +
+                         offset + 1024,
+                     _MM_HINT_NTA);
+      }
+    }
+    // a crc32 instruction takes 3 cycles, one can start every cycle
+    for (uint64_t word = offset; word < offset + 64; word += 8) {
+      first = _mm_crc32_u64(first, load64(memory + word));
+      second = _mm_crc32_u64(second, load64(memory + stripe + word));
+      third = _mm_crc32_u64(third, load64(memory + 2 * stripe + word));
+    }
+  }
+  return shift(shift(first) ^ second) ^ third;
+}
+
+// Large stripes for blocks, small ones for what is left and small blocks
+constexpr uint64_t LONG_STRIPE = 8192;
+constexpr uint64_t SHORT_STRIPE = 256;
+
+} // namespace
+
+uint32_t crc32c(uint32_t crc, const uint8_t *memory, uint64_t size,
+                bool non_temporal) {
+  static const Crc32cShift long_shift(LONG_STRIPE);
+  static const Crc32cShift short_shift(SHORT_STRIPE);
+  uint64_t state = ~crc;
+  for (; size >= 3 * LONG_STRIPE;
+       memory += 3 * LONG_STRIPE, size -= 3 * LONG_STRIPE) {
+    state = crc32c_stripes<LONG_STRIPE>(state, memory, non_temporal,
+                                        long_shift);
+  }
+  for (; size >= 3 * SHORT_STRIPE;
+       memory += 3 * SHORT_STRIPE, size -= 3 * SHORT_STRIPE) {
+    state = crc32c_stripes<SHORT_STRIPE>(state, memory, non_temporal,
+                                         short_shift);
+  }
+  for (; size >= 8; memory += 8, size -= 8) {
+    state = _mm_crc32_u64(state, load64(memory));
+  }
+  uint32_t tail = static_cast<uint32_t>(state);
+  for (; size; ++memory, --size) {
+    tail = _mm_crc32_u8(tail, *memory);
+  }
+  return ~tail;
+}
+
+namespace {
+
+constexpr uint32_t BLAKE3_IV[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                   0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                   0x1f83d9ab, 0x5be0cd19};
+
+// Order of message words in every round
+constexpr uint8_t BLAKE3_SCHEDULE[7][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+    {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+    {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+    {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+    {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+    {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13},
+};
+
+constexpr uint32_t CHUNK_START = 1;
+constexpr uint32_t CHUNK_END = 2;
+constexpr uint32_t PARENT = 4;
+constexpr uint32_t ROOT = 8;
+constexpr uint32_t KEYED_HASH = 16;
+
+constexpr uint64_t BLAKE3_BLOCK = 64;
+constexpr uint64_t BLAKE3_CHUNK = 1024;
+// chunks compressed at once, one per lane of AVX2 registers
+constexpr uint64_t BLAKE3_LANES = 8;
+
+inline uint32_t rotate_right(uint32_t value, int bits) {
+  return (value >> bits) | (value << (32 - bits));
+}
+
+inline void mix(uint32_t *state, int a, int b, int c, int d, uint32_t x,
+                uint32_t y) {
+  state[a] = state[a] + state[b] + x;
+  state[d] = rotate_right(state[d] ^ state[a], 16);
+  state[c] = state[c] + state[d];
+  state[b] = rotate_right(state[b] ^ state[c], 12);
+  state[a] = state[a] + state[b] + y;
+  state[d] = rotate_right(state[d] ^ state[a], 8);
+  state[c] = state[c] + state[d];
+  state[b] = rotate_right(state[b] ^ state[c], 7);
+}
+
+// First 8 words of output of the compression function, the chaining value
+void compress(const uint32_t *chaining_value, const uint8_t *block,
+              uint64_t counter, uint32_t block_size, uint32_t flags,
+              uint32_t *output) {
+  uint32_t message[16];
+  memcpy(message, block, sizeof(message));
+  uint32_t state[16] = {chaining_value[0],
+                        chaining_value[1],
+                        chaining_value[2],
+                        chaining_value[3],
+                        chaining_value[4],
+                        chaining_value[5],
+                        chaining_value[6],
+                        chaining_value[7],
+                        BLAKE3_IV[0],
+                        BLAKE3_IV[1],
+                        BLAKE3_IV[2],
+                        BLAKE3_IV[3],
+                        static_cast<uint32_t>(counter),
+                        static_cast<uint32_t>(counter >> 32),
+                        block_size,
+                        flags};
+  for (const uint8_t *order : BLAKE3_SCHEDULE) {
+    mix(state, 0, 4, 8, 12, message[order[0]], message[order[1]]);
+    mix(state, 1, 5, 9, 13, message[order[2]], message[order[3]]);
+    mix(state, 2, 6, 10, 14, message[order[4]], message[order[5]]);
+    mix(state, 3, 7, 11, 15, message[order[6]], message[order[7]]);
+    mix(state, 0, 5, 10, 15, message[order[8]], message[order[9]]);
+    mix(state, 1, 6, 11, 12, message[order[10]], message[order[11]]);
+    mix(state, 2, 7, 8, 13, message[order[12]], message[order[13]]);
+    mix(state, 3, 4, 9, 14, message[order[14]], message[order[15]]);
+  }
+  for (int word = 0; word < 8; ++word) {
+    output[word] = state[word] ^ state[word + 8];
+  }
+}
+
+// Same as mix() in every lane
+inline __m256i rotate_right16(__m256i value) {
+  return _mm256_shuffle_epi8(
+      value, _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15,
+                              12, 13, 2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9,
+                              14, 15, 12, 13));
+}
+
+inline __m256i rotate_right8(__m256i value) {
+  return _mm256_shuffle_epi8(
+      value, _mm256_setr_epi8(1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14,
+                              15, 12, 1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8,
+                              13, 14, 15, 12));
+}
+
+template <int bits> inline __m256i rotate_right(__m256i value) {
+  return _mm256_or_si256(_mm256_srli_epi32(value, bits),
+                         _mm256_slli_epi32(value, 32 - bits));
+}
+
+inline void mix8(__m256i *state, int a, int b, int c, int d, __m256i x,
+                 __m256i y) {
+  state[a] = _mm256_add_epi32(_mm256_add_epi32(state[a], state[b]), x);
+  state[d] = rotate_right16(_mm256_xor_si256(state[d], state[a]));
+  state[c] = _mm256_add_epi32(state[c], state[d]);
+  state[b] = rotate_right<12>(_mm256_xor_si256(state[b], state[c]));
+  state[a] = _mm256_add_epi32(_mm256_add_epi32(state[a], state[b]), y);
+  state[d] = rotate_right8(_mm256_xor_si256(state[d], state[a]));
+  state[c] = _mm256_add_epi32(state[c], state[d]);
+  state[b] = rotate_right<7>(_mm256_xor_si256(state[b], state[c]));
+}
+
+// Rows of 8 words become columns: words[i] gets word i of every row
+void transpose(__m256i *words) {
+  const __m256i a = _mm256_unpacklo_epi32(words[0], words[1]);
+  const __m256i b = _mm256_unpackhi_epi32(words[0], words[1]);
+  const __m256i c = _mm256_unpacklo_epi32(words[2], words[3]);
+  const __m256i d = _mm256_unpackhi_epi32(words[2], words[3]);
+  const __m256i e = _mm256_unpacklo_epi32(words[4], words[5]);
+  const __m256i f = _mm256_unpackhi_epi32(words[4], words[5]);
+  const __m256i g = _mm256_unpacklo_epi32(words[6], words[7]);
+  const __m256i h = _mm256_unpackhi_epi32(words[6], words[7]);
+  const __m256i ac_low = _mm256_unpacklo_epi64(a, c);
+  const __m256i ac_high = _mm256_unpackhi_epi64(a, c);
+  const __m256i bd_low = _mm256_unpacklo_epi64(b, d);
+  const __m256i bd_high = _mm256_unpackhi_epi64(b, d);
+  const __m256i eg_low = _mm256_unpacklo_epi64(e, g);
+  const __m256i eg_high = _mm256_unpackhi_epi64(e, g);
+  const __m256i fh_low = _mm256_unpacklo_epi64(f, h);
+  const __m256i fh_high = _mm256_unpackhi_epi64(f, h);
+  words[0] = _mm256_permute2x128_si256(ac_low, eg_low, 0x20);
+  words[1] = _mm256_permute2x128_si256(ac_high, eg_high, 0x20);
+  words[2] = _mm256_permute2x128_si256(bd_low, fh_low, 0x20);
+  words[3] = _mm256_permute2x128_si256(bd_high, fh_high, 0x20);
+  words[4] = _mm256_permute2x128_si256(ac_low, eg_low, 0x31);
+  words[5] = _mm256_permute2x128_si256(ac_high, eg_high, 0x31);
+  words[6] = _mm256_permute2x128_si256(bd_low, fh_low, 0x31);
+  words[7] = _mm256_permute2x128_si256(bd_high, fh_high, 0x31);
+}
+
+// Chaining values of BLAKE3_LANES whole chunks at `memory`, the first of
+// them chunk number `counter`, into `output` one after another
+void compress_chunks(const uint32_t *key, const uint8_t *memory,
+                     uint64_t counter, uint32_t flags, bool non_temporal,
+                     uint32_t *output) {
+  __m256i chaining_value[8];
+  for (int word = 0; word < 8; ++word) {
+    chaining_value[word] = _mm256_set1_epi32(static_cast<int>(key[word]));
+  }
+  int low[BLAKE3_LANES], high[BLAKE3_LANES];
+  for (uint64_t lane = 0; lane < BLAKE3_LANES; ++lane) {
+    low[lane] = static_cast<int>(static_cast<uint32_t>(counter + lane));
+    high[lane] = static_cast<int>((counter + lane) >> 32);
+  }
+  const __m256i counter_low = _mm256_loadu_si256(
+      reinterpret_cast<const __m256i *>(low));
+  const __m256i counter_high = _mm256_loadu_si256(
+      reinterpret_cast<const __m256i *>(high));
+  for (uint64_t block = 0; block < BLAKE3_CHUNK / BLAKE3_BLOCK; ++block) {
+    const uint64_t offset = block * BLAKE3_BLOCK;
+    __m256i message[16];
+    for (uint64_t lane = 0; lane < BLAKE3_LANES; ++lane) {
+      const uint8_t *input = memory + lane * BLAKE3_CHUNK + offset;
+      const char *ahead = reinterpret_cast<const char *>(input) + 256;
+      if (non_temporal) {
+        _mm_prefetch(ahead, _MM_HINT_NTA);
+      } else {
+        _mm_prefetch(ahead, _MM_HINT_T0);
+      }
+      message[lane] =
+          _mm256_loadu_si256(reinterpret_cast<const __m256i *>(input));
+      message[lane + 8] =
+          _mm256_loadu_si256(reinterpret_cast<const __m256i *>(input + 32));
+    }
+    transpose(message);
+    transpose(message + 8);
+    const uint32_t block_flags =
+        flags | (block == 0 ? CHUNK_START : 0) |
+        (offset + BLAKE3_BLOCK == BLAKE3_CHUNK ? CHUNK_END : 0);
+    __m256i state[16] = {
+        chaining_value[0],
+        chaining_value[1],
+        chaining_value[2],
+        chaining_value[3],
+        chaining_value[4],
+        chaining_value[5],
+        chaining_value[6],
+        chaining_value[7],
+        _mm256_set1_epi32(static_cast<int>(BLAKE3_IV[0])),
+        _mm256_set1_epi32(static_cast<int>(BLAKE3_IV[1])),
+        _mm256_set1_epi32(static_cast<int>(BLAKE3_IV[2])),
+        _mm256_set1_epi32(static_cast<int>(BLAKE3_IV[3])),
+        counter_low,
+        counter_high,
+        _mm256_set1_epi32(static_cast<int>(BLAKE3_BLOCK)),
+        _mm256_set1_epi32(static_cast<int>(block_flags))};
+    for (const uint8_t *order : BLAKE3_SCHEDULE) {
+      mix8(state, 0, 4, 8, 12, message[order[0]], message[order[1]]);
+      mix8(state, 1, 5, 9, 13, message[order[2]], message[order[3]]);
+      mix8(state, 2, 6, 10, 14, message[order[4]], message[order[5]]);
+      mix8(state, 3, 7, 11, 15, message[order[6]], message[order[7]]);
+      mix8(state, 0, 5, 10, 15, message[order[8]], message[order[9]]);
+      mix8(state, 1, 6, 11, 12, message[order[10]], message[order[11]]);
+      mix8(state, 2, 7, 8, 13, message[order[12]], message[order[13]]);
+      mix8(state, 3, 4, 9, 14, message[order[14]], message[order[15]]);
+    }
+    for (int word = 0; word < 8; ++word) {
+      chaining_value[word] = _mm256_xor_si256(state[word], state[word + 8]);
+    }
+  }
+  // lanes back to rows
+  transpose(chaining_value);
+  for (uint64_t lane = 0; lane < BLAKE3_LANES; ++lane) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(output + lane * 8),
+                        chaining_value[lane]);
+  }
+}
+
+} // namespace
+
+void Blake3State::begin(const Key *key) {
+  if (key) {
+    memcpy(key_, key->seed, sizeof(key_));
+    flags_ = KEYED_HASH;
+  } else {
+    memcpy(key_, BLAKE3_IV, sizeof(key_));
+    flags_ = 0;
+  }
+  memcpy(chaining_value_, key_, sizeof(chaining_value_));
+  chunks_ = 0;
+  stack_size_ = 0;
+  block_size_ = 0;
+  blocks_ = 0;
+}
+
+// A block of the chunk being absorbed that is not its last one
+void Blake3State::compress_block(const uint8_t *block, uint32_t flags) {
+  compress(chaining_value_, block, chunks_, BLAKE3_BLOCK,
+           flags_ | flags | (blocks_ ? 0 : CHUNK_START), chaining_value_);
+  ++blocks_;
+}
+
+// The chunk is whole and more input follows, so it is not the root
+void Blake3State::finish_chunk() {
+  compress_block(block_, CHUNK_END);
+  push_chunk(chaining_value_);
+  memcpy(chaining_value_, key_, sizeof(chaining_value_));
+  block_size_ = 0;
+  blocks_ = 0;
+}
+
+// Every complete subtree is merged into its parent right away, except the
+// one of all chunks: only end() knows that it is the root
+void Blake3State::push_chunk(const uint32_t *chaining_value) {
+  uint32_t node[8];
+  memcpy(node, chaining_value, sizeof(node));
+  for (uint64_t total = ++chunks_; !(total & 1); total >>= 1) {
+    uint8_t block[BLAKE3_BLOCK];
+    memcpy(block, stack_[--stack_size_], 32);
+    memcpy(block + 32, node, 32);
+    compress(key_, block, 0, BLAKE3_BLOCK, flags_ | PARENT, node);
+  }
+  memcpy(stack_[stack_size_++], node, sizeof(node));
+}
+
+void Blake3State::absorb(const uint8_t *memory, uint64_t size,
+                         bool non_temporal) {
+  while (size) {
+    if (blocks_ * BLAKE3_BLOCK + block_size_ == BLAKE3_CHUNK) {
+      finish_chunk();
+    }
+    if (!blocks_ && !block_size_ && size > BLAKE3_CHUNK) {
+      // whole chunks straight from input, the last byte stays for end()
+      uint64_t count = (size - 1) / BLAKE3_CHUNK;
+      uint32_t chaining_values[BLAKE3_LANES * 8];
+      for (; count >= BLAKE3_LANES; count -= BLAKE3_LANES) {
+        compress_chunks(key_, memory, chunks_, flags_, non_temporal,
+                        chaining_values);
+        for (uint64_t lane = 0; lane < BLAKE3_LANES; ++lane) {
+          push_chunk(chaining_values + lane * 8);
+        }
+        memory += BLAKE3_LANES * BLAKE3_CHUNK;
+        size -= BLAKE3_LANES * BLAKE3_CHUNK;
+      }
+      for (; count; --count) {
+        for (uint64_t offset = 0; offset < BLAKE3_CHUNK - BLAKE3_BLOCK;
+             offset += BLAKE3_BLOCK) {
+          compress_block(memory + offset, 0);
+        }
+        memcpy(block_, memory + BLAKE3_CHUNK - BLAKE3_BLOCK, BLAKE3_BLOCK);
+        block_size_ = BLAKE3_BLOCK;
+        finish_chunk();
+        memory += BLAKE3_CHUNK;
+        size -= BLAKE3_CHUNK;
+      }
+    }
+    // the last block of a chunk waits for what follows it
+    if (block_size_ == BLAKE3_BLOCK) {
+      compress_block(block_, 0);
+      block_size_ = 0;
+    }
+    if (!block_size_ && size > BLAKE3_BLOCK &&
+        blocks_ + 1 < BLAKE3_CHUNK / BLAKE3_BLOCK) {
+      compress_block(memory, 0);
+      memory += BLAKE3_BLOCK;
+      size -= BLAKE3_BLOCK;
+      continue;
+    }
+    const uint64_t length = std::min(BLAKE3_BLOCK - block_size_, size);
+    memcpy(block_ + block_size_, memory, length);
+    block_size_ += static_cast<uint32_t>(length);
+    memory += length;
+    size -= length;
+  }
+}
+
+void Blake3State::end(uint8_t *hash) const {
+  // the last block of the last chunk, then the parents above it up to
+  // the root
+  uint32_t chaining_value[8];
+  uint8_t block[BLAKE3_BLOCK] = {};
+  memcpy(chaining_value, chaining_value_, sizeof(chaining_value));
+  memcpy(block, block_, block_size_);
+  uint64_t counter = chunks_;
+  uint32_t size = block_size_;
+  uint32_t flags = flags_ | CHUNK_END | (blocks_ ? 0 : CHUNK_START);
+  for (uint32_t level = stack_size_; level; --level) {
+    uint32_t node[8];
+    compress(chaining_value, block, counter, size, flags, node);
+    memcpy(block, stack_[level - 1], 32);
+    memcpy(block + 32, node, 32);
+    memcpy(chaining_value, key_, sizeof(chaining_value));
+    counter = 0;
+    size = BLAKE3_BLOCK;
+    flags = flags_ | PARENT;
+  }
+  uint32_t output[8];
+  compress(chaining_value, block, counter, size, flags | ROOT, output);
+  memcpy(hash, output, HASH_SIZE);
+}
+
+} // namespace vsign
@@ -0,0 +1,251 @@
+// Hash functions that blocks can be signed with, one policy per Algorithm.
+// Job steps are templates instantiated with every policy, so the choice is
+// made once per step and calls per block are direct, Meow kernels for block
+// sizes known at compile time included. Every policy has:
+//
+//   hash<hint>(key, memory, size, hash)   hash of `size` bytes at `memory`
+//                                         into `hash`, prefetching input
+//                                         with `hint` where it prefetches
+//   State, begin(state, key),             same hash of input that comes in
+//   absorb(state, memory, size),          parts, for blocks larger than a
+//   end(state, hash)                      window of input
+//
+// `key` is nullptr for unkeyed signatures. Hashes are HASH_SIZE bytes.
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <tuple>
+#include <vector>
+
+#include <immintrin.h>
+
+#include "meow_fixed.h"
+#include "vsign.h"
+
+// In our namespace, so that it doesn't clash with another copy of xxHash
+// linked into the same program
+#ifndef XXH_NAMESPACE
+#define XXH_NAMESPACE vsign_
+#endif
+#ifndef XXH_STATIC_LINKING_ONLY
+#define XXH_STATIC_LINKING_ONLY
+#endif
+#if defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wswitch-default"
+#endif
+#include "xxhash/xxhash.h"
+#if defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+
+namespace vsign {
+
+// CRC32C of `size` bytes that follow data with CRC32C `crc` (0 for none),
+// three interleaved streams of the crc32 instruction at a time. Prefetches
+// non-temporally if asked to, otherwise leaves it to the hardware.
+uint32_t crc32c(uint32_t crc, const uint8_t *memory, uint64_t size,
+                bool non_temporal = false);
+
+// BLAKE3 hasher. Whole chunks of input are compressed eight at a time with
+// AVX2, the tree above them one node at a time.
+class Blake3State {
+public:
+  // Keyed hash mode with the first 32 bytes of key's seed
+  void begin(const Key *key);
+  void absorb(const uint8_t *memory, uint64_t size, bool non_temporal = false);
+  // First HASH_SIZE bytes of output
+  void end(uint8_t *hash) const;
+
+private:
+  void compress_block(const uint8_t *block, uint32_t flags);
+  void finish_chunk();
+  void push_chunk(const uint32_t *chaining_value);
+
+  uint32_t key_[8];
+  uint32_t chaining_value_[8]; // of the chunk being absorbed
+  // chaining values of complete subtrees, enough for 2^54 chunks
+  uint32_t stack_[54][8];
+  uint8_t block_[64]; // the block of the chunk not compressed yet
+  uint64_t chunks_;   // complete ones, pushed onto the stack
+  uint32_t flags_;    // mode flags, keyed or not
+  uint32_t stack_size_;
+  uint32_t block_size_; // bytes in block_
+  uint32_t blocks_;     // compressed blocks of the chunk being absorbed
+};
+
+struct MeowHasher {
+  static constexpr Algorithm algorithm = Algorithm::meow;
+  using State = meow_state;
+
+  // MeowHash() wants a mutable pointer, but doesn't write through it
+  static void *seed(const Key *key) {
+    return key ? const_cast<uint8_t *>(key->seed) : MeowDefaultSeed;
+  }
+
+  template <PrefetchHint hint>
+  static void hash(const Key *key, const uint8_t *memory, uint64_t size,
+                   uint8_t *hash) {
+    _mm_storeu_si128(reinterpret_cast<meow_u128 *>(hash),
+                     meow_hash<hint>(seed(key), size, memory));
+  }
+  static void begin(State &state, const Key *key) {
+    MeowBegin(&state, seed(key));
+  }
+  static void absorb(State &state, const uint8_t *memory, uint64_t size) {
+    MeowAbsorb(&state, size, const_cast<uint8_t *>(memory));
+  }
+  static void end(State &state, uint8_t *hash) {
+    _mm_storeu_si128(reinterpret_cast<meow_u128 *>(hash),
+                     MeowEnd(&state, nullptr));
+  }
+};
+
+struct Crc32cHasher {
+  static constexpr Algorithm algorithm = Algorithm::crc32c;
+  struct State {
+    uint32_t crc;
+  };
+
+  static void store(uint32_t crc, uint8_t *hash) {
+    memset(hash, 0, HASH_SIZE);
+    memcpy(hash, &crc, sizeof(crc));
+  }
+  template <PrefetchHint hint>
+  static void hash(const Key *, const uint8_t *memory, uint64_t size,
+                   uint8_t *hash) {
+    store(crc32c(0, memory, size, hint == _MM_HINT_NTA), hash);
+  }
+  static void begin(State &state, const Key *) { state.crc = 0; }
+  static void absorb(State &state, const uint8_t *memory, uint64_t size) {
+    state.crc = crc32c(state.crc, memory, size);
+  }
+  static void end(State &state, uint8_t *hash) { store(state.crc, hash); }
+};
+
+struct Xxh3Hasher {
+  static constexpr Algorithm algorithm = Algorithm::xxh3;
+  struct FreeState {
+    void operator()(XXH3_state_t *state) const { XXH3_freeState(state); }
+  };
+  // allocated by xxHash, which aligns it the way its vector code wants
+  using State = std::unique_ptr<XXH3_state_t, FreeState>;
+
+  static XXH64_hash_t seed(const Key *key) {
+    XXH64_hash_t seed = 0;
+    if (key) {
+      memcpy(&seed, key->seed, sizeof(seed));
+    }
+    return seed;
+  }
+  static void store(XXH128_hash_t value, uint8_t *hash) {
+    memcpy(hash, &value.low64, sizeof(value.low64));
+    memcpy(hash + sizeof(value.low64), &value.high64, sizeof(value.high64));
+  }
+
+  // Without a hint to follow, one call. Otherwise input is fed to the
+  // streaming state a piece at a time, with the next piece prefetched.
+  template <PrefetchHint hint>
+  static void hash(const Key *key, const uint8_t *memory, uint64_t size,
+                   uint8_t *hash) {
+    if (hint == _MM_HINT_T0) {
+      store(XXH3_128bits_withSeed(memory, size, seed(key)), hash);
+      return;
+    }
+    constexpr uint64_t PIECE = 4096;
+    XXH3_state_t state;
+    XXH3_128bits_reset_withSeed(&state, seed(key));
+    for (uint64_t offset = 0; offset < size; offset += PIECE) {
+      const char *ahead = reinterpret_cast<const char *>(memory) + offset;
+      for (uint64_t line = PIECE; line < 2 * PIECE; line += 64) {
+        _mm_prefetch(ahead + line, hint);
+      }
+      XXH3_128bits_update(&state, memory + offset,
+                          std::min(PIECE, size - offset));
+    }
+    store(XXH3_128bits_digest(&state), hash);
+  }
+  static void begin(State &state, const Key *key) {
+    if (!state) {
+      state.reset(XXH3_createState());
+      if (!state) {
+        throw std::bad_alloc();
+      }
+    }
+    XXH3_128bits_reset_withSeed(state.get(), seed(key));
+  }
+  static void absorb(State &state, const uint8_t *memory, uint64_t size) {
+    XXH3_128bits_update(state.get(), memory, size);
+  }
+  static void end(State &state, uint8_t *hash) {
+    store(XXH3_128bits_digest(state.get()), hash);
+  }
+};
+
+struct Blake3Hasher {
+  static constexpr Algorithm algorithm = Algorithm::blake3;
+  using State = Blake3State;
+
+  template <PrefetchHint hint>
+  static void hash(const Key *key, const uint8_t *memory, uint64_t size,
+                   uint8_t *hash) {
+    Blake3State state;
+    state.begin(key);
+    state.absorb(memory, size, hint == _MM_HINT_NTA);
+    state.end(hash);
+  }
+  static void begin(State &state, const Key *key) { state.begin(key); }
+  static void absorb(State &state, const uint8_t *memory, uint64_t size) {
+    state.absorb(memory, size);
+  }
+  static void end(State &state, uint8_t *hash) { state.end(hash); }
+};
+
+// Calls visit(Hasher()) with the hasher of `algorithm`, for code that
+// handles several algorithms at once. Unknown algorithms are Meow.
+template <class Visitor>
+void visit_hasher(Algorithm algorithm, Visitor &&visit) {
+  switch (algorithm) {
+  case Algorithm::crc32c:
+    visit(Crc32cHasher());
+    break;
+  case Algorithm::xxh3:
+    visit(Xxh3Hasher());
+    break;
+  case Algorithm::blake3:
+    visit(Blake3Hasher());
+    break;
+  case Algorithm::meow:
+  default:
+    visit(MeowHasher());
+    break;
+  }
+}
+
+// Streaming states that a thread keeps between steps, of every hasher
+struct HasherStates {
+  HasherStates() : states() {}
+
+  template <class Hasher> std::vector<typename Hasher::State> &of() {
+    return std::get<std::vector<typename Hasher::State>>(states);
+  }
+
+  std::tuple<std::vector<MeowHasher::State>, std::vector<Crc32cHasher::State>,
+             std::vector<Xxh3Hasher::State>, std::vector<Blake3Hasher::State>>
+      states;
+};
+
+// Hash with the hasher of `algorithm`, for the few hashes of a job that are
+// not worth instantiating anything for. Unknown algorithms are Meow.
+inline void hash_with(Algorithm algorithm, const Key *key,
+                      const uint8_t *memory, uint64_t size, uint8_t *hash) {
+  visit_hasher(algorithm, [&](auto hasher) {
+    decltype(hasher)::template hash<_MM_HINT_T0>(key, memory, size, hash);
+  });
+}
+
+} // namespace vsign
@@ -0,0 +1,114 @@
+// Keys of keyed signatures. Expanded seeds are cached in
+// cache_directory()/keys, one file per key ID, readable by the owner only.
+// The cache is not available on Windows, seeds are expanded every time.
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+#include <immintrin.h>
+
+#ifndef _MSC_VER
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "hashers.h"
+#include "meow_hash/meow_hash_x64_aesni.h"
+#include "vsign_internal.h"
+
+namespace vsign {
+
+static_assert(sizeof(Key::seed) == sizeof(MeowDefaultSeed),
+              "Key::seed must hold a whole Meow seed");
+
+// Keyed BLAKE3 of a fixed context string under the expanded seed: headers
+// record it, and it tells nothing about the key to whoever reads them.
+// Never 0, that means "no key".
+static uint64_t key_id(const Key &key) {
+  static const char CONTEXT[] = "vsign key ID";
+  uint8_t hash[HASH_SIZE];
+  Blake3Hasher::hash<_MM_HINT_T0>(&key,
+                                  reinterpret_cast<const uint8_t *>(CONTEXT),
+                                  sizeof(CONTEXT) - 1, hash);
+  uint64_t id;
+  memcpy(&id, hash, sizeof(id));
+  return id | 1;
+}
+
+#ifndef _MSC_VER
+static std::string key_path(uint64_t id) {
+  char name[32];
+  snprintf(name, sizeof(name), "/keys/%016llx.seed",
+           static_cast<unsigned long long>(id));
+  return cache_directory() + name;
+}
+
+bool find_key(uint64_t id, Key &key) {
+  std::ifstream file(key_path(id), std::ios::binary);
+  if (!id || !file.read(reinterpret_cast<char *>(key.seed), sizeof(key.seed))) {
+    return false;
+  }
+  key.id = id;
+  return true;
+}
+
+// Written to a temporary file first, so readers never see half of a seed
+static void store_key(const Key &key) {
+  const std::string path = key_path(key.id);
+  const std::string temporary = path + "." + std::to_string(::getpid());
+  if (!make_directories(path.substr(0, path.rfind('/')))) {
+    return;
+  }
+  const int file =
+      ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (file == -1) {
+    return;
+  }
+  const bool written = ::write(file, key.seed, sizeof(key.seed)) ==
+                       static_cast<ssize_t>(sizeof(key.seed));
+  ::close(file);
+  if (!written || ::rename(temporary.c_str(), path.c_str()) != 0) {
+    ::unlink(temporary.c_str());
+  }
+}
+#else
+bool find_key(uint64_t, Key &) { return false; }
+
+static void store_key(const Key &) {}
+#endif
+
+Status load_key(const void *material, size_t size, Key &key,
+                std::string &error) {
+  if (!size) {
+    error = "Key is empty";
+    return Status::invalid_argument;
+  }
+  MeowExpandSeed(size, const_cast<void *>(material), key.seed);
+  key.id = key_id(key);
+  // for verifying signatures with this ID without the key material
+  store_key(key);
+  return Status::ok;
+}
+
+Status load_key_file(const char *path, Key &key, std::string &error) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    error = std::string("Can't open key file ") + path + ": " +
+            strerror(errno);
+    return Status::io_error;
+  }
+  const std::vector<char> material{std::istreambuf_iterator<char>(file),
+                                   std::istreambuf_iterator<char>()};
+  if (file.bad()) {
+    error = std::string("Can't read key file ") + path;
+    return Status::io_error;
+  }
+  return load_key(material.data(), material.size(), key, error);
+}
+
+} // namespace vsign
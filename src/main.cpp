@@ -1,16 +1,23 @@
+#include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <climits>
+#include <csignal>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <string>
 #include <thread>
 #include <vector>
 
-// Best hash that I could find so far:
-#include "meow_hash/meow_hash_x64_aesni.h"
+#ifndef _MSC_VER
+#include <unistd.h>
+#endif
 
-// Cross-platform memory mapping:
-#include "portable-memory-mapping/MemoryMapped.h"
+#include "vsign.h"
 
 #define REPORT_ERROR_AND_EXIT(user_description)                                \
   do {                                                                         \
@@ -31,27 +38,226 @@
 
 namespace vsign {
 
+// Command line: what to do with which files, and library options
 struct Settings {
   int verbose = 0;
   int verify = 0;
-  unsigned long long block_size = 1024 * 1024;
-  unsigned long long threads = std::thread::hardware_concurrency();
+  int tune = 0;
+  int watch = 0;
+  int delta = 0;
+  int patch = 0;
+  int dedup = 0;
+  int bloom = 0;
+  int probe = 0;
+  int merge = 0;
+  Options options{};
+  // more than one: sign with each into OUTPUT_FILE.SIZE in one pass
+  std::vector<uint64_t> block_sizes{};
+  // more than one: sign with each into OUTPUT_FILE.ALGORITHM in one pass
+  std::vector<Algorithm> algorithms{};
+  WatchOptions watch_options{};
+  int sample_seeded = 0; // sample.seed is given
+  DedupOptions dedup_options{};
+  // dedup, bloom and probe, shards of merge
+  std::vector<const char *> signatures{};
+  BloomOptions bloom_options{};
+  // verify only bytes [range_offset, range_offset + range_length) if set
+  unsigned long long range_offset = 0;
+  unsigned long long range_length = 0;
+  // sign only bytes [shard_start, shard_end) into a shard if set
+  unsigned long long shard_start = 0;
+  unsigned long long shard_end = 0;
+  // verify a random sample of blocks if set
+  SampleOptions sample{};
+  double corruption = 0.001; // fraction of blocks, for reported confidence
+  // key material of keyed signatures
+  const char *key = nullptr;
+  const char *seed_file = nullptr;
+  // control file with limits of the throttle, re-read while running
+  const char *limits_file = nullptr;
   const char *input = nullptr;
   const char *output = nullptr;
+  // delta: signature of the old file, input is the new one
+  const char *old_signature = nullptr;
+  // patch: delta to apply to input, output is optional
+  const char *delta_file = nullptr;
 };
 
-const char *USAGE_TEXT = "\nUsage: vsign [OPTIONS] INPUT_FILE [OUTPUT_FILE]\n";
+const char *USAGE_TEXT =
+    "\nUsage: vsign [OPTIONS] INPUT_FILE [OUTPUT_FILE]\n"
+    "       vsign verify [OPTIONS] INPUT_FILE [SIGNATURE_FILE]\n"
+    "       vsign tune [OPTIONS] PATH\n"
+    "       vsign watch [OPTIONS] DIRECTORY\n"
+    "       vsign delta [OPTIONS] OLD_SIGNATURE NEW_FILE > DELTA\n"
+    "       vsign patch [OPTIONS] OLD_FILE DELTA [NEW_FILE]\n"
+    "       vsign dedup [OPTIONS] SIGNATURE_FILE...\n"
+    "       vsign bloom [OPTIONS] FILTER SIGNATURE_FILE|FILTER...\n"
+    "       vsign probe [OPTIONS] FILTER SIGNATURE_FILE...\n"
+    "       vsign merge SIGNATURE_FILE SHARD_FILE...\n";
 const char *HELP_TEXT =
     "\n"
     "Creates binary signature of contents of INPUT_FILE and writes to "
     "OUTPUT_FILE\n"
     "(by default will write to 'INPUT_FILE.signature')\n\n"
+    "'vsign verify' is the same as -y.\n\n"
+    "'vsign tune PATH' reads a part of file PATH with different settings and\n"
+    "saves the fastest ones as a profile of the storage device holding PATH.\n"
+    "Later runs use the profile of the input file's device for every option\n"
+    "that is not given explicitly (-c, -e, -t).\n\n"
+    "'vsign watch DIRECTORY' signs every file under DIRECTORY whose signature\n"
+    "is missing or out of date, then keeps signatures up to date as files\n"
+    "change, until interrupted. Linux only.\n\n"
+    "'vsign delta OLD_SIGNATURE NEW_FILE' writes to standard output a delta\n"
+    "that turns the file signed into OLD_SIGNATURE into NEW_FILE: blocks\n"
+    "found in the old file are copied from it, the rest is included. Block\n"
+    "size, mode and key are those of OLD_SIGNATURE. Not available on\n"
+    "Windows.\n\n"
+    "'vsign patch OLD_FILE DELTA NEW_FILE' rebuilds NEW_FILE out of OLD_FILE\n"
+    "and DELTA, checking it against the signature in DELTA. Without NEW_FILE\n"
+    "OLD_FILE is patched in place if the delta allows it, or replaced.\n"
+    "Not available on Windows.\n\n"
+    "'vsign dedup SIGNATURE_FILE...' counts blocks that occur more than once\n"
+    "in all these files together, and shows the largest sets of them. Not\n"
+    "available on Windows.\n\n"
+    "'vsign bloom FILTER SIGNATURE_FILE...' writes a Bloom filter of hashes\n"
+    "of all blocks of these signatures to FILTER. Other filters among them\n"
+    "are merged into it.\n\n"
+    "'vsign probe FILTER SIGNATURE_FILE...' counts blocks of signatures that\n"
+    "are probably in FILTER.\n\n"
+    "'vsign merge SIGNATURE_FILE SHARD_FILE...' writes signature of a file\n"
+    "out of its shards signed with --shard, which must cover it whole. Not\n"
+    "available on Windows.\n\n"
     "Options:\n"
-    " -b\t\tBlock size (bytes), default is 1 048 576 bytes\n"
+    " --algorithm A\tHash of blocks: 'meow' (default, fastest), 'crc32c'\n"
+    "\t\t(checksum of storage systems, can't be keyed), 'xxh3' (no\n"
+    "\t\tAES needed) or 'blake3' (cryptographic). Verification\n"
+    "\t\tfinds out the algorithm by itself. A list like meow,blake3\n"
+    "\t\tsigns with each into OUTPUT_FILE.ALGORITHM, reading\n"
+    "\t\tINPUT_FILE once (OUTPUT_FILE.SIZE.ALGORITHM with -b list)\n"
+    " -b\t\tBlock size (bytes), default is 1 048 576 bytes. A list\n"
+    "\t\tlike 4096,1048576 signs with each size into OUTPUT_FILE.SIZE,\n"
+    "\t\treading INPUT_FILE once; each size must divide larger ones\n"
+    " --bypass-cache\tKeep input out of the shared CPU cache, so that hashing\n"
+    "\t\tdoesn't evict what other processes keep there\n"
+    " -c\t\tBlocks taken by a thread at once, default is 1\n"
+    " --capacity N\tBloom: size filter for N hashes, default is as many as\n"
+    "\t\tthe signatures have\n"
+    " --checkpoint S\tSave progress to OUTPUT_FILE.checkpoint every S\n"
+    "\t\tseconds, default is 60, 0 turns checkpoints off\n"
+    " -d\t\tWatch: sign a file once it's not written to for this many\n"
+    "\t\tmilliseconds, default is 1000\n"
+    " -e\t\tI/O engine: 'mmap' (default), 'read' or 'direct'\n"
+    " --false-positives R\n"
+    "\t\tBloom: rate (0..1) of blocks that filter finds although\n"
+    "\t\tthey were not added, default is 0.01\n"
     " -h\t\tPrint help text\n"
+    " --limits F\tRead --max-bandwidth and --max-cpu from file F, lines\n"
+    "\t\tlike max_bandwidth=50 and max_cpu=25, every second\n"
+    " --max-bandwidth M\n"
+    "\t\tRead at most M MiB/s with all threads together\n"
+    " --max-cpu P\tLet every thread hash at most P percent of the time\n"
+    " --memory M\tDedup: keep at most M MiB of hashes in memory, spill\n"
+    "\t\tthe rest to temporary files, default is 1024\n"
+    " --per-device N\tWatch: sign at most N files of one disk at once,\n"
+    "\t\tdefault is 1 for spinning disks\n"
+    " --key KEY\tKeyed signature: without KEY nobody can compute it, or\n"
+    "\t\tcraft blocks with the same hashes. Verification finds\n"
+    "\t\tkeys used by this user before by themselves\n"
+    " --seed-file F\tSame, key is the contents of file F\n"
+    " --spill-dir D\tDedup: directory for temporary files, default is\n"
+    "\t\t$TMPDIR or /tmp\n"
+    " --priority P\tPriority of threads: 'normal' (default), 'low' (lowest\n"
+    "\t\tbest-effort I/O, nice 19) or 'idle' (idle I/O, SCHED_IDLE)\n"
+    " --resume\tContinue interrupted signing from OUTPUT_FILE.checkpoint,\n"
+    "\t\tif INPUT_FILE hasn't changed since (size, mtime, inode)\n"
+    " --shard START:END\n"
+    "\t\tSign only bytes [START, END) of INPUT_FILE into shard\n"
+    "\t\tOUTPUT_FILE, see 'vsign merge'. Both are multiples of block\n"
+    "\t\tsize, no END means end of input\n"
     " -t\t\tThreads count, equals to number of logical cores by default \n"
+    " --top N\tDedup: show N largest sets of equal blocks, default is 10\n"
+    " --tree CHUNK\tTree mode: split blocks into chunks of CHUNK bytes that\n"
+    "\t\tare hashed in parallel, so a few huge blocks still keep all\n"
+    "\t\tcores busy. CHUNK must divide block size. Signatures differ\n"
+    "\t\tfrom plain ones, verification finds out the mode by itself\n"
     " -v\t\tVerbose output\n"
-    " -y\t\tVerify that OUTPUT_FILE contains correct signature of INPUT_FILE\n";
+    " --trust-cache\tSkip INPUT_FILE if it's unchanged since it was signed,\n"
+    "\t\tjudging by its size, mtime, ctime and inode\n"
+    " --revalidate\tIf INPUT_FILE seems unchanged, verify its signature and\n"
+    "\t\tsign it again only if it doesn't match\n"
+    " -y\t\tVerify that OUTPUT_FILE contains correct signature of INPUT_FILE\n"
+    " --range OFFSET:LENGTH\n"
+    "\t\tVerify only blocks holding these bytes of INPUT_FILE\n"
+    " --sample N%|N\tVerify only N percent or N randomly chosen blocks\n"
+    " --seed N\tSeed that chooses blocks to sample, random by default\n"
+    " --corruption R\tReport chance to catch R (0..1) of blocks corrupted,\n"
+    "\t\tdefault is 0.001\n"
+    "\n"
+    "Tuning profiles are stored in $VSIGN_CACHE_DIR, $XDG_CACHE_HOME/vsign\n"
+    "or ~/.cache/vsign\n";
+
+// Options give sizes and bandwidths in MiB (MiB/s)
+static uint64_t mib_to_bytes(double mib) {
+  return static_cast<uint64_t>(mib * 1024 * 1024);
+}
+
+// Applies limits of a control file to the throttle, now and then every
+// second for as long as it lives, so that they can be changed on the fly.
+// Limits missing from the file are kept.
+class LimitsFile {
+public:
+  LimitsFile(const char *path, const std::shared_ptr<Throttle> &throttle)
+      : path_(path), throttle_(throttle), stop_(0), thread_() {
+    if (path_) {
+      read();
+      thread_ = std::thread(&LimitsFile::run, this);
+    }
+  }
+  ~LimitsFile() {
+    if (thread_.joinable()) {
+      stop_ = 1;
+      thread_.join();
+    }
+  }
+  LimitsFile(const LimitsFile &) = delete;
+  LimitsFile &operator=(const LimitsFile &) = delete;
+
+private:
+  void read() {
+    std::ifstream file(path_);
+    uint64_t max_bandwidth = throttle_->max_bandwidth();
+    unsigned max_cpu = throttle_->max_cpu();
+    std::string line;
+    while (std::getline(file, line)) {
+      const size_t equals = line.find('=');
+      if (line.empty() || line[0] == '#' || equals == std::string::npos) {
+        continue;
+      }
+      const std::string key = line.substr(0, equals);
+      const char *value = line.c_str() + equals + 1;
+      if (key == "max_bandwidth")
+        max_bandwidth = mib_to_bytes(std::strtod(value, nullptr));
+      else if (key == "max_cpu")
+        max_cpu = static_cast<unsigned>(std::strtoul(value, nullptr, 0));
+    }
+    throttle_->set(max_bandwidth, max_cpu);
+  }
+
+  void run() {
+    while (!stop_) {
+      for (int step = 0; step < 10 && !stop_; ++step) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      }
+      read();
+    }
+  }
+
+  const char *path_;
+  std::shared_ptr<Throttle> throttle_;
+  std::atomic<int> stop_;
+  int reserved_ = 0;
+  std::thread thread_;
+};
 
 void print_help_and_exit() {
   std::cout << USAGE_TEXT << HELP_TEXT;
@@ -60,164 +266,679 @@ void print_help_and_exit() {
 
 Settings parse_arguments(int argc, char **argv) {
   vsign::Settings settings{};
-  for (int count = 1; count < argc; ++count) {
+  settings.options.checkpoint_interval = 60;
+  settings.options.throttle = std::make_shared<Throttle>();
+  Throttle &throttle = *settings.options.throttle;
+  int first_arg = 1;
+  if (argc > 1 && !strcmp(argv[1], "tune")) {
+    settings.tune = 1;
+    first_arg = 2;
+  } else if (argc > 1 && !strcmp(argv[1], "verify")) {
+    settings.verify = 1;
+    first_arg = 2;
+  } else if (argc > 1 && !strcmp(argv[1], "watch")) {
+    settings.watch = 1;
+    first_arg = 2;
+  } else if (argc > 1 && !strcmp(argv[1], "delta")) {
+    settings.delta = 1;
+    first_arg = 2;
+  } else if (argc > 1 && !strcmp(argv[1], "patch")) {
+    settings.patch = 1;
+    first_arg = 2;
+  } else if (argc > 1 && !strcmp(argv[1], "dedup")) {
+    settings.dedup = 1;
+    first_arg = 2;
+  } else if (argc > 1 && !strcmp(argv[1], "bloom")) {
+    settings.bloom = 1;
+    first_arg = 2;
+  } else if (argc > 1 && !strcmp(argv[1], "probe")) {
+    settings.probe = 1;
+    first_arg = 2;
+  } else if (argc > 1 && !strcmp(argv[1], "merge")) {
+    settings.merge = 1;
+    first_arg = 2;
+  }
+  for (int count = first_arg; count < argc; ++count) {
     const char *current_arg = argv[count];
     if (current_arg[0] == '-') {
-      if (!strcmp(current_arg, "-v"))
+      if (!strcmp(current_arg, "-v")) {
         settings.verbose = 1;
-      else if (!strcmp(current_arg, "-y")) {
-	REPORT_ERROR_AND_EXIT("Verification is not implemented yet");
+        settings.options.verbose = 1;
+      }
+      else if (!strcmp(current_arg, "-y"))
         settings.verify = 1;
+      else if (!strcmp(current_arg, "-b") && count + 1 < argc) {
+        settings.block_sizes.clear();
+        for (const char *size = argv[++count]; *size;) {
+          char *end = nullptr;
+          settings.block_sizes.push_back(std::strtoull(size, &end, 0));
+          if (*end && *end != ',') {
+            REPORT_ERROR_AND_EXIT("Wrong block size (-b): " << argv[count]
+                                                            << USAGE_TEXT);
+          }
+          size = *end ? end + 1 : end;
+        }
+        if (!settings.block_sizes.empty()) {
+          settings.options.block_size = settings.block_sizes.front();
+        }
+      }
+      else if (!strcmp(current_arg, "-c") && count + 1 < argc)
+        settings.options.batch = std::strtoull(argv[++count], nullptr, 0);
+      else if (!strcmp(current_arg, "--checkpoint") && count + 1 < argc)
+        settings.options.checkpoint_interval =
+            static_cast<unsigned>(std::strtoul(argv[++count], nullptr, 0));
+      else if (!strcmp(current_arg, "--resume"))
+        settings.options.resume = 1;
+      else if (!strcmp(current_arg, "--bypass-cache"))
+        settings.options.bypass_cache = 1;
+      else if (!strcmp(current_arg, "--algorithm") && count + 1 < argc) {
+        settings.algorithms.clear();
+        std::string names = argv[++count];
+        for (size_t start = 0; start <= names.size();) {
+          size_t end = names.find(',', start);
+          end = end == std::string::npos ? names.size() : end;
+          Algorithm algorithm = Algorithm::meow;
+          if (!parse_algorithm(names.substr(start, end - start).c_str(),
+                               algorithm)) {
+            REPORT_ERROR_AND_EXIT("Unknown hash algorithm (--algorithm): "
+                                  << argv[count] << USAGE_TEXT);
+          }
+          settings.algorithms.push_back(algorithm);
+          start = end + 1;
+        }
+        settings.options.algorithm = settings.algorithms.front();
+      }
+      else if (!strcmp(current_arg, "--max-bandwidth") && count + 1 < argc) {
+        const double bandwidth = std::strtod(argv[++count], nullptr);
+        if (bandwidth <= 0) {
+          REPORT_ERROR_AND_EXIT("Wrong bandwidth (--max-bandwidth), "
+                                "expected MiB/s: "
+                                << argv[count] << USAGE_TEXT);
+        }
+        throttle.set(mib_to_bytes(bandwidth), throttle.max_cpu());
+      }
+      else if (!strcmp(current_arg, "--max-cpu") && count + 1 < argc) {
+        const unsigned long percent = std::strtoul(argv[++count], nullptr, 0);
+        if (percent < 1 || percent > 100) {
+          REPORT_ERROR_AND_EXIT("Wrong CPU limit (--max-cpu), expected "
+                                "percent from 1 to 100: "
+                                << argv[count] << USAGE_TEXT);
+        }
+        throttle.set(throttle.max_bandwidth(), static_cast<unsigned>(percent));
       }
-      else if (!strcmp(current_arg, "-b"))
-        settings.block_size = std::strtoull(argv[++count], nullptr, 0);
-      else if (!strcmp(current_arg, "-t"))
-        settings.threads = std::strtoull(argv[++count], nullptr, 0);
+      else if (!strcmp(current_arg, "--limits") && count + 1 < argc)
+        settings.limits_file = argv[++count];
+      else if (!strcmp(current_arg, "--priority") && count + 1 < argc) {
+        const char *priority = argv[++count];
+        if (!strcmp(priority, "normal"))
+          settings.options.priority = Priority::normal;
+        else if (!strcmp(priority, "low"))
+          settings.options.priority = Priority::low;
+        else if (!strcmp(priority, "idle"))
+          settings.options.priority = Priority::idle;
+        else
+          REPORT_ERROR_AND_EXIT("Unknown priority (--priority): "
+                                << priority << USAGE_TEXT);
+      }
+      else if (!strcmp(current_arg, "-d") && count + 1 < argc)
+        settings.watch_options.debounce_ms =
+            std::strtoul(argv[++count], nullptr, 0);
+      else if (!strcmp(current_arg, "--memory") && count + 1 < argc) {
+        const double memory = std::strtod(argv[++count], nullptr);
+        if (memory <= 0) {
+          REPORT_ERROR_AND_EXIT("Wrong memory budget (--memory), expected "
+                                "MiB: "
+                                << argv[count] << USAGE_TEXT);
+        }
+        settings.dedup_options.memory_budget = mib_to_bytes(memory);
+      }
+      else if (!strcmp(current_arg, "--spill-dir") && count + 1 < argc)
+        settings.dedup_options.spill_directory = argv[++count];
+      else if (!strcmp(current_arg, "--top") && count + 1 < argc)
+        settings.dedup_options.top = std::strtoull(argv[++count], nullptr, 0);
+      else if (!strcmp(current_arg, "--per-device") && count + 1 < argc)
+        settings.watch_options.jobs_per_device =
+            static_cast<unsigned>(std::strtoul(argv[++count], nullptr, 0));
+      else if (!strcmp(current_arg, "-e") && count + 1 < argc) {
+        settings.options.engine = parse_engine(argv[++count]);
+        if (settings.options.engine == Engine::automatic) {
+          REPORT_ERROR_AND_EXIT("Unknown I/O engine (-e): "
+                                << argv[count] << USAGE_TEXT);
+        }
+      }
+      else if (!strcmp(current_arg, "-t") && count + 1 < argc)
+        settings.options.threads = std::strtoull(argv[++count], nullptr, 0);
       else if (!strcmp(current_arg, "-h"))
         print_help_and_exit();
+      else if (!strcmp(current_arg, "--trust-cache"))
+        settings.options.cache = CachePolicy::trust;
+      else if (!strcmp(current_arg, "--revalidate"))
+        settings.options.cache = CachePolicy::revalidate;
+      else if (!strcmp(current_arg, "--shard") && count + 1 < argc) {
+        char *end = nullptr;
+        settings.shard_start = std::strtoull(argv[++count], &end, 0);
+        settings.shard_end = ULLONG_MAX;
+        if (*end == ':' && end[1]) {
+          settings.shard_end = std::strtoull(end + 1, &end, 0);
+        } else if (*end == ':') {
+          ++end;
+        }
+        if (*end || settings.shard_end <= settings.shard_start) {
+          REPORT_ERROR_AND_EXIT("Wrong shard (--shard), expected "
+                                "START:END: "
+                                << argv[count] << USAGE_TEXT);
+        }
+      }
+      else if (!strcmp(current_arg, "--range") && count + 1 < argc) {
+        char *end = nullptr;
+        settings.range_offset = std::strtoull(argv[++count], &end, 0);
+        if (*end == ':') {
+          settings.range_length = std::strtoull(end + 1, &end, 0);
+        }
+        if (*end || !settings.range_length) {
+          REPORT_ERROR_AND_EXIT("Wrong range (--range), expected "
+                                "OFFSET:LENGTH: "
+                                << argv[count] << USAGE_TEXT);
+        }
+        settings.verify = 1;
+      }
+      else if (!strcmp(current_arg, "--sample") && count + 1 < argc) {
+        char *end = nullptr;
+        const double amount = std::strtod(argv[++count], &end);
+        if (*end == '%' && !end[1] && amount > 0 && amount <= 100) {
+          settings.sample.percent = amount;
+        } else if (!*end && amount >= 1) {
+          settings.sample.count = static_cast<uint64_t>(amount);
+        } else {
+          REPORT_ERROR_AND_EXIT("Wrong sample size (--sample), expected "
+                                "percent of blocks or their count: "
+                                << argv[count] << USAGE_TEXT);
+        }
+        settings.verify = 1;
+      }
+      else if (!strcmp(current_arg, "--seed") && count + 1 < argc) {
+        settings.sample.seed = std::strtoull(argv[++count], nullptr, 0);
+        settings.sample_seeded = 1;
+      }
+      else if (!strcmp(current_arg, "--tree") && count + 1 < argc) {
+        settings.options.chunk_size = std::strtoull(argv[++count], nullptr, 0);
+        if (settings.options.chunk_size < HASH_SIZE) {
+          REPORT_ERROR_AND_EXIT("Wrong chunk size (--tree): "
+                                << argv[count] << USAGE_TEXT);
+        }
+      }
+      else if (!strcmp(current_arg, "--key") && count + 1 < argc)
+        settings.key = argv[++count];
+      else if (!strcmp(current_arg, "--seed-file") && count + 1 < argc)
+        settings.seed_file = argv[++count];
+      else if (!strcmp(current_arg, "--false-positives") &&
+               count + 1 < argc) {
+        const double rate = std::strtod(argv[++count], nullptr);
+        if (!(rate > 0 && rate < 1)) {
+          REPORT_ERROR_AND_EXIT("Wrong false positive rate "
+                                "(--false-positives), expected a number in "
+                                "(0, 1): "
+                                << argv[count] << USAGE_TEXT);
+        }
+        settings.bloom_options.false_positive_rate = rate;
+      }
+      else if (!strcmp(current_arg, "--capacity") && count + 1 < argc)
+        settings.bloom_options.capacity =
+            std::strtoull(argv[++count], nullptr, 0);
+      else if (!strcmp(current_arg, "--corruption") && count + 1 < argc) {
+        settings.corruption = std::strtod(argv[++count], nullptr);
+        if (settings.corruption <= 0 || settings.corruption > 1) {
+          REPORT_ERROR_AND_EXIT("Wrong corruption rate (--corruption), "
+                                "expected a number in (0, 1]: "
+                                << argv[count] << USAGE_TEXT);
+        }
+      }
       else
         REPORT_ERROR_AND_EXIT("Wrong argument: " << current_arg << USAGE_TEXT);
+    } else if (settings.merge && settings.output == nullptr) {
+      settings.output = current_arg;
+    } else if (settings.dedup || settings.merge ||
+               ((settings.bloom || settings.probe) && settings.input)) {
+      settings.signatures.push_back(current_arg);
+    } else if (settings.delta && settings.old_signature == nullptr) {
+      settings.old_signature = current_arg;
+    } else if (settings.patch && settings.input && !settings.delta_file) {
+      settings.delta_file = current_arg;
     } else {
       if (settings.input == nullptr) {
         settings.input = current_arg;
-      } else if (settings.output == nullptr) {
+      } else if (settings.output == nullptr && !settings.tune &&
+                 !settings.watch && !settings.delta) {
         settings.output = current_arg;
       } else {
         REPORT_ERROR_AND_EXIT(
             "What do you mean by this argument?\n"
             << current_arg
             << "\ninput file already defined as: " << settings.input
-            << "\nand output file already defined as: " << settings.output
-            << USAGE_TEXT);
+            << "\nand output file already defined as: "
+            << (settings.output ? settings.output : "(none)") << USAGE_TEXT);
       }
     }
   }
 
   // Verify that settings are correct:
-  if (settings.input == nullptr) {
+  if (settings.merge) {
+    if (settings.signatures.empty()) {
+      REPORT_ERROR_AND_EXIT("Missing required argument: shard file names\n"
+                            << USAGE_TEXT);
+    }
+  } else if (settings.dedup || settings.bloom || settings.probe) {
+    if (settings.signatures.empty()) {
+      REPORT_ERROR_AND_EXIT("Missing required argument: signature file names\n"
+                            << USAGE_TEXT);
+    }
+  } else if (settings.input == nullptr) {
     REPORT_ERROR_AND_EXIT("Missing required argument: input file name\n"
                           << USAGE_TEXT);
-  } else if (settings.output == nullptr) {
+  } else if (settings.patch && settings.delta_file == nullptr) {
+    REPORT_ERROR_AND_EXIT("Missing required argument: delta file name\n"
+                          << USAGE_TEXT);
+  } else if (settings.shard_end &&
+             (settings.output == nullptr || settings.verify)) {
+    REPORT_ERROR_AND_EXIT("Signing a shard (--shard) needs OUTPUT_FILE, "
+                          "and can't be verified\n"
+                          << USAGE_TEXT);
+  } else if (settings.output == nullptr && !settings.tune &&
+             !settings.watch && !settings.delta && !settings.patch) {
     static std::string output_name{settings.input};
+    // not next to devices, into the current directory
+    if (output_name.compare(0, 5, "/dev/") == 0) {
+      output_name = output_name.substr(output_name.rfind('/') + 1);
+    }
     output_name += ".signature";
     settings.output = output_name.c_str();
   }
 
-  constexpr size_t MIN_BLOCK_SIZE = sizeof(meow_u128);
-  if (settings.block_size < MIN_BLOCK_SIZE) {
-    REPORT_ERROR_AND_EXIT("You've set block size (-b) to "
-                          << settings.block_size
-                          << " bytes but minimal block size is "
-                          << MIN_BLOCK_SIZE << " bytes\n"
+  constexpr size_t MIN_BLOCK_SIZE = HASH_SIZE;
+  if (settings.block_sizes.empty()) {
+    settings.block_sizes.push_back(settings.options.block_size);
+  }
+  for (uint64_t block_size : settings.block_sizes) {
+    if (block_size < MIN_BLOCK_SIZE) {
+      REPORT_ERROR_AND_EXIT("You've set block size (-b) to "
+                            << block_size
+                            << " bytes but minimal block size is "
+                            << MIN_BLOCK_SIZE << " bytes\n"
+                            << USAGE_TEXT);
+    }
+  }
+  if (settings.block_sizes.size() > 1 &&
+      (settings.verify || settings.tune || settings.watch || settings.delta ||
+       settings.patch)) {
+    REPORT_ERROR_AND_EXIT("Several block sizes (-b) are for signing only\n"
+                          << USAGE_TEXT);
+  }
+  if (settings.block_sizes.size() > 1 && settings.options.resume) {
+    REPORT_ERROR_AND_EXIT("Only signing with one block size (-b) can be "
+                          "resumed\n"
+                          << USAGE_TEXT);
+  }
+  if (settings.algorithms.size() > 1 &&
+      (settings.verify || settings.tune || settings.watch || settings.delta ||
+       settings.patch || settings.options.resume)) {
+    REPORT_ERROR_AND_EXIT("Several algorithms (--algorithm) are for signing "
+                          "without resuming only\n"
                           << USAGE_TEXT);
   }
+
+  if (settings.key || settings.seed_file) {
+    std::shared_ptr<Key> key(new Key());
+    std::string error;
+    const Status status =
+        settings.seed_file
+            ? load_key_file(settings.seed_file, *key, error)
+            : load_key(settings.key, strlen(settings.key), *key, error);
+    if (status != Status::ok) {
+      REPORT_ERROR_AND_EXIT(error);
+    }
+    settings.options.key = key;
+  }
   return settings;
 }
 
-void execute_worker(
-    const std::shared_ptr<std::atomic<size_t>> &total_blocks_read,
-    size_t block_size, const std::shared_ptr<MemoryMapped> &input,
-    const std::shared_ptr<MemoryMapped> &output) {
-  try {
-    // calculate block sizes and last block position
-    int last_block_size = input->size() % block_size;
-    const size_t last_position =
-        input->size() / block_size - (last_block_size ? 0 : 1);
-    if (last_block_size == 0) {
-      last_block_size = block_size;
-    }
-
-    // get raw pointers to data
-    uint8_t *in_mem_begin = static_cast<uint8_t *>(input->accessData());
-    meow_u128 *out_mem_begin = static_cast<meow_u128 *>(output->accessData());
-
-    for (;;) {
-      // interlocked increment, strong memory ordering
-      const size_t position = ++(*total_blocks_read) - 1;
-      // calculate memory positions where to read/write
-      void *input_memory = in_mem_begin + position * block_size;
-      meow_u128 *output_memory = out_mem_begin + position;
-
-      if (position < last_position) {
-        *output_memory = MeowHash(MeowDefaultSeed, block_size, input_memory);
-      } else if (position == last_position) {
-        *output_memory =
-            MeowHash(MeowDefaultSeed, last_block_size, input_memory);
-      } else {
-        // end of file reached
-        break;
-      }
-    }
-  } catch (const std::exception &error) {
-    printf("Sorry, something went wrong: %s\n", error.what());
-    exit(EXIT_FAILURE);
-  } catch (...) {
-    printf("Sorry, something went wrong\n");
-    exit(EXIT_FAILURE);
+void tune(const Settings &settings) {
+  Options best = settings.options;
+  double bandwidth = 0;
+  std::string error;
+  const Status status =
+      tune_device(settings.input, best, bandwidth, error,
+                  settings.verbose ? &std::cout : nullptr);
+  if (status != Status::ok) {
+    REPORT_ERROR_AND_EXIT(error);
   }
+  std::cout << "Best settings: engine " << engine_name(best.engine) << ", "
+            << best.threads << " threads, " << best.batch
+            << " blocks at once, " << bandwidth << " MiB/s\n"
+            << "Saved to " << device_profile_path(settings.input) << "\n";
 }
 
-void run(const Settings &settings) {
+static std::atomic<int> stop_watching{0};
+
+static void request_stop(int) { stop_watching = 1; }
+
+void watch(const Settings &settings) {
+  Options options = settings.options;
+  if (apply_device_profile(settings.input, options) && settings.verbose) {
+    std::cout << "Using tuning profile "
+              << device_profile_path(settings.input) << "\n";
+  }
+  std::signal(SIGINT, request_stop);
+  std::signal(SIGTERM, request_stop);
+  const LimitsFile limits(settings.limits_file, options.throttle);
+  std::string error;
+  if (watch_tree(settings.input, options, settings.watch_options,
+                 stop_watching, error, &std::cout) != Status::ok) {
+    REPORT_ERROR_AND_EXIT(error);
+  }
+}
+
+// Standard output is the delta, so everything else goes to standard error
+void delta(const Settings &settings) {
+#ifndef _MSC_VER
+  if (::isatty(STDOUT_FILENO)) {
+    REPORT_ERROR_AND_EXIT("Delta is binary, redirect standard output into a "
+                          "file or pipe"
+                          << USAGE_TEXT);
+  }
+#endif
+  Options options = settings.options;
+  if (apply_device_profile(settings.input, options) && settings.verbose) {
+    std::cerr << "Using tuning profile "
+              << device_profile_path(settings.input) << "\n";
+  }
+  Signer signer(options);
+  const LimitsFile limits(settings.limits_file, options.throttle);
+  DeltaReport report;
+  if (signer.delta(settings.old_signature, settings.input, 1, &report) !=
+      Status::ok) {
+    REPORT_ERROR_AND_EXIT(signer.error());
+  }
   if (settings.verbose) {
-    std::cout << "Running vsign with settings:\n"
-              << "verbose: " << settings.verbose << "\n"
-              << "verify: " << settings.verify << "\n"
-              << "block_size: " << settings.block_size << "\n"
-              << "threads: " << settings.threads << "\n"
-              << "input: " << settings.input << "\n"
-              << "output: " << settings.output << "\n";
+    std::cerr << "Delta of " << report.new_size << " bytes: "
+              << report.copied_bytes << " copied, " << report.literal_bytes
+              << " literal, " << report.op_count << " ops\n";
   }
+}
 
-  auto total_blocks_read = std::make_shared<std::atomic<size_t>>();
+void patch(const Settings &settings) {
+  Options options = settings.options;
+  if (apply_device_profile(settings.input, options) && settings.verbose) {
+    std::cout << "Using tuning profile "
+              << device_profile_path(settings.input) << "\n";
+  }
+  Signer signer(options);
+  const LimitsFile limits(settings.limits_file, options.throttle);
+  PatchReport report;
+  if (signer.patch(settings.input, settings.delta_file, settings.output,
+                   &report) != Status::ok) {
+    REPORT_ERROR_AND_EXIT(signer.error());
+  }
+  if (settings.verbose) {
+    std::cout << (report.in_place ? "Patched in place, " : "Rebuilt, ")
+              << report.new_size << " bytes: " << report.written_bytes
+              << " written, " << report.copied_bytes << " copied, "
+              << report.unchanged_bytes << " unchanged\n";
+  }
+}
 
-  // Init input
-  auto input = std::make_shared<MemoryMapped>();
-  bool ok = input->open_read(settings.input);
-  if (!ok) {
-    REPORT_ERROR_AND_EXIT("Can't map input file " << settings.input
-                                                  << " into memory");
+static std::string hex(const uint8_t *data, size_t size) {
+  static const char digits[] = "0123456789abcdef";
+  std::string text;
+  for (size_t i = 0; i < size; ++i) {
+    text += digits[data[i] >> 4];
+    text += digits[data[i] & 15];
   }
+  return text;
+}
 
-  // Init output
-  const size_t last_block_size =
-      input->size() % settings.block_size > 0 ? sizeof(meow_u128) : 0;
-  const size_t output_size =
-      sizeof(meow_u128) * (input->size() / settings.block_size) +
-      last_block_size;
+void dedup(const Settings &settings) {
+  DedupReport report;
+  std::string error;
+  if (find_duplicates(settings.signatures.data(), settings.signatures.size(),
+                      settings.options, settings.dedup_options, report,
+                      error) != Status::ok) {
+    REPORT_ERROR_AND_EXIT(error);
+  }
+  const double percent =
+      report.bytes ? 100.0 * static_cast<double>(report.duplicate_bytes) /
+                         static_cast<double>(report.bytes)
+                   : 0;
+  std::cout << report.files << " files, " << report.blocks << " blocks, "
+            << report.bytes << " bytes\n"
+            << report.unique_blocks << " distinct blocks, "
+            << report.duplicate_blocks << " duplicates, "
+            << report.duplicate_bytes << " bytes (" << percent
+            << "%) saved by storing every block once\n";
+  if (settings.verbose && report.spilled_shards) {
+    std::cout << report.spilled_shards << " hash table shards spilled "
+              << "to disk\n";
+  }
+  if (!report.top.empty()) {
+    std::cout << "Largest sets of equal blocks:\n";
+  }
+  for (const DuplicateSet &set : report.top) {
+    std::cout << "  " << set.count << " x " << set.size << " bytes, first in "
+              << settings.signatures[set.first_file] << " block "
+              << set.first_block << ", hash "
+              << hex(set.hash, sizeof(set.hash)) << "\n";
+  }
+}
 
-  auto output = std::make_shared<MemoryMapped>();
-  ok = output->open_write(settings.output, output_size);
-  if (!ok) {
-    REPORT_ERROR_AND_EXIT("Can't map output file " << settings.output
-                                                   << " into memory");
+void bloom(const Settings &settings) {
+  BloomFilter filter;
+  std::string error;
+  if (build_bloom_filter(settings.signatures.data(),
+                         settings.signatures.size(), settings.options,
+                         settings.bloom_options, filter, error) != Status::ok ||
+      filter.save(settings.input, error) != Status::ok) {
+    REPORT_ERROR_AND_EXIT(error);
   }
+  const BloomHeader &header = filter.header();
+  std::cout << "Filter of " << header.hash_count << " hashes, "
+            << header.line_count * BLOOM_LINE << " bytes, finds "
+            << filter.false_positive_rate() * 100
+            << "% of other hashes\n";
+}
 
-  // start workers
-  std::vector<std::thread> threads;
-  const size_t threads_to_create = settings.threads - 1;
-  threads.reserve(threads_to_create);
-  size_t failed_threads = 0;
-  for (size_t i = 0; i < threads_to_create; ++i) {
-    try {
-      threads.emplace_back(execute_worker, total_blocks_read,
-                           settings.block_size, input, output);
-    } catch (const std::system_error &error) {
-      if (settings.verbose) {
-        std::cout << "Couldn't create thread: " << error.what() << "\n";
-      }
-      ++failed_threads;
-      if (failed_threads < threads_to_create) {
-        --i; // retry for some time, but not infinitely
+void probe(const Settings &settings) {
+  BloomFilter filter;
+  std::string error;
+  if (filter.load(settings.input, error) != Status::ok) {
+    REPORT_ERROR_AND_EXIT(error);
+  }
+  const BloomHeader &filter_header = filter.header();
+  constexpr size_t PIECE = 1 << 20; // hashes read at once
+  std::vector<uint8_t> hashes(PIECE * HASH_SIZE);
+  std::vector<uint8_t> found(PIECE);
+  uint64_t probed = 0;
+  std::chrono::steady_clock::duration spent{};
+  for (const char *path : settings.signatures) {
+    SignatureHeader header;
+    if (!read_signature_header(path, header)) {
+      REPORT_ERROR_AND_EXIT("Signature " << path << " has no header");
+    }
+    const uint64_t chunk_size =
+        header.flags & SIGNATURE_FLAG_TREE ? header.chunk_size : 0;
+    if (header.flags != filter_header.flags ||
+        header.algorithm != filter_header.algorithm ||
+        header.block_size != filter_header.block_size ||
+        chunk_size != filter_header.chunk_size ||
+        header.key_id != filter_header.key_id) {
+      REPORT_ERROR_AND_EXIT("Signature " << path << " is made of blocks "
+                            << "signed in another way (block size, "
+                            << "algorithm, mode or key) than the filter");
+    }
+    std::ifstream file(path, std::ios::binary);
+    file.seekg(header.header_size);
+    const uint64_t blocks =
+        (header.file_size + header.block_size - 1) / header.block_size;
+    uint64_t maybe = 0;
+    for (uint64_t done = 0; done < blocks;) {
+      const size_t size = static_cast<size_t>(
+          std::min<uint64_t>(PIECE, blocks - done));
+      if (!file.read(reinterpret_cast<char *>(hashes.data()),
+                     static_cast<std::streamsize>(size * HASH_SIZE))) {
+        REPORT_ERROR_AND_EXIT("Signature " << path << " is truncated");
       }
+      const auto start = std::chrono::steady_clock::now();
+      maybe += filter.contains(hashes.data(), size, found.data());
+      spent += std::chrono::steady_clock::now() - start;
+      done += size;
     }
+    probed += blocks;
+    std::cout << path << ": " << maybe << " of " << blocks
+              << " blocks are probably in the filter\n";
+  }
+  if (settings.verbose) {
+    const double seconds = std::chrono::duration<double>(spent).count();
+    std::cout << "Probed " << probed << " hashes at "
+              << (seconds > 0 ? static_cast<double>(probed) / seconds / 1e6
+                              : 0)
+              << " million per second\n";
+  }
+}
+
+void merge(const Settings &settings) {
+  std::string error;
+  if (merge_shards(settings.signatures.data(), settings.signatures.size(),
+                   settings.output, error) != Status::ok) {
+    REPORT_ERROR_AND_EXIT(error);
   }
+  if (settings.verbose) {
+    std::cout << "Merged " << settings.signatures.size() << " shards into "
+              << settings.output << "\n";
+  }
+}
 
-  // main thread already exists, so do some useful work here too:
-  execute_worker(total_blocks_read, settings.block_size, input, output);
+void run(const Settings &settings) {
+  Options options = settings.options;
+  if (apply_device_profile(settings.input, options) && settings.verbose) {
+    std::cout << "Using tuning profile "
+              << device_profile_path(settings.input) << "\n";
+  }
+  Signer signer(options);
+  const LimitsFile limits(settings.limits_file, options.throttle);
 
-  // Wait for completion of all threads
-  for (std::thread &thread : threads) {
-    thread.join();
+  if (settings.verbose) {
+    std::cout << "Running vsign with settings:\n"
+              << "verbose: " << settings.verbose << "\n"
+              << "verify: " << settings.verify << "\n"
+              << "block_size: " << signer.options().block_size << "\n"
+              << "chunk_size: " << signer.options().chunk_size << "\n"
+              << "threads: " << signer.options().threads << "\n"
+              << "batch: " << signer.options().batch << "\n"
+              << "engine: " << engine_name(signer.options().engine) << "\n"
+              << "algorithm: "
+              << algorithm_name(
+                     static_cast<uint32_t>(signer.options().algorithm))
+              << "\n"
+              << "checkpoint: " << options.checkpoint_interval << "\n"
+              << "max_bandwidth: "
+              << options.throttle->max_bandwidth() / (1024.0 * 1024)
+              << " MiB/s\n"
+              << "max_cpu: " << options.throttle->max_cpu() << "%\n"
+              << "bypass_cache: " << options.bypass_cache << "\n"
+              << "key: " << std::hex
+              << (options.key ? options.key->id : 0) << std::dec << "\n"
+              << "input: " << settings.input << "\n"
+              << "output: " << settings.output << "\n";
+  }
+
+  if (settings.verify && (settings.sample.percent || settings.sample.count)) {
+    SampleOptions sample = settings.sample;
+    if (!settings.sample_seeded) {
+      sample.seed = static_cast<uint64_t>(
+          std::chrono::system_clock::now().time_since_epoch().count());
+    }
+    SampleReport report;
+    const Status status = signer.verify_sample(settings.input, settings.output,
+                                               sample, nullptr, &report);
+    // seed lets the same blocks be checked again
+    std::cout << "Checked " << report.checked_blocks << " of "
+              << report.total_blocks << " blocks (seed " << sample.seed
+              << ")\n";
+    if (status != Status::ok) {
+      REPORT_ERROR_AND_EXIT(signer.error());
+    }
+    std::cout << "Sampled blocks are correct, chance to catch "
+              << settings.corruption * 100 << "% of blocks corrupted: "
+              << detection_confidence(report.total_blocks,
+                                      report.checked_blocks,
+                                      settings.corruption) *
+                     100
+              << "%\n";
+  } else if (settings.verify) {
+    const Status status =
+        settings.range_length
+            ? signer.verify_range(settings.input, settings.output,
+                                  settings.range_offset, settings.range_length)
+            : signer.verify_from_file(settings.input, settings.output);
+    if (status != Status::ok) {
+      REPORT_ERROR_AND_EXIT(signer.error());
+    }
+    std::cout << "Signature is correct\n";
+  } else if (settings.shard_end) {
+    if (settings.block_sizes.size() > 1 || settings.algorithms.size() > 1) {
+      REPORT_ERROR_AND_EXIT("A shard is signed with one block size and "
+                            "algorithm");
+    }
+    if (signer.sign_range_to_file(settings.input, settings.output,
+                                  settings.shard_start,
+                                  settings.shard_end - settings.shard_start) !=
+        Status::ok) {
+      REPORT_ERROR_AND_EXIT(signer.error());
+    }
+  } else if (settings.block_sizes.size() > 1 ||
+             settings.algorithms.size() > 1) {
+    const std::vector<Algorithm> chosen =
+        settings.algorithms.empty()
+            ? std::vector<Algorithm>{settings.options.algorithm}
+            : settings.algorithms;
+    std::vector<std::string> names;
+    std::vector<const char *> outputs;
+    std::vector<uint64_t> block_sizes;
+    std::vector<Algorithm> algorithms;
+    for (uint64_t block_size : settings.block_sizes) {
+      for (Algorithm algorithm : chosen) {
+        std::string name = settings.output;
+        if (settings.block_sizes.size() > 1) {
+          name += "." + std::to_string(block_size);
+        }
+        if (chosen.size() > 1) {
+          name += std::string(".") +
+                  algorithm_name(static_cast<uint32_t>(algorithm));
+        }
+        names.push_back(name);
+        block_sizes.push_back(block_size);
+        algorithms.push_back(algorithm);
+      }
+    }
+    for (const std::string &name : names) {
+      outputs.push_back(name.c_str());
+    }
+    bool skipped = false;
+    if (signer.sign_to_files(settings.input, block_sizes.data(),
+                             algorithms.data(), outputs.data(),
+                             outputs.size(), &skipped) != Status::ok) {
+      REPORT_ERROR_AND_EXIT(signer.error());
+    }
+    if (skipped && settings.verbose) {
+      std::cout << "Signatures are up to date\n";
+    }
+  } else {
+    bool skipped = false;
+    if (signer.sign_to_file(settings.input, settings.output, &skipped) !=
+        Status::ok) {
+      REPORT_ERROR_AND_EXIT(signer.error());
+    }
+    if (skipped && settings.verbose) {
+      std::cout << "Signature is up to date\n";
+    }
   }
 }
 } // namespace vsign
@@ -227,13 +948,32 @@ int main(int argc, char **argv) {
     auto start_time = std::chrono::system_clock::now();
 
     vsign::Settings settings = vsign::parse_arguments(argc, argv);
-    vsign::run(settings);
+    if (settings.tune) {
+      vsign::tune(settings);
+    } else if (settings.watch) {
+      vsign::watch(settings);
+    } else if (settings.delta) {
+      vsign::delta(settings);
+    } else if (settings.patch) {
+      vsign::patch(settings);
+    } else if (settings.dedup) {
+      vsign::dedup(settings);
+    } else if (settings.bloom) {
+      vsign::bloom(settings);
+    } else if (settings.probe) {
+      vsign::probe(settings);
+    } else if (settings.merge) {
+      vsign::merge(settings);
+    } else {
+      vsign::run(settings);
+    }
 
     auto duration = std::chrono::system_clock::now() - start_time;
     auto duration_ms =
         std::chrono::duration_cast<std::chrono::milliseconds>(duration);
     if (settings.verbose) {
-      std::cout << "Completed in " << duration_ms.count() << " milliseconds\n";
+      (settings.delta ? std::cerr : std::cout)
+          << "Completed in " << duration_ms.count() << " milliseconds\n";
     }
   } catch (const std::exception &error) {
     printf("Sorry, something went wrong: %s\n", error.what());
@@ -0,0 +1,264 @@
+// MeowHash() for block sizes known at compile time. Every block but the last
+// one of a job has the same power-of-two size, and hashing it this way skips
+// what MeowHash() does for inputs of any length: residual masking, the tail
+// of 32-byte lanes and choice of the loop at run time. Hashes are the same.
+//
+// Kernels also take the prefetch hint: _MM_HINT_NTA keeps input that is
+// hashed once from displacing what other processes have in the shared
+// last-level cache.
+#pragma once
+
+#include <cstdint>
+
+#include <immintrin.h>
+
+#include "meow_hash/meow_hash_x64_aesni.h"
+
+namespace vsign {
+
+using PrefetchHint = decltype(_MM_HINT_T0);
+
+// Hash accumulation lanes of MeowHash()
+struct MeowLanes {
+  meow_u128 xmm0, xmm1, xmm2, xmm3, xmm4, xmm5, xmm6, xmm7;
+};
+
+// Steps of MeowHash(), its macros are not defined outside of it
+inline void meow_mix_reg(meow_u128 &r1, meow_u128 &r2, meow_u128 &r3,
+                         meow_u128 &r4, meow_u128 &r5, meow_u128 i1,
+                         meow_u128 i2, meow_u128 i3, meow_u128 i4) {
+  r1 = _mm_aesdec_si128(r1, r2);
+  r3 = _mm_add_epi64(r3, i1);
+  r2 = _mm_xor_si128(r2, i2);
+  r2 = _mm_aesdec_si128(r2, r4);
+  r5 = _mm_add_epi64(r5, i3);
+  r4 = _mm_xor_si128(r4, i4);
+}
+
+inline void meow_mix(meow_u128 &r1, meow_u128 &r2, meow_u128 &r3,
+                     meow_u128 &r4, meow_u128 &r5, const meow_u8 *input) {
+  meow_mix_reg(r1, r2, r3, r4, r5,
+               _mm_loadu_si128(reinterpret_cast<const __m128i *>(input + 15)),
+               _mm_loadu_si128(reinterpret_cast<const __m128i *>(input + 0)),
+               _mm_loadu_si128(reinterpret_cast<const __m128i *>(input + 1)),
+               _mm_loadu_si128(reinterpret_cast<const __m128i *>(input + 16)));
+}
+
+inline void meow_shuffle(meow_u128 &r1, meow_u128 &r2, meow_u128 r3,
+                         meow_u128 &r4, meow_u128 &r5, meow_u128 r6) {
+  r1 = _mm_aesdec_si128(r1, r4);
+  r2 = _mm_add_epi64(r2, r5);
+  r4 = _mm_xor_si128(r4, r6);
+  r4 = _mm_aesdec_si128(r4, r2);
+  r5 = _mm_add_epi64(r5, r6);
+  r2 = _mm_xor_si128(r2, r3);
+}
+
+inline void meow_seed(MeowLanes &lanes, const void *seed) {
+  const __m128i *memory = static_cast<const __m128i *>(seed);
+  lanes.xmm0 = _mm_loadu_si128(memory + 0);
+  lanes.xmm1 = _mm_loadu_si128(memory + 1);
+  lanes.xmm2 = _mm_loadu_si128(memory + 2);
+  lanes.xmm3 = _mm_loadu_si128(memory + 3);
+  lanes.xmm4 = _mm_loadu_si128(memory + 4);
+  lanes.xmm5 = _mm_loadu_si128(memory + 5);
+  lanes.xmm6 = _mm_loadu_si128(memory + 6);
+  lanes.xmm7 = _mm_loadu_si128(memory + 7);
+}
+
+// Hashes `count` 256-byte blocks, prefetching `distance` bytes ahead unless
+// it's 0. Returns where the blocks end.
+template <PrefetchHint hint, uint64_t distance>
+inline const meow_u8 *meow_blocks(MeowLanes &lanes, const meow_u8 *input,
+                                  uint64_t count) {
+  meow_u128 xmm0 = lanes.xmm0, xmm1 = lanes.xmm1, xmm2 = lanes.xmm2,
+            xmm3 = lanes.xmm3, xmm4 = lanes.xmm4, xmm5 = lanes.xmm5,
+            xmm6 = lanes.xmm6, xmm7 = lanes.xmm7;
+  for (; count; --count) {
+    if (distance) {
+      const char *ahead = reinterpret_cast<const char *>(input) + distance;
+      _mm_prefetch(ahead + 0x00, hint);
+      _mm_prefetch(ahead + 0x40, hint);
+      _mm_prefetch(ahead + 0x80, hint);
+      _mm_prefetch(ahead + 0xc0, hint);
+    }
+    meow_mix(xmm0, xmm4, xmm6, xmm1, xmm2, input + 0x00);
+    meow_mix(xmm1, xmm5, xmm7, xmm2, xmm3, input + 0x20);
+    meow_mix(xmm2, xmm6, xmm0, xmm3, xmm4, input + 0x40);
+    meow_mix(xmm3, xmm7, xmm1, xmm4, xmm5, input + 0x60);
+    meow_mix(xmm4, xmm0, xmm2, xmm5, xmm6, input + 0x80);
+    meow_mix(xmm5, xmm1, xmm3, xmm6, xmm7, input + 0xa0);
+    meow_mix(xmm6, xmm2, xmm4, xmm7, xmm0, input + 0xc0);
+    meow_mix(xmm7, xmm3, xmm5, xmm0, xmm1, input + 0xe0);
+    input += 0x100;
+  }
+  lanes = MeowLanes{xmm0, xmm1, xmm2, xmm3, xmm4, xmm5, xmm6, xmm7};
+  return input;
+}
+
+// Mixes in the less-than-32-byte residual and the length. `residual` and
+// `overflow` are xmm9 and xmm11 of MeowHash(), zeros if there's no residual.
+inline void meow_append(MeowLanes &lanes, meow_u128 residual,
+                        meow_u128 overflow, uint64_t size) {
+  const meow_u128 zero = _mm_setzero_si128();
+  const meow_u128 length = _mm_set_epi64x(0, static_cast<int64_t>(size));
+  meow_mix_reg(lanes.xmm0, lanes.xmm4, lanes.xmm6, lanes.xmm1, lanes.xmm2,
+               _mm_alignr_epi8(residual, overflow, 15), residual,
+               _mm_alignr_epi8(residual, overflow, 1), overflow);
+  meow_mix_reg(lanes.xmm1, lanes.xmm5, lanes.xmm7, lanes.xmm2, lanes.xmm3,
+               _mm_alignr_epi8(zero, length, 15), zero,
+               _mm_alignr_epi8(zero, length, 1), length);
+}
+
+// Mixes the eight lanes down to one 128-bit hash
+inline meow_u128 meow_fold(MeowLanes &lanes) {
+  meow_u128 &xmm0 = lanes.xmm0, &xmm1 = lanes.xmm1, &xmm2 = lanes.xmm2,
+            &xmm3 = lanes.xmm3, &xmm4 = lanes.xmm4, &xmm5 = lanes.xmm5,
+            &xmm6 = lanes.xmm6, &xmm7 = lanes.xmm7;
+  meow_shuffle(xmm0, xmm1, xmm2, xmm4, xmm5, xmm6);
+  meow_shuffle(xmm1, xmm2, xmm3, xmm5, xmm6, xmm7);
+  meow_shuffle(xmm2, xmm3, xmm4, xmm6, xmm7, xmm0);
+  meow_shuffle(xmm3, xmm4, xmm5, xmm7, xmm0, xmm1);
+  meow_shuffle(xmm4, xmm5, xmm6, xmm0, xmm1, xmm2);
+  meow_shuffle(xmm5, xmm6, xmm7, xmm1, xmm2, xmm3);
+  meow_shuffle(xmm6, xmm7, xmm0, xmm2, xmm3, xmm4);
+  meow_shuffle(xmm7, xmm0, xmm1, xmm3, xmm4, xmm5);
+  meow_shuffle(xmm0, xmm1, xmm2, xmm4, xmm5, xmm6);
+  meow_shuffle(xmm1, xmm2, xmm3, xmm5, xmm6, xmm7);
+  meow_shuffle(xmm2, xmm3, xmm4, xmm6, xmm7, xmm0);
+  meow_shuffle(xmm3, xmm4, xmm5, xmm7, xmm0, xmm1);
+
+  xmm0 = _mm_add_epi64(xmm0, xmm2);
+  xmm1 = _mm_add_epi64(xmm1, xmm3);
+  xmm4 = _mm_add_epi64(xmm4, xmm6);
+  xmm5 = _mm_add_epi64(xmm5, xmm7);
+  xmm0 = _mm_xor_si128(xmm0, xmm1);
+  xmm4 = _mm_xor_si128(xmm4, xmm5);
+  return _mm_add_epi64(xmm0, xmm4);
+}
+
+// Same as MeowHash(seed, Size, source). Size is a multiple of 256 bytes, so
+// there is no residual, and the main loop runs a constant number of times.
+// Unrolling it by hand four blocks at a time measured slower than leaving
+// that to the compiler.
+//
+// Blocks of a job come one after another from a large input, so it always
+// prefetches `distance` bytes ahead. MeowHash() doesn't below 256 KiB, as
+// small inputs are usually in cache already; for blocks streamed from memory
+// that costs about a sixth of the speed, and prefetching data that is in
+// cache costs nothing measurable. Farther or closer than 4 KiB is not faster.
+template <uint64_t Size, PrefetchHint hint = _MM_HINT_T0,
+          uint64_t distance = MEOW_PREFETCH>
+meow_u128 meow_hash_fixed(const void *seed, const void *source) {
+  static_assert(Size >= 256 && Size % 256 == 0, "no residual");
+  MeowLanes lanes;
+  meow_seed(lanes, seed);
+  meow_blocks<hint, distance>(lanes, static_cast<const meow_u8 *>(source),
+                              Size / 256);
+  const meow_u128 zero = _mm_setzero_si128();
+  meow_append(lanes, zero, zero, Size);
+  // no 32-byte lanes left
+  return meow_fold(lanes);
+}
+
+// Same as MeowHash(seed, size, source) for any size, always prefetching
+// `distance` bytes ahead with the given hint
+template <PrefetchHint hint, uint64_t distance = MEOW_PREFETCH>
+meow_u128 meow_hash_any(const void *seed, uint64_t size, const void *source) {
+  MeowLanes lanes;
+  meow_seed(lanes, seed);
+  const meow_u8 *start = static_cast<const meow_u8 *>(source);
+  const meow_u8 *input =
+      meow_blocks<hint, distance>(lanes, start, size >> 8);
+
+  // The part of residual that is not 16-byte aligned is loaded the way
+  // MeowHash() does, from a position that can't cross into the next page
+  meow_u128 residual = _mm_setzero_si128();
+  meow_u128 overflow = _mm_setzero_si128();
+  const meow_u8 *last = start + (size & ~uint64_t(0xf));
+  const unsigned partial = size & 0xf;
+  if (partial) {
+    const uintptr_t last_ok =
+        ((reinterpret_cast<uintptr_t>(start) + size - 1) |
+         (MEOW_PAGESIZE - 1)) -
+        16;
+    const unsigned align = reinterpret_cast<uintptr_t>(last) > last_ok
+                               ? reinterpret_cast<uintptr_t>(last) & 0xf
+                               : 0;
+    residual = _mm_shuffle_epi8(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(last - align)),
+        _mm_loadu_si128(
+            reinterpret_cast<const __m128i *>(&MeowShiftAdjust[align])));
+    residual = _mm_and_si128(
+        residual, _mm_loadu_si128(reinterpret_cast<const __m128i *>(
+                      &MeowMaskLen[0x10 - partial])));
+  }
+  if (size & 0x10) {
+    overflow = residual;
+    residual = _mm_loadu_si128(reinterpret_cast<const __m128i *>(last - 0x10));
+  }
+  meow_append(lanes, residual, overflow, size);
+
+  // full 32-byte lanes after the blocks
+  meow_u128 &xmm0 = lanes.xmm0, &xmm1 = lanes.xmm1, &xmm2 = lanes.xmm2,
+            &xmm3 = lanes.xmm3, &xmm4 = lanes.xmm4, &xmm5 = lanes.xmm5,
+            &xmm6 = lanes.xmm6, &xmm7 = lanes.xmm7;
+  const unsigned count = (size >> 5) & 0x7;
+  if (count > 0)
+    meow_mix(xmm2, xmm6, xmm0, xmm3, xmm4, input + 0x00);
+  if (count > 1)
+    meow_mix(xmm3, xmm7, xmm1, xmm4, xmm5, input + 0x20);
+  if (count > 2)
+    meow_mix(xmm4, xmm0, xmm2, xmm5, xmm6, input + 0x40);
+  if (count > 3)
+    meow_mix(xmm5, xmm1, xmm3, xmm6, xmm7, input + 0x60);
+  if (count > 4)
+    meow_mix(xmm6, xmm2, xmm4, xmm7, xmm0, input + 0x80);
+  if (count > 5)
+    meow_mix(xmm7, xmm3, xmm5, xmm0, xmm1, input + 0xa0);
+  if (count > 6)
+    meow_mix(xmm0, xmm4, xmm6, xmm1, xmm2, input + 0xc0);
+  return meow_fold(lanes);
+}
+
+// Same as MeowHash(seed, size, source), with a specialized kernel for
+// power-of-two sizes from 4 KiB to 16 MiB. Other sizes are hashed by
+// MeowHash() itself if the hint is _MM_HINT_T0.
+template <PrefetchHint hint = _MM_HINT_T0>
+meow_u128 meow_hash(void *seed, uint64_t size, const void *source) {
+  switch (size) {
+  case uint64_t(1) << 12:
+    return meow_hash_fixed<uint64_t(1) << 12, hint>(seed, source);
+  case uint64_t(1) << 13:
+    return meow_hash_fixed<uint64_t(1) << 13, hint>(seed, source);
+  case uint64_t(1) << 14:
+    return meow_hash_fixed<uint64_t(1) << 14, hint>(seed, source);
+  case uint64_t(1) << 15:
+    return meow_hash_fixed<uint64_t(1) << 15, hint>(seed, source);
+  case uint64_t(1) << 16:
+    return meow_hash_fixed<uint64_t(1) << 16, hint>(seed, source);
+  case uint64_t(1) << 17:
+    return meow_hash_fixed<uint64_t(1) << 17, hint>(seed, source);
+  case uint64_t(1) << 18:
+    return meow_hash_fixed<uint64_t(1) << 18, hint>(seed, source);
+  case uint64_t(1) << 19:
+    return meow_hash_fixed<uint64_t(1) << 19, hint>(seed, source);
+  case uint64_t(1) << 20:
+    return meow_hash_fixed<uint64_t(1) << 20, hint>(seed, source);
+  case uint64_t(1) << 21:
+    return meow_hash_fixed<uint64_t(1) << 21, hint>(seed, source);
+  case uint64_t(1) << 22:
+    return meow_hash_fixed<uint64_t(1) << 22, hint>(seed, source);
+  case uint64_t(1) << 23:
+    return meow_hash_fixed<uint64_t(1) << 23, hint>(seed, source);
+  case uint64_t(1) << 24:
+    return meow_hash_fixed<uint64_t(1) << 24, hint>(seed, source);
+  default:
+    if (hint == _MM_HINT_T0) {
+      return MeowHash(seed, size, const_cast<void *>(source));
+    }
+    return meow_hash_any<hint>(seed, size, source);
+  }
+}
+
+} // namespace vsign
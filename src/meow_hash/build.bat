@@ -15,7 +15,7 @@ call cl %common% -EHsc -TC ..\meow_example.cpp -Femeow_example_c.exe
 call cl %common% -EHsc ..\meow_example.cpp -Femeow_example.exe
 call cl %common% -EHsc ..\util\meow_test.cpp -Femeow_test.exe
 call cl %common% -arch:AVX2 ..\util\meow_search.cpp -Femeow_search.exe
-call cl %common% -arch:AVX2 ..\util\meow_bench.cpp -Femeow_bench.exe
+call cl %common% -arch:AVX2 ..\util\meow_bench.cpp ..\..\hashers.cpp -Femeow_bench.exe
 popd
 
 :SkipMSVC
@@ -32,7 +32,7 @@ set common=-I../ -Wno-deprecated-declarations -g -O3 -maes %*
 call clang++ %common% -msse4 ..\meow_example.cpp -o meow_example.exe
 call clang++ %common% -msse4 ..\util\meow_test.cpp -o meow_test.exe
 call clang++ %common% -mavx2 -mpclmul ..\util\meow_search.cpp -o meow_search.exe
-call clang++ %common% -mavx2 -mpclmul ..\util\meow_bench.cpp -o meow_bench.exe
+call clang++ %common% -mavx2 -mpclmul ..\util\meow_bench.cpp ..\..\hashers.cpp -o meow_bench.exe
 popd
 
 echo -------------------
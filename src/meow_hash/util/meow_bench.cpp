@@ -53,6 +53,13 @@ _rotl(int unsigned Value, int Count)
 #endif
 
 #include "meow_test.h"
+#include "../meow_fixed.h"
+#include "../hashers.h"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
 
 #define Kb(x) ((meow_u64)(x)*(meow_u64)1024)
 #define Mb(x) ((meow_u64)(x)*(meow_u64)1024*(meow_u64)1024)
@@ -790,9 +797,348 @@ WriteHTML(input_size_tests *Tests, char *HTMLFileName)
     }
 }
 
+//
+// NOTE: Block sizes of vsign, hashed with MeowHash and with the kernel
+// specialized for the size that vsign dispatches to. "Hot" hashes the same
+// block over and over from cache, "stream" hashes consecutive blocks of a
+// buffer much larger than the cache, the way vsign reads its input.
+//
+
+typedef meow_u128 fixed_bench_hash(void *Seed128, meow_u64 Len, const void *Source);
+
+static meow_u128
+MeowHashGeneric(void *Seed128, meow_u64 Len, const void *Source)
+{
+    return(MeowHash(Seed128, Len, (void *)Source));
+}
+
+static meow_u128
+MeowHashDispatched(void *Seed128, meow_u64 Len, const void *Source)
+{
+    return(vsign::meow_hash(Seed128, Len, Source));
+}
+
+static double
+HotBytesPerCycle(fixed_bench_hash *Hash, meow_u64 Size, meow_u8 *Buffer, meow_u128 *Slot)
+{
+    meow_u64 Runs = Mb(512) / Size;
+    meow_u64 ClockMin = (meow_u64)-1;
+    for(meow_u64 RunIndex = 0;
+        RunIndex < Runs;
+        ++RunIndex)
+    {
+        int Ignored[4];
+        int unsigned Ignored2;
+        CPUID(Ignored, 0);
+        meow_u64 StartClock = __rdtsc();
+        *Slot = Hash(MeowDefaultSeed, Size, Buffer);
+        meow_u64 EndClock = __rdtscp(&Ignored2);
+        CPUID(Ignored, 0);
+        
+        if(ClockMin > EndClock - StartClock)
+        {
+            ClockMin = EndClock - StartClock;
+        }
+    }
+    return((double)Size / (double)ClockMin);
+}
+
+static double
+StreamBytesPerCycle(fixed_bench_hash *Hash, meow_u64 Size, meow_u8 *Buffer, meow_u64 BufferSize)
+{
+    meow_u128 Accumulator = _mm_setzero_si128();
+    int unsigned Ignored2;
+    meow_u64 StartClock = __rdtsc();
+    for(meow_u64 Offset = 0;
+        Offset < BufferSize;
+        Offset += Size)
+    {
+        Accumulator = _mm_xor_si128(Accumulator, Hash(MeowDefaultSeed, Size, Buffer + Offset));
+    }
+    meow_u64 EndClock = __rdtscp(&Ignored2);
+    
+    // NOTE: Keep the optimizer from removing the hashing
+    volatile int Sink = _mm_cvtsi128_si32(Accumulator);
+    (void)Sink;
+    return((double)BufferSize / (double)(EndClock - StartClock));
+}
+
+static int
+BenchFixedSizes(void)
+{
+    meow_u64 BufferSize = Mb(512);
+    meow_u8 *Buffer = (meow_u8 *)aligned_alloc(CACHE_LINE_ALIGNMENT, BufferSize);
+    if(!Buffer)
+    {
+        fprintf(stderr, "ERROR: Unable to allocate buffer for hashing\n");
+        return(1);
+    }
+    FuddleBuffer(BufferSize, Buffer, 1);
+    
+    fprintf(stdout, "Fixed block sizes, bytes/cycle:\n");
+    fprintf(stdout, "    %9s %9s %9s %7s %9s %9s %7s\n", "size",
+            "hot", "fixed", "gain", "stream", "fixed", "gain");
+    for(meow_u64 Size = Kb(4);
+        Size <= Mb(16);
+        Size *= 2)
+    {
+        meow_u128 Generic = {};
+        meow_u128 Fixed = {};
+        double HotGeneric = HotBytesPerCycle(MeowHashGeneric, Size, Buffer, &Generic);
+        double HotFixed = HotBytesPerCycle(MeowHashDispatched, Size, Buffer, &Fixed);
+        if(!MeowHashesAreEqual(Generic, Fixed))
+        {
+            fprintf(stderr, "ERROR: Hashes of %llu bytes differ\n", (unsigned long long)Size);
+            free(Buffer);
+            return(1);
+        }
+        
+        double StreamGeneric = StreamBytesPerCycle(MeowHashGeneric, Size, Buffer, BufferSize);
+        double StreamFixed = StreamBytesPerCycle(MeowHashDispatched, Size, Buffer, BufferSize);
+        fprintf(stdout, "    %9llu %9.03f %9.03f %+6.01f%% %9.03f %9.03f %+6.01f%%\n",
+                (unsigned long long)Size,
+                HotGeneric, HotFixed, 100.0 * (HotFixed / HotGeneric - 1.0),
+                StreamGeneric, StreamFixed, 100.0 * (StreamFixed / StreamGeneric - 1.0));
+    }
+    
+    free(Buffer);
+    return(0);
+}
+
+//
+// NOTE: Hash algorithms that vsign can sign blocks with, through the same policies
+// (hashers.h) that vsign calls, on the same "hot" and "stream" workloads.
+//
+
+template<class Hasher>
+static meow_u128
+BackendHash(void *Seed128, meow_u64 Len, const void *Source)
+{
+    (void)Seed128;
+    meow_u8 Result[16];
+    Hasher::template hash<_MM_HINT_T0>(0, (const meow_u8 *)Source, Len, Result);
+    return(_mm_loadu_si128((meow_u128 *)Result));
+}
+
+static int
+BenchBackends(void)
+{
+    meow_u64 BufferSize = Mb(512);
+    meow_u8 *Buffer = (meow_u8 *)aligned_alloc(CACHE_LINE_ALIGNMENT, BufferSize);
+    if(!Buffer)
+    {
+        fprintf(stderr, "ERROR: Unable to allocate buffer for hashing\n");
+        return(1);
+    }
+    FuddleBuffer(BufferSize, Buffer, 1);
+    
+    fixed_bench_hash *Hashes[4] =
+    {
+        BackendHash<vsign::MeowHasher>,
+        BackendHash<vsign::Crc32cHasher>,
+        BackendHash<vsign::Xxh3Hasher>,
+        BackendHash<vsign::Blake3Hasher>,
+    };
+    char const *Names[4] = {"meow", "crc32c", "xxh3", "blake3"};
+    
+    fprintf(stdout, "Hash algorithms of vsign, bytes/cycle:\n");
+    fprintf(stdout, "    %9s %-8s %9s %9s\n", "size", "hash", "hot", "stream");
+    for(meow_u64 Size = Kb(4);
+        Size <= Mb(16);
+        Size *= 16)
+    {
+        for(int Index = 0; Index < 4; ++Index)
+        {
+            meow_u128 Slot = {};
+            double Hot = HotBytesPerCycle(Hashes[Index], Size, Buffer, &Slot);
+            double Stream = StreamBytesPerCycle(Hashes[Index], Size, Buffer, BufferSize);
+            fprintf(stdout, "    %9llu %-8s %9.03f %9.03f\n",
+                    (unsigned long long)Size, Names[Index], Hot, Stream);
+        }
+    }
+    
+    free(Buffer);
+    return(0);
+}
+
+//
+// NOTE: Co-location benchmark. A neighbor thread stands in for a latency-sensitive
+// service: it answers "requests" that each chase pointers through its working set,
+// which fits in the last-level cache when nobody else uses it. Meanwhile another
+// thread hashes a buffer much larger than the cache the way vsign does, with
+// regular (T0) or non-temporal (NTA) prefetches, and the neighbor's request
+// latencies are compared with those it has alone. Run it on a machine with at least
+// two cores sharing the last-level cache.
+//
+
+#define NEIGHBOR_LOADS_PER_REQUEST 256
+#define NEIGHBOR_SECONDS_PER_MODE 3
+
+struct neighbor_node
+{
+    // NOTE: volatile keeps the compiler from moving the loads out of the timed part
+    neighbor_node *volatile Next;
+    meow_u8 Pad[56];
+};
+
+struct neighbor_report
+{
+    double P50;
+    double P99;
+    double P999;
+    double HashBPC;
+};
+
+static neighbor_node *
+MakeNeighborChain(neighbor_node *Nodes, meow_u64 Count)
+{
+    // NOTE: A random cycle through all nodes, so the hardware prefetchers can't help
+    meow_u64 Series = 0x9E3779B97F4A7C15ULL;
+    std::vector<meow_u64> Order(Count);
+    for(meow_u64 Index = 0; Index < Count; ++Index)
+    {
+        Order[Index] = Index;
+    }
+    for(meow_u64 Index = Count - 1; Index > 0; --Index)
+    {
+        meow_u64 Other = Random(&Series) % (Index + 1);
+        std::swap(Order[Index], Order[Other]);
+    }
+    for(meow_u64 Index = 0; Index < Count; ++Index)
+    {
+        Nodes[Order[Index]].Next = &Nodes[Order[(Index + 1) % Count]];
+    }
+    return(&Nodes[Order[0]]);
+}
+
+static double
+Percentile(std::vector<meow_u64> &Samples, double Fraction)
+{
+    meow_u64 Index = (meow_u64)(Fraction * (double)(Samples.size() - 1));
+    std::nth_element(Samples.begin(), Samples.begin() + Index, Samples.end());
+    return((double)Samples[Index]);
+}
+
+// NOTE: Mode 0 hashes nothing, the neighbor runs alone; 1 prefetches with T0, 2 with NTA
+template<int Mode>
+static neighbor_report
+RunNeighbor(neighbor_node *Chain, meow_u8 *Buffer, meow_u64 BufferSize, meow_u64 BlockSize)
+{
+    std::atomic<int> Stop(0);
+    std::atomic<meow_u64> HashedBytes(0);
+    std::atomic<meow_u64> HashedClocks(0);
+    std::thread Hasher([&]()
+    {
+        meow_u128 Accumulator = _mm_setzero_si128();
+        meow_u64 Bytes = 0;
+        meow_u64 StartClock = __rdtsc();
+        while(Mode && !Stop.load(std::memory_order_relaxed))
+        {
+            for(meow_u64 Offset = 0;
+                Offset + BlockSize <= BufferSize && !Stop.load(std::memory_order_relaxed);
+                Offset += BlockSize)
+            {
+                meow_u128 Hash = (Mode == 1)
+                    ? vsign::meow_hash<_MM_HINT_T0>(MeowDefaultSeed, BlockSize, Buffer + Offset)
+                    : vsign::meow_hash<_MM_HINT_NTA>(MeowDefaultSeed, BlockSize, Buffer + Offset);
+                Accumulator = _mm_xor_si128(Accumulator, Hash);
+                Bytes += BlockSize;
+            }
+        }
+        HashedClocks = __rdtsc() - StartClock;
+        HashedBytes = Bytes;
+        volatile int Sink = _mm_cvtsi128_si32(Accumulator);
+        (void)Sink;
+    });
+    
+    std::vector<meow_u64> Samples;
+    neighbor_node *Node = Chain;
+    time_t End = time(0) + NEIGHBOR_SECONDS_PER_MODE;
+    while(time(0) < End)
+    {
+        for(int Request = 0; Request < 1000; ++Request)
+        {
+            int unsigned Ignored;
+            meow_u64 StartClock = __rdtsc();
+            for(int Load = 0; Load < NEIGHBOR_LOADS_PER_REQUEST; ++Load)
+            {
+                Node = Node->Next;
+            }
+            Samples.push_back(__rdtscp(&Ignored) - StartClock);
+        }
+    }
+    Stop = 1;
+    Hasher.join();
+    
+    neighbor_report Report = {};
+    Report.P50 = Percentile(Samples, 0.5);
+    Report.P99 = Percentile(Samples, 0.99);
+    Report.P999 = Percentile(Samples, 0.999);
+    Report.HashBPC = HashedClocks ? (double)HashedBytes / (double)HashedClocks : 0;
+    
+    volatile neighbor_node *Sink = Node;
+    (void)Sink;
+    return(Report);
+}
+
+static int
+BenchNeighbor(meow_u64 WorkingSet)
+{
+    meow_u64 BufferSize = Gb(1);
+    meow_u64 BlockSize = Mb(1);
+    meow_u8 *Buffer = (meow_u8 *)aligned_alloc(CACHE_LINE_ALIGNMENT, BufferSize);
+    neighbor_node *Nodes = (neighbor_node *)aligned_alloc(CACHE_LINE_ALIGNMENT, WorkingSet);
+    if(!Buffer || !Nodes)
+    {
+        fprintf(stderr, "ERROR: Unable to allocate buffers\n");
+        return(1);
+    }
+    FuddleBuffer(BufferSize, Buffer, 1);
+    neighbor_node *Chain = MakeNeighborChain(Nodes, WorkingSet / sizeof(neighbor_node));
+    
+    fprintf(stdout, "Neighbor with %llu KiB working set, %d dependent loads per request,\n",
+            (unsigned long long)(WorkingSet / 1024), NEIGHBOR_LOADS_PER_REQUEST);
+    fprintf(stdout, "cycles per request while another thread hashes %llu KiB blocks:\n",
+            (unsigned long long)(BlockSize / 1024));
+    fprintf(stdout, "    %-12s %10s %10s %10s %12s\n", "hashing", "p50", "p99", "p99.9", "bytes/cycle");
+    
+    neighbor_report Reports[3] =
+    {
+        RunNeighbor<0>(Chain, Buffer, BufferSize, BlockSize),
+        RunNeighbor<1>(Chain, Buffer, BufferSize, BlockSize),
+        RunNeighbor<2>(Chain, Buffer, BufferSize, BlockSize),
+    };
+    char const *Names[3] = {"none", "prefetcht0", "prefetchnta"};
+    for(int Index = 0; Index < 3; ++Index)
+    {
+        fprintf(stdout, "    %-12s %10.0f %10.0f %10.0f %12.03f\n", Names[Index],
+                Reports[Index].P50, Reports[Index].P99, Reports[Index].P999,
+                Reports[Index].HashBPC);
+    }
+    
+    free(Nodes);
+    free(Buffer);
+    return(0);
+}
+
 int
 main(int ArgCount, char **Args)
 {
+    if((ArgCount == 2) && (strcmp(Args[1], "fixed") == 0))
+    {
+        return(BenchFixedSizes());
+    }
+    if((ArgCount == 2) && (strcmp(Args[1], "backends") == 0))
+    {
+        return(BenchBackends());
+    }
+    if((ArgCount >= 2) && (strcmp(Args[1], "neighbor") == 0))
+    {
+        // NOTE: Working set in MiB, pick one that fits the last-level cache
+        meow_u64 WorkingSet = (ArgCount > 2) ? Mb(atoi(Args[2])) : Mb(4);
+        return(BenchNeighbor(WorkingSet));
+    }
+    
 #if __aarch64__
     enable_pmu(0x008);
 #endif
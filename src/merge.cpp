@@ -0,0 +1,174 @@
+// Merging shards signed by different processes or machines into one
+// signature file. Not available on Windows.
+//
+// Shards are checked against each other first: signed the same way, from
+// the same input as far as its size and modification time tell, and
+// covering every block once. Only then is the output created, hashes are
+// copied into it in the kernel and the header goes last, so a merge that
+// fails halfway leaves no valid signature.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+#ifndef _MSC_VER
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "vsign_internal.h"
+
+namespace vsign {
+
+#ifndef _MSC_VER
+
+namespace {
+
+struct Shard {
+  Shard() : path(), source(), header() {}
+
+  std::string path;
+  std::shared_ptr<Source> source;
+  ShardHeader header;
+};
+
+// Same signature, apart from the part of it
+bool same_input(const SignatureHeader &left, const SignatureHeader &right) {
+  return left.flags == right.flags && left.algorithm == right.algorithm &&
+         left.block_size == right.block_size &&
+         left.file_size == right.file_size &&
+         left.mtime_ns == right.mtime_ns && left.key_id == right.key_id &&
+         tree_chunk_size(left) == tree_chunk_size(right);
+}
+
+} // namespace
+
+static Status open_shard(const char *path, Shard &shard, std::string &error) {
+  shard.path = path;
+  shard.source.reset(new Source());
+  const Status status = shard.source->open(path, Engine::mmap, 0, error);
+  if (status != Status::ok) {
+    return status;
+  }
+  const Source &source = *shard.source;
+  ShardHeader &header = shard.header;
+  const SignatureHeader &signature = header.signature;
+  if (source.size() < sizeof(header)) {
+    error = std::string(path) + " is not a shard";
+    return Status::invalid_argument;
+  }
+  memcpy(&header, source.memory(), sizeof(header));
+  if (memcmp(signature.magic, SHARD_MAGIC, sizeof(signature.magic)) ||
+      signature.version != SIGNATURE_VERSION ||
+      (signature.flags & ~SIGNATURE_FLAG_TREE) ||
+      signature.algorithm >= ALGORITHM_COUNT ||
+      signature.header_size != sizeof(header) ||
+      signature.block_size < HASH_SIZE || !header.block_count ||
+      header.first_block + header.block_count >
+          block_count(signature.file_size, signature.block_size)) {
+    error = std::string(path) + " is not a shard";
+    return Status::invalid_argument;
+  }
+  if (source.size() != sizeof(header) + header.block_count * HASH_SIZE) {
+    error = std::string("Shard ") + path + " is truncated or too long";
+    return Status::invalid_argument;
+  }
+  return Status::ok;
+}
+
+Status merge_shards(const char *const *shards, size_t count,
+                    const char *output, std::string &error) {
+  std::vector<Shard> parts(count);
+  for (size_t index = 0; index < count; ++index) {
+    const Status status = open_shard(shards[index], parts[index], error);
+    if (status != Status::ok) {
+      return status;
+    }
+    if (index && !same_input(parts[index].header.signature,
+                             parts[0].header.signature)) {
+      error = std::string("Shards ") + shards[0] + " and " + shards[index] +
+              " are not signed the same way from the same input";
+      return Status::invalid_argument;
+    }
+  }
+  if (parts.empty()) {
+    error = "No shards to merge";
+    return Status::invalid_argument;
+  }
+  std::sort(parts.begin(), parts.end(),
+            [](const Shard &left, const Shard &right) {
+              return left.header.first_block < right.header.first_block;
+            });
+  const SignatureHeader &first = parts[0].header.signature;
+  const uint64_t blocks = block_count(first.file_size, first.block_size);
+  uint64_t next = 0; // block that the next shard must start with
+  for (const Shard &shard : parts) {
+    if (shard.header.first_block != next) {
+      error = shard.header.first_block > next
+                  ? "No shard has blocks " + std::to_string(next) + " to " +
+                        std::to_string(shard.header.first_block - 1)
+                  : "Shard " + shard.path +
+                        " overlaps another one at block " +
+                        std::to_string(shard.header.first_block);
+      return Status::invalid_argument;
+    }
+    next += shard.header.block_count;
+  }
+  if (next != blocks) {
+    error = "No shard has blocks " + std::to_string(next) + " to " +
+            std::to_string(blocks - 1);
+    return Status::invalid_argument;
+  }
+
+  const int file =
+      ::open(output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (file == -1) {
+    error = std::string("Can't create ") + output + ": " + strerror(errno);
+    return Status::io_error;
+  }
+  SignatureHeader header = first;
+  memcpy(header.magic, SIGNATURE_MAGIC, sizeof(header.magic));
+  header.header_size = sizeof(header);
+  bool written = true;
+  for (const Shard &shard : parts) {
+    const uint64_t offset =
+        sizeof(header) + shard.header.first_block * HASH_SIZE;
+    const uint64_t size = shard.header.block_count * HASH_SIZE;
+    const uint8_t *hashes = shard.source->memory() + sizeof(ShardHeader);
+    const int from = ::open(shard.path.c_str(), O_RDONLY | O_CLOEXEC);
+    written = (from != -1 &&
+               copy_range(from, sizeof(ShardHeader), file, offset, size)) ||
+              write_fully_at(file, hashes, size, offset);
+    if (from != -1) {
+      ::close(from);
+    }
+    if (!written) {
+      break;
+    }
+  }
+  written = written &&
+            write_fully_at(file, reinterpret_cast<const uint8_t *>(&header),
+                           sizeof(header), 0);
+  if (!written) {
+    error = std::string("Can't write ") + output + ": " + strerror(errno);
+  }
+  ::close(file);
+  if (!written) {
+    ::unlink(output);
+    return Status::io_error;
+  }
+  return Status::ok;
+}
+
+#else
+
+Status merge_shards(const char *const *, size_t, const char *,
+                    std::string &error) {
+  error = "Merging shards is not available on Windows";
+  return Status::invalid_argument;
+}
+
+#endif
+
+} // namespace vsign
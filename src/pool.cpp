@@ -0,0 +1,132 @@
+#include "pool.h"
+
+#include <algorithm>
+#include <iostream>
+#include <system_error>
+
+namespace vsign {
+
+ThreadPool::ThreadPool(size_t workers, int verbose,
+                       const std::function<void()> &setup)
+    : setup_(setup), threads_(), tasks_(), mutex_(), wake_(), done_() {
+  threads_.reserve(workers);
+  size_t failed_threads = 0;
+  for (size_t i = 0; i < workers; ++i) {
+    try {
+      threads_.emplace_back(&ThreadPool::work, this);
+    } catch (const std::system_error &error) {
+      if (verbose) {
+        std::cout << "Couldn't create thread: " << error.what() << "\n";
+      }
+      ++failed_threads;
+      if (failed_threads < workers) {
+        --i; // retry for some time, but not infinitely
+      }
+    }
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (threads_.empty()) {
+      // nobody else would ever finish queued tasks
+      while (!tasks_.empty()) {
+        std::shared_ptr<Task> task = tasks_.front();
+        step(task, lock);
+      }
+    }
+    done_.wait(lock, [this] { return tasks_.empty(); });
+    stop_ = 1;
+  }
+  wake_.notify_all();
+  for (std::thread &thread : threads_) {
+    thread.join();
+  }
+}
+
+size_t ThreadPool::size() const { return threads_.size(); }
+
+bool ThreadPool::runnable(const Task &task) const {
+  return !task.exhausted_ && task.workers_ < task.max_workers;
+}
+
+void ThreadPool::submit(const std::shared_ptr<Task> &task) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks_.push_back(task);
+  }
+  wake_.notify_all();
+}
+
+void ThreadPool::run(const std::shared_ptr<Task> &task) {
+  submit(task);
+  std::unique_lock<std::mutex> lock(mutex_);
+  // calling thread already exists, so do some useful work here too:
+  while (!task->exhausted_ && (!setup_ || threads_.empty())) {
+    step(task, lock);
+  }
+  done_.wait(lock, [&task] { return task->completed_ == 1; });
+}
+
+void ThreadPool::step(const std::shared_ptr<Task> &task,
+                      std::unique_lock<std::mutex> &lock) {
+  ++task->workers_;
+  lock.unlock();
+  const bool more = task->step();
+  lock.lock();
+  --task->workers_;
+  if (!more) {
+    task->exhausted_ = 1;
+  }
+  if (task->exhausted_ && task->workers_ == 0 && !task->completed_) {
+    // last one out completes the task
+    auto position = std::find(tasks_.begin(), tasks_.end(), task);
+    const size_t index = static_cast<size_t>(position - tasks_.begin());
+    tasks_.erase(position);
+    if (cursor_ > index) {
+      --cursor_;
+    }
+    task->completed_ = -1; // completing
+    lock.unlock();
+    task->complete();
+    lock.lock();
+    task->completed_ = 1;
+    done_.notify_all();
+  }
+}
+
+void ThreadPool::work() {
+  if (setup_) {
+    setup_();
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    std::shared_ptr<Task> task;
+    wake_.wait(lock, [this, &task] {
+      if (stop_) {
+        return true;
+      }
+      // next runnable task in round robin order
+      for (size_t i = 0; i < tasks_.size(); ++i) {
+        const size_t index = (cursor_ + i) % tasks_.size();
+        if (runnable(*tasks_[index])) {
+          task = tasks_[index];
+          cursor_ = index + 1;
+          return true;
+        }
+      }
+      return false;
+    });
+    if (stop_) {
+      return;
+    }
+    step(task, lock);
+    if (!task->exhausted_) {
+      // it may have been skipped because of max_workers
+      wake_.notify_one();
+    }
+  }
+}
+
+} // namespace vsign
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace vsign {
+
+// Piece of work that ThreadPool runs in small steps, so that many tasks can
+// share the same threads fairly
+class Task {
+public:
+  Task() = default;
+  virtual ~Task() = default;
+  Task(const Task &) = delete;
+  Task &operator=(const Task &) = delete;
+
+  // Does a bit of work. Returns false when there's nothing left to start,
+  // steps that are already running on other threads may still be going.
+  virtual bool step() = 0;
+  // Called once, after the last step of the task has finished
+  virtual void complete() = 0;
+
+  // Upper limit of threads stepping this task at the same time
+  size_t max_workers = SIZE_MAX;
+
+private:
+  friend class ThreadPool;
+  size_t workers_ = 0; // threads inside step() right now
+  int exhausted_ = 0;  // step() returned false at least once
+  int completed_ = 0;  // complete() has returned
+};
+
+// Worker threads that live as long as the pool and take turns between all
+// submitted tasks: every thread does one step of a task, then moves on to
+// the next task in round robin order.
+class ThreadPool {
+public:
+  // Every worker calls `setup` (if any) once it starts
+  explicit ThreadPool(size_t workers, int verbose = 0,
+                      const std::function<void()> &setup = nullptr);
+  // Waits until every submitted task is completed
+  ~ThreadPool();
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  // Number of worker threads
+  size_t size() const;
+
+  // Queue task and return immediately
+  void submit(const std::shared_ptr<Task> &task);
+
+  // Queue task, help workers with it from the calling thread and return
+  // when it is completed. Threads that are not set up only wait.
+  void run(const std::shared_ptr<Task> &task);
+
+private:
+  void work();
+  // Steps task once with all the bookkeeping, `lock` is held on entry/exit
+  void step(const std::shared_ptr<Task> &task,
+            std::unique_lock<std::mutex> &lock);
+  bool runnable(const Task &task) const;
+
+  std::function<void()> setup_;
+  std::vector<std::thread> threads_;
+  std::vector<std::shared_ptr<Task>> tasks_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable done_;
+  size_t cursor_ = 0; // where round robin continues
+  int stop_ = 0;
+  int reserved_ = 0;
+};
+
+} // namespace vsign
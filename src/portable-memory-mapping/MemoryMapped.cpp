@@ -9,6 +9,10 @@
 //  - remove unused code
 //  - error reporting
 //  - clang-format
+//  - optional limit of mapped size
+//  - mapping of already opened file descriptors
+//  - mapping of a part of file starting at any offset
+//  - mapping of block devices
 
 #include "MemoryMapped.h"
 
@@ -34,11 +38,15 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
 #endif
 
 /// do nothing, must use open()
 MemoryMapped::MemoryMapped()
-    : _filesize(0), _file(0),
+    : _filesize(0), _viewOffset(0), _file(0),
 #ifdef _MSC_VER
       _mappedFile(NULL),
 #endif
@@ -48,14 +56,28 @@ MemoryMapped::MemoryMapped()
 /// close file (see close() )
 MemoryMapped::~MemoryMapped() { close(); }
 
-/// open file for reading
-bool MemoryMapped::open_read(const char *filename) {
+/// get granularity of mapping offsets
+uint64_t MemoryMapped::getpagesize() {
+#ifdef _MSC_VER
+  SYSTEM_INFO sysInfo;
+  GetSystemInfo(&sysInfo);
+  return sysInfo.dwAllocationGranularity;
+#else
+  return static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+#endif
+}
+
+/// open file for reading, map at most max_size bytes (0 = up to the end)
+/// starting at offset
+bool MemoryMapped::open_read(const char *filename, uint64_t max_size,
+                             uint64_t offset) {
   // already open ?
   if (isValid())
     return false;
 
   _file = 0;
   _filesize = 0;
+  _viewOffset = 0;
 #ifdef _MSC_VER
   _mappedFile = NULL;
 #endif
@@ -81,6 +103,14 @@ bool MemoryMapped::open_read(const char *filename) {
     return false;
   }
   _filesize = static_cast<uint64_t>(result.QuadPart);
+  if (offset >= _filesize) {
+    return false;
+  }
+  _filesize -= offset;
+  if (max_size && max_size < _filesize)
+    _filesize = max_size;
+  _viewOffset = offset % getpagesize();
+  const uint64_t mapOffset = offset - _viewOffset;
 
   // convert to mapped mode
   _mappedFile = ::CreateFileMapping(_file, NULL, PAGE_READONLY, 0, 0, NULL);
@@ -91,7 +121,9 @@ bool MemoryMapped::open_read(const char *filename) {
   }
 
   // get memory address
-  _mappedView = ::MapViewOfFile(_mappedFile, FILE_MAP_READ, 0, 0, _filesize);
+  _mappedView = ::MapViewOfFile(
+      _mappedFile, FILE_MAP_READ, static_cast<DWORD>(mapOffset >> 32),
+      static_cast<DWORD>(mapOffset & 0xFFFFFFFF), _filesize + _viewOffset);
   if (_mappedView == NULL) {
     std::cerr << "MapViewOfFile Win32 error code: " << GetLastError() << "\n";
     return false;
@@ -101,11 +133,31 @@ bool MemoryMapped::open_read(const char *filename) {
   // Linux
 
   // open file
-  _file = ::open(filename, O_RDONLY | O_LARGEFILE);
-  if (_file == -1) {
-    _file = 0;
+  const int file = ::open(filename, O_RDONLY | O_LARGEFILE);
+  if (file == -1) {
     return false;
   }
+  return open_read_fd(file, max_size, offset);
+#endif
+
+  // everything's fine
+  return true;
+}
+
+#ifndef _MSC_VER
+/// map already opened file for reading, takes ownership of file descriptor
+bool MemoryMapped::open_read_fd(int file, uint64_t max_size,
+                                uint64_t offset) {
+  // already open ?
+  if (isValid()) {
+    ::close(file);
+    return false;
+  }
+
+  _file = file;
+  _filesize = 0;
+  _viewOffset = 0;
+  _mappedView = NULL;
 
   // file size
   struct stat64 statInfo;
@@ -113,9 +165,24 @@ bool MemoryMapped::open_read(const char *filename) {
     return false;
   }
 
-  _filesize = statInfo.st_size;
-
-  _mappedView = ::mmap64(NULL, _filesize, PROT_READ, MAP_SHARED, _file, 0);
+  uint64_t size = static_cast<uint64_t>(statInfo.st_size);
+#ifdef __linux__
+  // st_size of block devices is 0
+  if (S_ISBLK(statInfo.st_mode) && ::ioctl(_file, BLKGETSIZE64, &size) < 0) {
+    return false;
+  }
+#endif
+  if (offset >= size) {
+    return false;
+  }
+  _filesize = size - offset;
+  if (max_size && max_size < _filesize)
+    _filesize = max_size;
+  // mapping has to start at page boundary
+  _viewOffset = offset % getpagesize();
+
+  _mappedView = ::mmap64(NULL, _filesize + _viewOffset, PROT_READ, MAP_SHARED,
+                         _file, offset - _viewOffset);
   if (_mappedView == MAP_FAILED) {
     _mappedView = NULL;
     return false;
@@ -129,19 +196,20 @@ bool MemoryMapped::open_read(const char *filename) {
   // assume that file will be large
   linuxHint |= MADV_HUGEPAGE;
 
-  const int madvise_result = ::madvise(_mappedView, _filesize, linuxHint);
+  const int madvise_result =
+      ::madvise(_mappedView, _filesize + _viewOffset, linuxHint);
   if (madvise_result == -1) {
     return false;
   }
 
-#endif
-
   // everything's fine
   return true;
 }
+#endif
 
 /// open file for writing
-bool MemoryMapped::open_write(const char *filename, size_t size) {
+bool MemoryMapped::open_write(const char *filename, size_t size,
+                              bool truncate) {
   // already open ?
   if (isValid()) {
     return false;
@@ -149,6 +217,7 @@ bool MemoryMapped::open_write(const char *filename, size_t size) {
 
   _file = 0;
   _filesize = size;
+  _viewOffset = 0;
 #ifdef _MSC_VER
   _mappedFile = NULL;
 #endif
@@ -162,7 +231,8 @@ bool MemoryMapped::open_write(const char *filename, size_t size) {
   // FILE_ATTRIBUTE_NORMAL
   _file =
       ::CreateFileA(filename, GENERIC_WRITE | GENERIC_READ, FILE_SHARE_WRITE,
-                    NULL, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+                    NULL, truncate ? CREATE_ALWAYS : OPEN_ALWAYS,
+                    FILE_FLAG_SEQUENTIAL_SCAN, NULL);
   if (!_file) {
     std::cerr << "CreateFileA Win32 error code: " << GetLastError() << "\n";
     return false;
@@ -192,14 +262,15 @@ bool MemoryMapped::open_write(const char *filename, size_t size) {
 
   // open file
   const mode_t rw = 0660;
-  _file = ::open(filename, O_CREAT | O_RDWR | O_LARGEFILE | O_TRUNC, rw);
+  _file = ::open(filename,
+                 O_CREAT | O_RDWR | O_LARGEFILE | (truncate ? O_TRUNC : 0), rw);
   if (_file == -1) {
     _file = 0;
     return false;
   }
 
   // grow file size
-  int truncate_result = truncate(filename, _filesize);
+  int truncate_result = ::truncate(filename, _filesize);
   if (truncate_result == -1) {
     return false;
   }
@@ -229,6 +300,18 @@ bool MemoryMapped::open_write(const char *filename, size_t size) {
   return true;
 }
 
+/// write modified pages to disk, blocks until done
+bool MemoryMapped::flush() {
+  if (!_mappedView) {
+    return false;
+  }
+#ifdef _MSC_VER
+  return ::FlushViewOfFile(_mappedView, 0) && ::FlushFileBuffers(_file);
+#else
+  return ::msync(_mappedView, _filesize + _viewOffset, MS_SYNC) == 0;
+#endif
+}
+
 /// close file
 void MemoryMapped::close() {
   // kill pointer
@@ -240,7 +323,7 @@ void MemoryMapped::close() {
                 << "\n";
     }
 #else
-    ::munmap(_mappedView, _filesize);
+    ::munmap(_mappedView, _filesize + _viewOffset);
 #endif
     _mappedView = NULL;
   }
@@ -271,13 +354,16 @@ void MemoryMapped::close() {
   }
 
   _filesize = 0;
+  _viewOffset = 0;
 }
 
 /// raw access
-void *MemoryMapped::accessData() const { return _mappedView; }
+void *MemoryMapped::accessData() const {
+  return _mappedView ? static_cast<char *>(_mappedView) + _viewOffset : NULL;
+}
 
 /// true, if file successfully opened
 bool MemoryMapped::isValid() const { return _mappedView != NULL; }
 
-/// get file size
+/// get size of mapped part of file
 uint64_t MemoryMapped::size() const { return _filesize; }
@@ -9,6 +9,11 @@
 //  - remove unused code
 //  - error reporting
 //  - clang-format
+//  - optional limit of mapped size
+//  - mapping of already opened file descriptors
+//  - mapping of a part of file starting at any offset
+//  - mapping of block devices
+//  - writing into existing files, flushing
 
 #pragma once
 
@@ -30,10 +35,18 @@ public:
   /// close file (see close() )
   ~MemoryMapped();
 
-  /// open file for reading
-  bool open_read(const char *filename);
-  /// open file for writing
-  bool open_write(const char *filename, size_t size);
+  /// open file for reading, map at most max_size bytes (0 = up to the end)
+  /// starting at offset
+  bool open_read(const char *filename, uint64_t max_size = 0,
+                 uint64_t offset = 0);
+#ifndef _MSC_VER
+  /// map already opened file for reading, takes ownership of file descriptor
+  bool open_read_fd(int file, uint64_t max_size = 0, uint64_t offset = 0);
+#endif
+  /// open file for writing, existing contents are kept unless truncate is set
+  bool open_write(const char *filename, size_t size, bool truncate = true);
+  /// write modified pages to disk, blocks until done
+  bool flush();
   /// close file
   void close();
 
@@ -43,7 +56,7 @@ public:
   /// true, if file successfully opened
   bool isValid() const;
 
-  /// get file size
+  /// get size of mapped part of file
   uint64_t size() const;
 
 private:
@@ -52,11 +65,13 @@ private:
   /// don't copy object
   MemoryMapped &operator=(const MemoryMapped &);
 
-  /// get OS page size (for remap)
-  static int getpagesize();
+  /// get granularity of mapping offsets
+  static uint64_t getpagesize();
 
-  /// file size
+  /// size of mapped part of file
   uint64_t _filesize;
+  /// requested offset minus the page aligned one that was mapped
+  uint64_t _viewOffset;
 
   /// define handle
 #ifdef _MSC_VER
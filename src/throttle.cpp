@@ -0,0 +1,114 @@
+// Limits of bandwidth, CPU time and priority of worker threads
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#elif defined(_MSC_VER)
+#define NOMINMAX // std::max
+#include <windows.h>
+#endif
+
+#include "vsign_internal.h"
+
+namespace vsign {
+
+// Reading may get this far ahead of the bandwidth limit after a pause
+constexpr int64_t BURST_NS = 100 * 1000 * 1000;
+// Longer gaps between reads of a worker are idle time, not hashing
+constexpr int64_t MAX_BUSY_NS = 1000 * 1000 * 1000;
+
+static int64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static void sleep_ns(int64_t duration) {
+  if (duration > 0) {
+    std::this_thread::sleep_for(std::chrono::nanoseconds(duration));
+  }
+}
+
+Throttle::Throttle(uint64_t max_bandwidth, unsigned max_cpu)
+    : max_bandwidth_(max_bandwidth), max_cpu_(max_cpu), mutex_() {}
+
+void Throttle::set(uint64_t max_bandwidth, unsigned max_cpu) {
+  max_bandwidth_ = max_bandwidth;
+  max_cpu_ = max_cpu;
+}
+
+uint64_t Throttle::max_bandwidth() const { return max_bandwidth_; }
+
+unsigned Throttle::max_cpu() const { return max_cpu_; }
+
+void Throttle::pace(uint64_t bytes) {
+  // end of the previous pace() of this thread, what's after it was hashing
+  thread_local int64_t last_pace_ns = 0;
+  const unsigned max_cpu = max_cpu_.load(std::memory_order_relaxed);
+  const uint64_t max_bandwidth =
+      max_bandwidth_.load(std::memory_order_relaxed);
+  if (!max_bandwidth && (!max_cpu || max_cpu >= 100)) {
+    last_pace_ns = 0;
+    return;
+  }
+  int64_t now = now_ns();
+  if (max_cpu && max_cpu < 100 && last_pace_ns &&
+      now - last_pace_ns < MAX_BUSY_NS) {
+    // duty cycle: rest for as long as it takes busy time to be max_cpu%
+    sleep_ns((now - last_pace_ns) * (100 - max_cpu) / max_cpu);
+    now = now_ns();
+  }
+  if (max_bandwidth) {
+    // token bucket, kept as the time when the budget is spent
+    int64_t start;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      start = std::max(next_read_ns_, now - BURST_NS);
+      next_read_ns_ =
+          start + static_cast<int64_t>(static_cast<double>(bytes) * 1e9 /
+                                       static_cast<double>(max_bandwidth));
+    }
+    sleep_ns(start - now);
+  }
+  last_pace_ns = now_ns();
+}
+
+#ifdef __linux__
+// See ioprio_set(2), glibc has no wrapper
+constexpr int IOPRIO_WHO_PROCESS = 1;
+constexpr int IOPRIO_CLASS_SHIFT = 13;
+constexpr int IOPRIO_CLASS_BE = 2;
+constexpr int IOPRIO_CLASS_IDLE = 3;
+constexpr int IOPRIO_BE_LOWEST = 7;
+#endif
+
+// Linux applies all of them to the calling thread only, Windows' background
+// mode lowers both CPU and I/O priority
+void apply_priority(Priority priority) {
+  if (priority == Priority::normal) {
+    return;
+  }
+#ifdef __linux__
+  const pid_t thread = static_cast<pid_t>(::syscall(SYS_gettid));
+  if (priority == Priority::low) {
+    ::syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, thread,
+              IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT | IOPRIO_BE_LOWEST);
+    ::setpriority(PRIO_PROCESS, static_cast<id_t>(thread), 19);
+  } else {
+    ::syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, thread,
+              IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+    sched_param parameters{};
+    ::sched_setscheduler(thread, SCHED_IDLE, &parameters);
+  }
+#elif defined(_MSC_VER)
+  ::SetThreadPriority(::GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+#endif
+}
+
+} // namespace vsign
@@ -0,0 +1,338 @@
+// Storage tuning profiles, one per device. Not available on Windows.
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+#ifndef _MSC_VER
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#endif
+
+#include "vsign_internal.h"
+
+namespace vsign {
+
+#ifndef _MSC_VER
+std::string cache_directory() {
+  const char *vsign_cache = getenv("VSIGN_CACHE_DIR");
+  if (vsign_cache && *vsign_cache) {
+    return vsign_cache;
+  }
+  const char *xdg_cache = getenv("XDG_CACHE_HOME");
+  if (xdg_cache && *xdg_cache) {
+    return std::string(xdg_cache) + "/vsign";
+  }
+  const char *home = getenv("HOME");
+  return std::string(home && *home ? home : ".") + "/.cache/vsign";
+}
+
+// mkdir -p
+bool make_directories(const std::string &path) {
+  for (size_t slash = path.find('/', 1);; slash = path.find('/', slash + 1)) {
+    const std::string part = path.substr(0, slash);
+    if (::mkdir(part.c_str(), 0755) != 0 && errno != EEXIST) {
+      return false;
+    }
+    if (slash == std::string::npos) {
+      return true;
+    }
+  }
+}
+
+std::string device_profile_path(const char *path) {
+  struct stat info;
+  if (::stat(path, &info) != 0) {
+    return std::string();
+  }
+  // a block device is the device itself, not the one its node is on
+  const dev_t device = S_ISBLK(info.st_mode) ? info.st_rdev : info.st_dev;
+  return cache_directory() + "/device-" + std::to_string(major(device)) +
+         "-" + std::to_string(minor(device)) + ".profile";
+}
+
+// sysfs name of the disk that block device at sysfs `path` is, or is a
+// partition of
+static std::string disk_name(const std::string &path) {
+  char resolved[PATH_MAX];
+  if (!::realpath(path.c_str(), resolved)) {
+    return std::string();
+  }
+  std::string disk = resolved;
+  // partitions are subdirectories of their disk
+  if (::access((disk + "/partition").c_str(), F_OK) == 0) {
+    disk.erase(disk.rfind('/'));
+  }
+  return disk.substr(disk.rfind('/') + 1);
+}
+
+std::string physical_device(uint64_t device) {
+  std::string name =
+      disk_name("/sys/dev/block/" + std::to_string(major(device)) + ":" +
+                std::to_string(minor(device)));
+  // LVM, dm-crypt or md on top of one disk belong to that disk, devices
+  // spanning several disks are disks of their own
+  for (int depth = 0; !name.empty() && depth < 8; ++depth) {
+    DIR *slaves = ::opendir(("/sys/block/" + name + "/slaves").c_str());
+    if (!slaves) {
+      break;
+    }
+    std::string slave;
+    int count = 0;
+    while (const dirent *entry = ::readdir(slaves)) {
+      if (entry->d_name[0] != '.') {
+        slave = entry->d_name;
+        ++count;
+      }
+    }
+    ::closedir(slaves);
+    if (count != 1) {
+      break;
+    }
+    name = disk_name("/sys/class/block/" + slave);
+  }
+  return name;
+}
+
+bool is_rotational(const std::string &disk) {
+  std::ifstream file("/sys/block/" + disk + "/queue/rotational");
+  int rotational = 0;
+  return file >> rotational && rotational;
+}
+
+bool apply_device_profile(const char *path, Options &options) {
+  const std::string profile_path = device_profile_path(path);
+  std::ifstream file(profile_path);
+  if (profile_path.empty() || !file) {
+    return false;
+  }
+  Options profile{};
+  std::string line;
+  while (std::getline(file, line)) {
+    const size_t equals = line.find('=');
+    if (line.empty() || line[0] == '#' || equals == std::string::npos) {
+      continue;
+    }
+    const std::string key = line.substr(0, equals);
+    const std::string value = line.substr(equals + 1);
+    if (key == "threads")
+      profile.threads = std::strtoull(value.c_str(), nullptr, 0);
+    else if (key == "batch")
+      profile.batch = std::strtoull(value.c_str(), nullptr, 0);
+    else if (key == "engine")
+      profile.engine = parse_engine(value.c_str());
+  }
+  if (!profile.threads || !profile.batch ||
+      profile.engine == Engine::automatic) {
+    return false;
+  }
+  if (!options.threads)
+    options.threads = profile.threads;
+  if (!options.batch)
+    options.batch = profile.batch;
+  if (options.engine == Engine::automatic)
+    options.engine = profile.engine;
+  return true;
+}
+
+static bool save_profile(const std::string &path, const Options &options,
+                         double bandwidth) {
+  const size_t slash = path.rfind('/');
+  if (slash != std::string::npos && !make_directories(path.substr(0, slash))) {
+    return false;
+  }
+  std::ofstream file(path, std::ios::trunc);
+  file << "# vsign tuning profile, written by 'vsign tune'\n"
+       << "threads=" << options.threads << "\n"
+       << "batch=" << options.batch << "\n"
+       << "engine=" << engine_name(options.engine) << "\n"
+       << "bandwidth=" << bandwidth << "\n";
+  return static_cast<bool>(file);
+}
+
+// Reads at most this many bytes of the file for every probe
+constexpr uint64_t TUNE_PROBE_SIZE = 256ull * 1024 * 1024;
+// Options that are this close to the fastest ones are equally good, and
+// the one with less threads and smaller batch wins
+constexpr double TUNE_TOLERANCE = 0.95;
+
+struct Trial {
+  Options options;
+  double bandwidth; // MiB/s
+};
+
+// Hashes the beginning of the input with given options, cold page cache.
+// Returns bandwidth in MiB/s, or 0 on failure.
+static double probe(const char *path, const Options &options, int file,
+                    uint64_t probe_size, std::string &error,
+                    std::ostream *log) {
+  // drop cached pages of the input, so every probe really reads the device
+  ::fdatasync(file);
+  ::posix_fadvise(file, 0, 0, POSIX_FADV_DONTNEED);
+
+  ThreadPool pool(options.threads - 1, options.verbose);
+  const auto start_time = std::chrono::steady_clock::now();
+
+  auto job = std::make_shared<Job>(options.block_size, options.batch);
+  if (job->source.open(path, options.engine, probe_size, error) !=
+      Status::ok) {
+    return 0;
+  }
+  std::vector<uint8_t> output(
+      HASH_SIZE * block_count(job->source.size(), options.block_size));
+  job->output = output.data();
+  if (run_job(pool, job, output.size(), error) != Status::ok) {
+    return 0;
+  }
+
+  const std::chrono::duration<double> seconds =
+      std::chrono::steady_clock::now() - start_time;
+  const double bandwidth =
+      static_cast<double>(probe_size) / (1024 * 1024) / seconds.count();
+  if (log) {
+    *log << "engine: " << engine_name(options.engine)
+         << "\tthreads: " << options.threads << "\tbatch: " << options.batch
+         << "\t" << bandwidth << " MiB/s\n";
+  }
+  return bandwidth;
+}
+
+static const Trial &best_trial(const std::vector<Trial> &trials) {
+  double fastest = 0;
+  for (const Trial &trial : trials) {
+    fastest = std::max(fastest, trial.bandwidth);
+  }
+  // trials are ordered from the lightest options to the heaviest
+  for (const Trial &trial : trials) {
+    if (trial.bandwidth >= fastest * TUNE_TOLERANCE) {
+      return trial;
+    }
+  }
+  return trials.front();
+}
+
+Status tune_device(const char *path, Options &best, double &bandwidth,
+                   std::string &error, std::ostream *log) {
+  const int file = ::open(path, O_RDONLY);
+  FileIdentity identity; // size of block devices too
+  if (file == -1 || !file_identity(path, identity) || identity.size == 0) {
+    error = std::string("Can't read file ") + path + " to probe its device";
+    if (file != -1)
+      ::close(file);
+    return Status::io_error;
+  }
+  const uint64_t probe_size =
+      std::min<uint64_t>(identity.size, TUNE_PROBE_SIZE);
+  if (probe_size < TUNE_PROBE_SIZE && log) {
+    *log << "Warning: " << path << " is smaller than " << TUNE_PROBE_SIZE
+         << " bytes, profile may be inaccurate\n";
+  }
+
+  // thread counts: powers of two up to twice the number of logical cores
+  const unsigned long long cores =
+      std::max(1u, std::thread::hardware_concurrency());
+  std::vector<unsigned long long> thread_counts;
+  for (unsigned long long threads = 1; threads <= cores * 2; threads *= 2) {
+    thread_counts.push_back(threads);
+  }
+  if (std::find(thread_counts.begin(), thread_counts.end(), cores) ==
+      thread_counts.end()) {
+    thread_counts.push_back(cores);
+    std::sort(thread_counts.begin(), thread_counts.end());
+  }
+
+  std::vector<Engine> engines{Engine::mmap, Engine::read};
+#ifdef O_DIRECT
+  // only where the file system has direct I/O, others refuse it with EINVAL
+  const int direct = ::open(path, O_RDONLY | O_DIRECT);
+  if (direct != -1) {
+    ::close(direct);
+    engines.push_back(Engine::direct);
+  } else if (log) {
+    *log << "Skipping engine direct: " << strerror(errno) << "\n";
+  }
+#endif
+
+  std::vector<Trial> trials;
+  for (Engine engine : engines) {
+    for (unsigned long long threads : thread_counts) {
+      Options candidate = best;
+      candidate.engine = engine;
+      candidate.threads = threads;
+      candidate.batch = 1;
+      trials.push_back(
+          {candidate, probe(path, candidate, file, probe_size, error, log)});
+      if (trials.back().bandwidth != 0) {
+        continue;
+      }
+      if (engine == Engine::direct) {
+        // reads may still fail with EINVAL, or the block size may not be
+        // aligned for them: the other engines do without
+        if (log) {
+          *log << "Skipping engine direct: " << error << "\n";
+        }
+        error.clear();
+        trials.pop_back();
+        break;
+      }
+      ::close(file);
+      return Status::io_error;
+    }
+  }
+  std::stable_sort(trials.begin(), trials.end(),
+                   [](const Trial &a, const Trial &b) {
+                     return a.options.threads < b.options.threads;
+                   });
+  Trial winner = best_trial(trials);
+
+  // then see whether handing out several blocks at once helps
+  std::vector<Trial> batch_trials{winner};
+  for (unsigned long long batch : {4ull, 16ull, 64ull}) {
+    if (batch * best.block_size > probe_size) {
+      break;
+    }
+    Options candidate = winner.options;
+    candidate.batch = batch;
+    batch_trials.push_back(
+        {candidate, probe(path, candidate, file, probe_size, error, log)});
+  }
+  winner = best_trial(batch_trials);
+  ::close(file);
+
+  const std::string profile_path = device_profile_path(path);
+  if (profile_path.empty() ||
+      !save_profile(profile_path, winner.options, winner.bandwidth)) {
+    error = "Can't save tuning profile " + profile_path;
+    return Status::io_error;
+  }
+  best = winner.options;
+  bandwidth = winner.bandwidth;
+  return Status::ok;
+}
+#else
+std::string physical_device(uint64_t) { return std::string(); }
+
+bool is_rotational(const std::string &) { return false; }
+
+std::string device_profile_path(const char *) { return std::string(); }
+
+bool apply_device_profile(const char *, Options &) { return false; }
+
+Status tune_device(const char *, Options &, double &, std::string &error,
+                   std::ostream *) {
+  error = "Tuning is not supported on Windows";
+  return Status::invalid_argument;
+}
+#endif
+
+} // namespace vsign
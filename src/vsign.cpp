@@ -0,0 +1,1961 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <memory>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include <immintrin.h>
+
+#ifndef _MSC_VER
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <sys/stat.h>
+#include <sys/types.h>
+#endif
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#endif
+
+// Meow is the best hash that I could find so far, others are there for
+// whoever needs them:
+#include "hashers.h"
+
+#include "vsign_internal.h"
+
+namespace vsign {
+
+const char *engine_name(Engine engine) {
+  switch (engine) {
+  case Engine::mmap:
+    return "mmap";
+  case Engine::read:
+    return "read";
+  case Engine::direct:
+    return "direct";
+  case Engine::automatic:
+  default:
+    return "auto";
+  }
+}
+
+Engine parse_engine(const char *name) {
+  if (name != nullptr) {
+    if (!strcmp(name, "mmap"))
+      return Engine::mmap;
+    if (!strcmp(name, "read"))
+      return Engine::read;
+    if (!strcmp(name, "direct"))
+      return Engine::direct;
+  }
+  return Engine::automatic;
+}
+
+const char *algorithm_name(uint32_t algorithm) {
+  switch (static_cast<Algorithm>(algorithm)) {
+  case Algorithm::meow:
+    return "meow";
+  case Algorithm::crc32c:
+    return "crc32c";
+  case Algorithm::xxh3:
+    return "xxh3";
+  case Algorithm::blake3:
+    return "blake3";
+  default:
+    return "unknown";
+  }
+}
+
+bool parse_algorithm(const char *name, Algorithm &algorithm) {
+  for (uint32_t value = 0; value < ALGORITHM_COUNT; ++value) {
+    if (name != nullptr && !strcmp(name, algorithm_name(value))) {
+      algorithm = static_cast<Algorithm>(value);
+      return true;
+    }
+  }
+  return false;
+}
+
+Options resolve_options(const Options &options) {
+  Options resolved = options;
+  if (!resolved.threads)
+    resolved.threads = std::max(1u, std::thread::hardware_concurrency());
+  if (!resolved.batch)
+    resolved.batch = 1;
+  if (resolved.engine == Engine::automatic)
+    resolved.engine = Engine::mmap;
+  return resolved;
+}
+
+uint64_t block_count(uint64_t input_size, uint64_t block_size) {
+  return (input_size + block_size - 1) / block_size;
+}
+
+Source::Source()
+    : mapping_(), holes_(), memory_(nullptr), size_(0), offset_(0),
+      identity_(),
+      file_(-1), owns_file_(0),
+      engine_(Engine::mmap), alignment_(1) {}
+
+Source::~Source() {
+#ifndef _MSC_VER
+  if (owns_file_) {
+    ::close(file_);
+  }
+#endif
+}
+
+#ifndef _MSC_VER
+static FileIdentity to_identity(const struct stat &info) {
+  FileIdentity identity;
+  identity.device = static_cast<uint64_t>(info.st_dev);
+  identity.inode = static_cast<uint64_t>(info.st_ino);
+  identity.size = static_cast<uint64_t>(info.st_size);
+  identity.mtime_ns = static_cast<int64_t>(info.st_mtim.tv_sec) * 1000000000 +
+                      info.st_mtim.tv_nsec;
+  identity.ctime_ns = static_cast<int64_t>(info.st_ctim.tv_sec) * 1000000000 +
+                      info.st_ctim.tv_nsec;
+  identity.type = static_cast<uint32_t>(info.st_mode & S_IFMT);
+  return identity;
+}
+
+// st_size of block devices is 0, their size and logical block size are
+// asked for separately. Direct reads of files are aligned to the largest
+// logical block size there is.
+static bool device_geometry(int file, FileIdentity &identity,
+                            uint32_t &alignment) {
+  alignment = READ_BUFFER_ALIGNMENT;
+#ifdef __linux__
+  if (S_ISBLK(identity.type)) {
+    int logical_block = 0;
+    if (::ioctl(file, BLKGETSIZE64, &identity.size) != 0 ||
+        ::ioctl(file, BLKSSZGET, &logical_block) != 0) {
+      return false;
+    }
+    alignment = static_cast<uint32_t>(logical_block);
+  }
+#else
+  (void)file;
+  (void)identity;
+#endif
+  return true;
+}
+
+bool file_identity(const char *path, FileIdentity &identity) {
+  struct stat info;
+  if (::stat(path, &info) != 0) {
+    return false;
+  }
+  identity = to_identity(info);
+  if (S_ISBLK(info.st_mode)) {
+    const int file = ::open(path, O_RDONLY | O_CLOEXEC);
+    uint32_t alignment;
+    const bool known = file != -1 && device_geometry(file, identity, alignment);
+    if (file != -1) {
+      ::close(file);
+    }
+    return known;
+  }
+  return true;
+}
+#else
+bool file_identity(const char *path, FileIdentity &identity) {
+  struct _stat64 info;
+  if (_stat64(path, &info) != 0) {
+    return false;
+  }
+  identity.device = static_cast<uint64_t>(info.st_dev);
+  identity.inode = static_cast<uint64_t>(info.st_ino);
+  identity.size = static_cast<uint64_t>(info.st_size);
+  identity.mtime_ns = static_cast<int64_t>(info.st_mtime) * 1000000000;
+  identity.ctime_ns = static_cast<int64_t>(info.st_ctime) * 1000000000;
+  identity.type = static_cast<uint32_t>(info.st_mode & _S_IFMT);
+  return true;
+}
+#endif
+
+Status Source::open(const char *path, Engine engine, uint64_t max_size,
+                    std::string &error, uint64_t offset) {
+#ifndef _MSC_VER
+  const int file = ::open(path, O_RDONLY);
+  if (file == -1) {
+    error = std::string("Can't open input file ") + path + ": " +
+            strerror(errno);
+    return Status::io_error;
+  }
+  const Status status = open_fd(file, engine, max_size, error, offset);
+  ::close(file);
+  return status;
+#else
+  engine_ = engine;
+  if (engine != Engine::mmap) {
+    error = std::string("I/O engine '") + engine_name(engine) +
+            "' is not supported on Windows";
+    return Status::invalid_argument;
+  }
+  file_identity(path, identity_);
+  offset_ = offset;
+  if (!mapping_.open_read(path, max_size, offset)) {
+    error = std::string("Can't map input file ") + path + " into memory";
+    return Status::io_error;
+  }
+  memory_ = static_cast<const uint8_t *>(mapping_.accessData());
+  size_ = mapping_.size();
+  return Status::ok;
+#endif
+}
+
+Status Source::open_fd(int file, Engine engine, uint64_t max_size,
+                       std::string &error, uint64_t offset) {
+#ifndef _MSC_VER
+  engine_ = engine;
+  struct stat info;
+  if (::fstat(file, &info) != 0) {
+    error = std::string("Can't stat input file: ") + strerror(errno);
+    return Status::io_error;
+  }
+  identity_ = to_identity(info);
+  if (!device_geometry(file, identity_, alignment_)) {
+    error = std::string("Can't get size of block device: ") + strerror(errno);
+    return Status::io_error;
+  }
+  if (offset > identity_.size) {
+    error = "Offset " + std::to_string(offset) + " is past end of input";
+    return Status::invalid_argument;
+  }
+  offset_ = offset;
+  size_ = identity_.size - offset;
+  if (max_size && max_size < size_) {
+    size_ = max_size;
+  }
+
+  find_holes(file);
+
+  // own a duplicate, so the caller's descriptor can be closed at any moment
+  int duplicate = -1;
+  if (engine == Engine::direct) {
+#ifdef O_DIRECT
+    // a new open file description, O_DIRECT of a dup() would affect the
+    // caller's descriptor too
+    const std::string path = "/proc/self/fd/" + std::to_string(file);
+    duplicate = ::open(path.c_str(), O_RDONLY | O_DIRECT | O_CLOEXEC);
+#else
+    error = "I/O engine 'direct' is not supported on this system";
+    return Status::invalid_argument;
+#endif
+  } else {
+    duplicate = ::dup(file);
+  }
+  if (duplicate == -1) {
+    error = std::string("Can't duplicate file descriptor: ") + strerror(errno);
+    return Status::io_error;
+  }
+  if (engine == Engine::direct) {
+    file_ = duplicate;
+    owns_file_ = 1;
+  } else if (engine == Engine::read) {
+    file_ = duplicate;
+    owns_file_ = 1;
+    ::posix_fadvise(file_, 0, 0, POSIX_FADV_SEQUENTIAL);
+  } else if (size_ > 0) {
+    // mapping of an empty file fails, and there is nothing to hash anyway
+    if (!mapping_.open_read_fd(duplicate, size_, offset_)) {
+      error = std::string("Can't map input file into memory: ") +
+              strerror(errno);
+      return Status::io_error;
+    }
+    memory_ = static_cast<const uint8_t *>(mapping_.accessData());
+  } else {
+    ::close(duplicate);
+  }
+  return Status::ok;
+#else
+  (void)file;
+  (void)engine;
+  (void)max_size;
+  (void)offset;
+  error = "Signing of file descriptors is not supported on Windows";
+  return Status::invalid_argument;
+#endif
+}
+
+// Holes of sparse file read as zeros, there is no need to read them at all
+void Source::find_holes(int file) {
+#if defined(SEEK_HOLE) && defined(SEEK_DATA)
+  // the caller may share file position with us
+  const off_t position = ::lseek(file, 0, SEEK_CUR);
+  const uint64_t end = offset_ + size_;
+  for (uint64_t offset = offset_; offset < end;) {
+    const off_t hole = ::lseek(file, static_cast<off_t>(offset), SEEK_HOLE);
+    // there is always a virtual hole at the end of file
+    if (hole < 0 || static_cast<uint64_t>(hole) >= end) {
+      break;
+    }
+    off_t data = ::lseek(file, hole, SEEK_DATA);
+    if (data < 0 || static_cast<uint64_t>(data) > end) {
+      data = static_cast<off_t>(end); // ENXIO: hole up to the end
+    }
+    // relative to the beginning of source
+    holes_.emplace_back(static_cast<uint64_t>(hole) - offset_,
+                        static_cast<uint64_t>(data) - offset_);
+    offset = static_cast<uint64_t>(data);
+  }
+  if (position >= 0) {
+    ::lseek(file, position, SEEK_SET);
+  }
+#else
+  (void)file;
+#endif
+}
+
+bool Source::is_hole(uint64_t offset, uint64_t size) const {
+  // last hole that begins at or before offset
+  auto hole = std::upper_bound(
+      holes_.begin(), holes_.end(), std::make_pair(offset, UINT64_MAX));
+  if (hole == holes_.begin()) {
+    return false;
+  }
+  --hole;
+  return hole->second >= offset + size;
+}
+
+void Source::open_memory(const void *data, uint64_t size) {
+  engine_ = Engine::mmap;
+  memory_ = static_cast<const uint8_t *>(data);
+  size_ = size;
+}
+
+SignatureWriter::SignatureWriter() : mapping_(), header_() {}
+
+Status SignatureWriter::open(const char *path, const Source &input,
+                             uint64_t block_size, uint64_t chunk_size,
+                             uint64_t key_id, Algorithm algorithm,
+                             std::string &error, bool resume, bool shard) {
+  SignatureHeader &header = header_.signature;
+  memcpy(header.magic, shard ? SHARD_MAGIC : SIGNATURE_MAGIC,
+         sizeof(header.magic));
+  header.version = SIGNATURE_VERSION;
+  header.header_size =
+      shard ? sizeof(ShardHeader) : sizeof(SignatureHeader);
+  header.block_size = block_size;
+  // a shard is a part of the whole input
+  header.file_size = shard ? input.identity().size : input.size();
+  header.mtime_ns = input.identity().mtime_ns;
+  header.key_id = key_id;
+  header.algorithm = static_cast<uint32_t>(algorithm);
+  header.flags = chunk_size ? SIGNATURE_FLAG_TREE : 0;
+  header.chunk_size = chunk_size;
+  if (shard) {
+    header_.first_block = input.offset() / block_size;
+    header_.block_count = block_count(input.size(), block_size);
+  }
+  const uint64_t size =
+      header.header_size + HASH_SIZE * block_count(input.size(), block_size);
+  // new file is all zeros, so there is no valid header until finish()
+  if (!mapping_.open_write(path, size, !resume)) {
+    error = std::string("Can't map output file ") + path + " into memory";
+    return Status::io_error;
+  }
+  return Status::ok;
+}
+
+uint8_t *SignatureWriter::hashes() {
+  return static_cast<uint8_t *>(mapping_.accessData()) +
+         header_.signature.header_size;
+}
+
+uint64_t SignatureWriter::hashes_size() const {
+  return mapping_.size() - header_.signature.header_size;
+}
+
+bool SignatureWriter::flush() { return mapping_.flush(); }
+
+void SignatureWriter::finish() {
+  memcpy(mapping_.accessData(), &header_, header_.signature.header_size);
+  mapping_.close();
+}
+
+bool parse_signature_header(const uint8_t *memory, uint64_t size,
+                            SignatureHeader &header) {
+  if (size < sizeof(header)) {
+    return false;
+  }
+  memcpy(&header, memory, sizeof(header));
+  return !memcmp(header.magic, SIGNATURE_MAGIC, sizeof(header.magic)) &&
+         header.version == SIGNATURE_VERSION &&
+         !(header.flags & ~SIGNATURE_FLAG_TREE) &&
+         header.algorithm < ALGORITHM_COUNT &&
+         header.header_size >= sizeof(header) && header.header_size <= size &&
+         header.block_size >= HASH_SIZE;
+}
+
+bool read_signature_header(const char *signature_file,
+                           SignatureHeader &header) {
+  std::ifstream file(signature_file, std::ios::binary);
+  uint8_t memory[sizeof(header)];
+  if (!file.read(reinterpret_cast<char *>(memory), sizeof(memory))) {
+    return false;
+  }
+  file.seekg(0, std::ios::end);
+  return parse_signature_header(memory, static_cast<uint64_t>(file.tellg()),
+                                header);
+}
+
+// Threads return to the pool after hashing this many bytes of a job
+constexpr uint64_t STEP_SIZE = 8 * 1024 * 1024;
+
+Job::Job(uint64_t job_block_size, uint64_t job_batch)
+    : source(), callback(), sample(), key(), throttle(), resolutions(),
+      writer(),
+      checkpoint(), on_done(), promise(),
+      future(promise.get_future()), block_size(job_block_size),
+      batch(job_batch), chunk_hashes(), pending_chunks(), slot_blocks(),
+      error_mutex_(),
+      error_() {}
+
+void Job::hash_zeros(const uint8_t *zeros, uint64_t size,
+                     uint8_t *hash) const {
+  hash_with(algorithm, key.get(), zeros, size, hash);
+}
+
+// Smaller blocks of resolutions are hashed while a window of input is in L2
+// cache, larger ones absorb the window into their streaming state. Blocks
+// of the same size are hashed with every algorithm one after another, while
+// the block is in L1 cache if it fits there.
+constexpr uint64_t WINDOW_SIZE = 256 * 1024;
+
+// Chunk hashes of blocks in flight in tree mode take about this much memory,
+// however large the input is
+constexpr uint64_t TREE_RING_SIZE = 64 * 1024 * 1024;
+
+bool Job::plan_tree() {
+  if (chunk_size < HASH_SIZE || block_size % chunk_size) {
+    fail(Status::invalid_argument,
+         "Chunk size " + std::to_string(chunk_size) +
+             " doesn't divide block size " + std::to_string(block_size));
+    return false;
+  }
+  chunk_count = vsign::block_count(source.size(), chunk_size);
+  const uint64_t per_block = block_size / chunk_size;
+  // at least two blocks, so that one is hashed while the last chunks of
+  // the other are
+  tree_slots = std::min(
+      block_count,
+      std::max<uint64_t>(2, TREE_RING_SIZE / (per_block * HASH_SIZE)));
+  chunk_hashes.reset(
+      new (std::nothrow) uint8_t[tree_slots * per_block * HASH_SIZE]);
+  pending_chunks.reset(new (std::nothrow) std::atomic<uint64_t>[tree_slots]);
+  slot_blocks.reset(new (std::nothrow) std::atomic<uint64_t>[tree_slots]);
+  if (tree_slots && (!chunk_hashes || !pending_chunks || !slot_blocks)) {
+    fail(Status::internal_error, "Can't allocate memory");
+    return false;
+  }
+  for (uint64_t slot = 0; slot < tree_slots; ++slot) {
+    pending_chunks[slot] = chunks_of(slot);
+    slot_blocks[slot] = slot;
+  }
+  return true;
+}
+
+uint64_t Job::chunks_of(uint64_t block) const {
+  const uint64_t per_block = block_size / chunk_size;
+  return std::min(per_block, chunk_count - block * per_block);
+}
+
+bool Job::wait_for_slot(uint64_t block) const {
+  const std::atomic<uint64_t> &owner = slot_blocks[block % tree_slots];
+  while (owner.load(std::memory_order_acquire) != block) {
+    if (status_ != 0) {
+      return false;
+    }
+    // a thread that took an earlier chunk is finishing the block before
+    std::this_thread::yield();
+  }
+  return true;
+}
+
+// Block sizes are checked by Signer::sign_to_files()
+bool Job::plan_resolutions() {
+  window = resolutions.front().block_size;
+  for (Resolution &resolution : resolutions) {
+    if (static_cast<uint32_t>(resolution.algorithm) >= ALGORITHM_COUNT) {
+      fail(Status::invalid_argument,
+           "Unknown hash algorithm " +
+               std::to_string(static_cast<uint32_t>(resolution.algorithm)));
+      return false;
+    }
+    if (resolution.algorithm == Algorithm::crc32c && key) {
+      fail(Status::invalid_argument, "CRC32C signatures can't be keyed");
+      return false;
+    }
+    if (resolution.block_size <= WINDOW_SIZE) {
+      window = resolution.block_size;
+    }
+    resolution.block_count =
+        vsign::block_count(source.size(), resolution.block_size);
+    resolution.last_block_size =
+        source.size() - (resolution.block_count
+                             ? resolution.block_count - 1
+                             : 0) * resolution.block_size;
+    if (source.has_holes() && resolution.block_count) {
+      std::unique_ptr<uint8_t, decltype(&free)> zeros(
+          static_cast<uint8_t *>(calloc(1, resolution.block_size)), &free);
+      if (!zeros) {
+        fail(Status::internal_error, "Can't allocate memory");
+        return false;
+      }
+      hash_with(resolution.algorithm, key.get(), zeros.get(),
+                resolution.block_size, resolution.zero_hashes);
+      hash_with(resolution.algorithm, key.get(), zeros.get(),
+                resolution.last_block_size,
+                resolution.zero_hashes + HASH_SIZE);
+    }
+  }
+  // No block fits the window: one hash reads the smallest blocks whole,
+  // several of them take the same parts of a block in turns
+  if (window > WINDOW_SIZE && resolutions.size() > 1 &&
+      resolutions[1].block_size == window) {
+    while (window > WINDOW_SIZE && window % 2 == 0) {
+      window /= 2;
+    }
+  }
+  return true;
+}
+
+bool Job::plan(uint64_t output_size) {
+  if (static_cast<uint32_t>(algorithm) >= ALGORITHM_COUNT) {
+    fail(Status::invalid_argument,
+         "Unknown hash algorithm " +
+             std::to_string(static_cast<uint32_t>(algorithm)));
+    return false;
+  }
+  if (algorithm == Algorithm::crc32c && key) {
+    fail(Status::invalid_argument, "CRC32C signatures can't be keyed");
+    return false;
+  }
+  if (block_size < HASH_SIZE) {
+    fail(Status::invalid_argument,
+         "Block size " + std::to_string(block_size) +
+             " is less than minimal block size " + std::to_string(HASH_SIZE));
+    return false;
+  }
+  // threads read whole blocks (chunks in tree mode), reads start at their
+  // multiples
+  const uint64_t unit = chunk_size ? chunk_size : block_size;
+  if (source.engine() == Engine::direct &&
+      (unit % source.alignment() || source.offset() % source.alignment())) {
+    fail(Status::invalid_argument,
+         "I/O engine 'direct' needs block size (chunk size in tree mode) "
+         "that is a multiple of " +
+             std::to_string(source.alignment()));
+    return false;
+  }
+  block_count = vsign::block_count(source.size(), block_size);
+  last_block_size =
+      source.size() - (block_count ? block_count - 1 : 0) * block_size;
+  if (!resolutions.empty() && !plan_resolutions()) {
+    return false;
+  }
+  if (chunk_size && !plan_tree()) {
+    return false;
+  }
+  if (source.has_holes() && block_count) {
+    const uint64_t unit = chunk_size ? chunk_size : block_size;
+    const uint64_t last_unit =
+        chunk_size ? source.size() - (chunk_count - 1) * chunk_size
+                   : last_block_size;
+    // calloc'ed memory is backed by the zero page, it doesn't cost much
+    std::unique_ptr<uint8_t, decltype(&free)> zeros(
+        static_cast<uint8_t *>(calloc(1, unit)), &free);
+    if (!zeros) {
+      fail(Status::internal_error, "Can't allocate memory");
+      return false;
+    }
+    hash_zeros(zeros.get(), unit, zero_hashes);
+    hash_zeros(zeros.get(), last_unit, zero_hashes + HASH_SIZE);
+  }
+  const uint64_t signature_size = block_count * HASH_SIZE;
+  if (expected && output_size != signature_size) {
+    fail(Status::mismatch, "Signature has " + std::to_string(output_size) +
+                               " bytes, but input needs " +
+                               std::to_string(signature_size));
+    return false;
+  }
+  if (!expected && !callback && output_size < signature_size) {
+    fail(Status::buffer_too_small,
+         "Signature needs " + std::to_string(signature_size) +
+             " bytes, but buffer has only " + std::to_string(output_size));
+    return false;
+  }
+  return true;
+}
+
+void Job::fail(Status failure, const std::string &message) {
+  std::lock_guard<std::mutex> lock(error_mutex_);
+  if (status_ == 0) {
+    error_ = message;
+    status_ = static_cast<int>(failure);
+  }
+}
+
+Status Job::status() const { return static_cast<Status>(status_.load()); }
+
+Result Job::result() const {
+  Result result;
+  result.status = status();
+  result.mismatched_blocks = mismatched_blocks;
+  result.first_mismatch =
+      mismatched_blocks ? first_block + first_mismatch.load() : 0;
+  if (result.status == Status::ok && result.mismatched_blocks) {
+    result.status = Status::mismatch;
+    result.error = std::to_string(result.mismatched_blocks) +
+                   " blocks don't match signature, first one is block " +
+                   std::to_string(result.first_mismatch);
+  } else {
+    std::lock_guard<std::mutex> lock(error_mutex_);
+    result.error = error_;
+  }
+  return result;
+}
+
+bool Source::read(uint8_t *buffer, uint64_t offset, uint64_t size) const {
+#ifndef _MSC_VER
+  offset += offset_;
+  // direct reads past the end of input just come out short
+  uint64_t wanted = size;
+  if (engine_ == Engine::direct) {
+    wanted = (size + alignment_ - 1) / alignment_ * alignment_;
+  }
+  uint64_t done = 0;
+  while (done < size) {
+    const ssize_t result =
+        ::pread(file_, buffer + done, wanted - done, offset + done);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      return false;
+    }
+    done += static_cast<uint64_t>(result);
+  }
+  return true;
+#else
+  (void)buffer;
+  (void)offset;
+  (void)size;
+  return false;
+#endif
+}
+
+uint8_t *read_buffer(std::vector<uint8_t> &buffer, uint64_t size) {
+  if (buffer.size() < size + 2 * READ_BUFFER_ALIGNMENT) {
+    buffer.resize(size + 2 * READ_BUFFER_ALIGNMENT);
+  }
+  const uintptr_t address = reinterpret_cast<uintptr_t>(buffer.data());
+  return buffer.data() + (READ_BUFFER_ALIGNMENT - 1) -
+         (address + READ_BUFFER_ALIGNMENT - 1) % READ_BUFFER_ALIGNMENT;
+}
+
+// True if all `size` bytes at `memory` are equal to the first one. Reads
+// 128 bytes per iteration, stops at the first chunk that differs.
+static bool is_constant(const uint8_t *memory, uint64_t size) {
+  const __m256i pattern = _mm256_set1_epi8(static_cast<char>(memory[0]));
+  const __m256i *chunk = reinterpret_cast<const __m256i *>(memory);
+  uint64_t offset = 0;
+  for (; offset + 128 <= size; offset += 128, chunk += 4) {
+    const __m256i difference = _mm256_or_si256(
+        _mm256_or_si256(
+            _mm256_xor_si256(_mm256_loadu_si256(chunk), pattern),
+            _mm256_xor_si256(_mm256_loadu_si256(chunk + 1), pattern)),
+        _mm256_or_si256(
+            _mm256_xor_si256(_mm256_loadu_si256(chunk + 2), pattern),
+            _mm256_xor_si256(_mm256_loadu_si256(chunk + 3), pattern)));
+    if (!_mm256_testz_si256(difference, difference)) {
+      return false;
+    }
+  }
+  for (; offset < size; ++offset) {
+    if (memory[offset] != memory[0]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Blocks of one repeated byte (zeros of preallocated files, mostly) are
+// recognized at memory bandwidth, and their hashes are taken from a cache
+// instead of hashing. Scan of a block that only starts with a repeated byte
+// is wasted, so after such blocks the following ones are skipped, more of
+// them after every miss. One per hasher.
+template <class Hasher> class ConstantBlocks {
+public:
+  // False if block isn't constant or wasn't checked
+  bool hash(const uint8_t *memory, uint64_t size, const Key *key,
+            uint8_t *hash) {
+    if (skip_) {
+      --skip_;
+      return false;
+    }
+    // high-entropy data fails right here, at the cost of two cache lines
+    if (!is_constant(memory, std::min<uint64_t>(size, 128))) {
+      return false;
+    }
+    if (!is_constant(memory, size)) {
+      misses_ = std::min<uint64_t>(misses_ + 1, MAX_SKIP_SHIFT);
+      skip_ = uint64_t(1) << misses_;
+      return false;
+    }
+    misses_ = 0;
+    const uint64_t key_id = key ? key->id : 0;
+    if (key_id != key_id_) {
+      // hashes of another key
+      memset(cache_, 0, sizeof(cache_));
+      key_id_ = key_id;
+    }
+    Entry &entry = cache_[memory[0]];
+    if (entry.size != size) {
+      entry.size = size;
+      Hasher::template hash<_MM_HINT_T0>(key, memory, size, entry.hash);
+    }
+    memcpy(hash, entry.hash, HASH_SIZE);
+    return true;
+  }
+
+private:
+  static constexpr uint64_t MAX_SKIP_SHIFT = 10;
+  struct Entry {
+    uint64_t size;
+    uint8_t hash[HASH_SIZE];
+  };
+  Entry cache_[256] = {}; // by byte value
+  uint64_t skip_ = 0;
+  uint64_t misses_ = 0;
+  uint64_t key_id_ = 0;
+};
+
+void Job::report_mismatch(uint64_t block) {
+  ++mismatched_blocks;
+  uint64_t known = first_mismatch;
+  while (block < known &&
+         !first_mismatch.compare_exchange_weak(known, block)) {
+  }
+}
+
+template <class Hasher>
+void Job::hash_input(const uint8_t *memory, uint64_t size, uint8_t *hash) {
+  if (bypass_cache) {
+    Hasher::template hash<_MM_HINT_NTA>(key.get(), memory, size, hash);
+  } else {
+    Hasher::template hash<_MM_HINT_T0>(key.get(), memory, size, hash);
+  }
+}
+
+template <class Hasher>
+void Job::hash_block(const uint8_t *memory, uint64_t size, uint8_t *hash) {
+  if (!chunk_size) {
+    hash_input<Hasher>(memory, size, hash);
+    return;
+  }
+  thread_local std::vector<uint8_t> hashes;
+  hashes.resize((size + chunk_size - 1) / chunk_size * HASH_SIZE);
+  for (uint64_t offset = 0; offset < size; offset += chunk_size) {
+    hash_input<Hasher>(memory + offset, std::min(chunk_size, size - offset),
+                       hashes.data() + offset / chunk_size * HASH_SIZE);
+  }
+  Hasher::template hash<_MM_HINT_T0>(key.get(), hashes.data(), hashes.size(),
+                                     hash);
+}
+
+bool Job::step() {
+  switch (algorithm) {
+  case Algorithm::crc32c:
+    return step_with<Crc32cHasher>();
+  case Algorithm::xxh3:
+    return step_with<Xxh3Hasher>();
+  case Algorithm::blake3:
+    return step_with<Blake3Hasher>();
+  case Algorithm::meow:
+  default:
+    return step_with<MeowHasher>();
+  }
+}
+
+template <class Hasher> bool Job::step_with() {
+  if (!sample.empty()) {
+    return step_sample<Hasher>();
+  }
+  if (!resolutions.empty()) {
+    return step_resolutions();
+  }
+  if (chunk_size) {
+    return step_tree<Hasher>();
+  }
+  return step_blocks<Hasher>();
+}
+
+template <class Hasher> bool Job::step_blocks() {
+  try {
+    // every thread keeps its buffers between steps and jobs
+    thread_local std::vector<uint8_t> buffer;
+    thread_local std::vector<uint8_t> hashes;
+    thread_local ConstantBlocks<Hasher> constant_blocks;
+    uint8_t *read_memory = nullptr;
+    if (source.engine() != Engine::mmap) {
+      read_memory = read_buffer(buffer, block_size * batch);
+    }
+    if ((callback || expected) && hashes.size() < HASH_SIZE * batch) {
+      hashes.resize(HASH_SIZE * batch);
+    }
+
+    for (uint64_t hashed = 0; hashed < STEP_SIZE && status_ == 0;) {
+      // interlocked increment, strong memory ordering
+      const uint64_t first = next_block.fetch_add(batch);
+      if (first >= block_count) {
+        // end of file reached
+        return false;
+      }
+      const uint64_t end = std::min(first + batch, block_count);
+      if (checkpoint && checkpoint->done(first, end)) {
+        continue; // hashed by interrupted job
+      }
+
+      // blocks in holes of sparse file are neither read nor hashed
+      const uint64_t offset = first * block_size;
+      const uint64_t range =
+          std::min(end * block_size, source.size()) - offset;
+      const bool all_holes =
+          source.has_holes() && source.is_hole(offset, range);
+      if (throttle && !all_holes) {
+        throttle->pace(range);
+      }
+
+      // get raw pointer to data of the first block
+      const uint8_t *input_memory = nullptr;
+      if (all_holes) {
+        // nothing to read
+      } else if (read_memory) {
+        if (!source.read(read_memory, offset, range)) {
+          fail(Status::io_error, "Can't read input at offset " +
+                                     std::to_string(offset) + ": " +
+                                     strerror(errno));
+          return false;
+        }
+        input_memory = read_memory;
+      } else {
+        input_memory = source.memory() + first * block_size;
+      }
+
+      // hashes go straight to output memory if there is one
+      uint8_t *output_memory =
+          output && !expected ? output + first * HASH_SIZE : hashes.data();
+      for (uint64_t position = first; position < end; ++position) {
+        const bool last = position + 1 == block_count;
+        const uint64_t size = last ? last_block_size : block_size;
+        uint8_t *hash = output_memory + (position - first) * HASH_SIZE;
+        if (all_holes || (source.has_holes() &&
+                          source.is_hole(position * block_size, size))) {
+          memcpy(hash, zero_hashes + (last ? HASH_SIZE : 0), HASH_SIZE);
+          continue;
+        }
+        // calculate memory positions where to read/write
+        const uint8_t *block_memory =
+            input_memory + (position - first) * block_size;
+        hashed += size;
+        if (constant_blocks.hash(block_memory, size, key.get(), hash)) {
+          continue;
+        }
+        hash_input<Hasher>(block_memory, size, hash);
+      }
+
+      if (expected) {
+        for (uint64_t position = first; position < end; ++position) {
+          if (memcmp(output_memory + (position - first) * HASH_SIZE,
+                     expected + position * HASH_SIZE, HASH_SIZE) != 0) {
+            report_mismatch(position);
+          }
+        }
+      } else if (callback) {
+        callback(first, output_memory, end - first);
+      } else if (checkpoint) {
+        checkpoint->mark(first, end, *writer);
+      }
+    }
+    return status_ == 0;
+  } catch (const std::exception &error) {
+    fail(Status::internal_error,
+         std::string("Sorry, something went wrong: ") + error.what());
+  } catch (...) {
+    fail(Status::internal_error, "Sorry, something went wrong");
+  }
+  return false;
+}
+
+template <class Hasher> bool Job::step_sample() {
+  try {
+    thread_local std::vector<uint8_t> buffer;
+    uint8_t *read_memory = nullptr;
+    if (source.engine() != Engine::mmap) {
+      read_memory = read_buffer(buffer, block_size);
+    }
+    for (uint64_t hashed = 0; hashed < STEP_SIZE && status_ == 0;) {
+      const uint64_t first = next_block.fetch_add(batch);
+      if (first >= sample.size()) {
+        return false;
+      }
+      const uint64_t end = std::min<uint64_t>(first + batch, sample.size());
+      for (uint64_t index = first; index < end; ++index) {
+        const uint64_t position = sample[index];
+        const bool last = position + 1 == block_count;
+        const uint64_t size = last ? last_block_size : block_size;
+        const uint64_t offset = position * block_size;
+        uint8_t hash[HASH_SIZE];
+        if (!chunk_size && source.has_holes() &&
+            source.is_hole(offset, size)) {
+          memcpy(hash, zero_hashes + (last ? HASH_SIZE : 0), HASH_SIZE);
+        } else {
+          if (throttle) {
+            throttle->pace(size);
+          }
+          const uint8_t *memory = source.memory() + offset;
+          if (read_memory) {
+            if (!source.read(read_memory, offset, size)) {
+              fail(Status::io_error, "Can't read input at offset " +
+                                         std::to_string(offset) + ": " +
+                                         strerror(errno));
+              return false;
+            }
+            memory = read_memory;
+          }
+          hash_block<Hasher>(memory, size, hash);
+          hashed += size;
+        }
+        if (memcmp(hash, expected + position * HASH_SIZE, HASH_SIZE) != 0) {
+          report_mismatch(position);
+        }
+      }
+    }
+    return status_ == 0;
+  } catch (const std::exception &error) {
+    fail(Status::internal_error,
+         std::string("Sorry, something went wrong: ") + error.what());
+  } catch (...) {
+    fail(Status::internal_error, "Sorry, something went wrong");
+  }
+  return false;
+}
+
+// Block size is a multiple of chunk size, so chunk N starts at N * chunk_size
+// of input and chunks of a block are adjacent
+template <class Hasher> bool Job::step_tree() {
+  try {
+    thread_local std::vector<uint8_t> buffer;
+    thread_local ConstantBlocks<Hasher> constant_blocks;
+    uint8_t *read_memory = nullptr;
+    if (source.engine() != Engine::mmap) {
+      read_memory = read_buffer(buffer, chunk_size * batch);
+    }
+    const uint64_t per_block = block_size / chunk_size;
+    for (uint64_t hashed = 0; hashed < STEP_SIZE && status_ == 0;) {
+      const uint64_t first = next_block.fetch_add(batch);
+      if (first >= chunk_count) {
+        return false;
+      }
+      const uint64_t end = std::min(first + batch, chunk_count);
+      // chunks of blocks that a checkpoint has are not hashed, but still
+      // counted, for their slots to go to later blocks
+      const bool skip =
+          checkpoint &&
+          checkpoint->done(first / per_block, (end - 1) / per_block + 1);
+      const uint64_t offset = first * chunk_size;
+      const uint64_t range =
+          std::min(end * chunk_size, source.size()) - offset;
+      const bool all_holes =
+          !skip && source.has_holes() && source.is_hole(offset, range);
+      if (throttle && !skip && !all_holes) {
+        throttle->pace(range);
+      }
+
+      const uint8_t *input_memory = source.memory() + offset;
+      if (!skip && !all_holes && read_memory) {
+        if (!source.read(read_memory, offset, range)) {
+          fail(Status::io_error, "Can't read input at offset " +
+                                     std::to_string(offset) + ": " +
+                                     strerror(errno));
+          return false;
+        }
+        input_memory = read_memory;
+      }
+
+      for (uint64_t chunk = first; chunk < end; ++chunk) {
+        const bool last = chunk + 1 == chunk_count;
+        const uint64_t size =
+            last ? source.size() - chunk * chunk_size : chunk_size;
+        uint8_t hash[HASH_SIZE] = {};
+        if (skip) {
+          // the signature has the hash of its block already
+        } else if (all_holes || (source.has_holes() &&
+                                 source.is_hole(chunk * chunk_size, size))) {
+          memcpy(hash, zero_hashes + (last ? HASH_SIZE : 0), HASH_SIZE);
+        } else {
+          const uint8_t *memory = input_memory + (chunk - first) * chunk_size;
+          hashed += size;
+          if (!constant_blocks.hash(memory, size, key.get(), hash)) {
+            hash_input<Hasher>(memory, size, hash);
+          }
+        }
+        const uint64_t block = chunk / per_block;
+        if (!wait_for_slot(block)) {
+          return false;
+        }
+        const uint64_t slot = block % tree_slots;
+        if (!skip) {
+          memcpy(chunk_hashes.get() +
+                     (slot * per_block + chunk % per_block) * HASH_SIZE,
+                 hash, HASH_SIZE);
+        }
+        // makes hashes of other chunks of the block visible to the last one
+        if (pending_chunks[slot].fetch_sub(1, std::memory_order_acq_rel) ==
+            1) {
+          if (!checkpoint || !checkpoint->done(block, block + 1)) {
+            finish_tree_block<Hasher>(block);
+          }
+          // hand the slot over to the block tree_slots later
+          const uint64_t next = block + tree_slots;
+          if (next < block_count) {
+            pending_chunks[slot].store(chunks_of(next),
+                                       std::memory_order_relaxed);
+          }
+          slot_blocks[slot].store(next, std::memory_order_release);
+        }
+      }
+    }
+    return status_ == 0;
+  } catch (const std::exception &error) {
+    fail(Status::internal_error,
+         std::string("Sorry, something went wrong: ") + error.what());
+  } catch (...) {
+    fail(Status::internal_error, "Sorry, something went wrong");
+  }
+  return false;
+}
+
+// Hash of a block is the hash of its chunks' hashes
+template <class Hasher> void Job::finish_tree_block(uint64_t block) {
+  const uint64_t per_block = block_size / chunk_size;
+  const uint64_t first = (block % tree_slots) * per_block;
+  uint8_t hash[HASH_SIZE];
+  Hasher::template hash<_MM_HINT_T0>(key.get(),
+                                     chunk_hashes.get() + first * HASH_SIZE,
+                                     chunks_of(block) * HASH_SIZE, hash);
+  if (expected) {
+    if (memcmp(hash, expected + block * HASH_SIZE, HASH_SIZE) != 0) {
+      report_mismatch(block);
+    }
+  } else if (callback) {
+    callback(block, hash, 1);
+  } else {
+    memcpy(output + block * HASH_SIZE, hash, HASH_SIZE);
+    if (checkpoint) {
+      checkpoint->mark(block, block + 1, *writer);
+    }
+  }
+}
+
+// Window of input at `memory`, [position, position + length), into the
+// streaming state of a resolution with larger blocks. `last` if input of
+// the job ends with it, maybe in the middle of a block.
+template <class Hasher>
+void Job::absorb_window(Resolution &resolution, typename Hasher::State &state,
+                        const uint8_t *memory, uint64_t position,
+                        uint64_t length, bool last) {
+  if (position % resolution.block_size == 0) {
+    Hasher::begin(state, key.get());
+  }
+  Hasher::absorb(state, memory, length);
+  if ((position + length) % resolution.block_size == 0 || last) {
+    const uint64_t block = position / resolution.block_size;
+    Hasher::end(state, resolution.writer->hashes() + block * HASH_SIZE);
+  }
+}
+
+// Hashes [offset, offset + size) of input at `memory` with every
+// resolution, window by window. `states` are of each resolution.
+void Job::hash_resolutions(const uint8_t *memory, uint64_t offset,
+                           uint64_t size, HasherStates &states) {
+  for (uint64_t done = 0; done < size; done += window) {
+    const uint64_t length = std::min(window, size - done);
+    const uint64_t position = offset + done;
+    const uint8_t *input = memory + done;
+    size_t index = 0;
+    // resolutions of the same block size take each block in turns
+    while (index < resolutions.size() &&
+           resolutions[index].block_size <= window) {
+      const uint64_t small = resolutions[index].block_size;
+      size_t end = index;
+      while (end < resolutions.size() && resolutions[end].block_size == small) {
+        ++end;
+      }
+      for (uint64_t part = 0; part < length; part += small) {
+        const uint64_t block = (position + part) / small;
+        for (size_t next = index; next < end; ++next) {
+          uint8_t *hash =
+              resolutions[next].writer->hashes() + block * HASH_SIZE;
+          visit_hasher(resolutions[next].algorithm, [&](auto hasher) {
+            hash_input<decltype(hasher)>(
+                input + part, std::min(small, length - part), hash);
+          });
+        }
+      }
+      index = end;
+    }
+    for (; index < resolutions.size(); ++index) {
+      Resolution &resolution = resolutions[index];
+      visit_hasher(resolution.algorithm, [&](auto hasher) {
+        using Hasher = decltype(hasher);
+        absorb_window<Hasher>(resolution, states.of<Hasher>()[index], input,
+                              position, length, done + length == size);
+      });
+    }
+  }
+}
+
+bool Job::step_resolutions() {
+  try {
+    thread_local std::vector<uint8_t> buffer;
+    thread_local HasherStates states;
+    uint8_t *read_memory = nullptr;
+    if (source.engine() != Engine::mmap) {
+      read_memory = read_buffer(buffer, block_size * batch);
+    }
+    for (const Resolution &resolution : resolutions) {
+      visit_hasher(resolution.algorithm, [&](auto hasher) {
+        auto &of_hasher = states.of<decltype(hasher)>();
+        of_hasher.resize(std::max(of_hasher.size(), resolutions.size()));
+      });
+    }
+
+    for (uint64_t hashed = 0; hashed < STEP_SIZE && status_ == 0;) {
+      const uint64_t first = next_block.fetch_add(batch);
+      if (first >= block_count) {
+        return false;
+      }
+      const uint64_t end = std::min(first + batch, block_count);
+      const uint64_t offset = first * block_size;
+      const uint64_t range =
+          std::min(end * block_size, source.size()) - offset;
+      const bool all_holes =
+          source.has_holes() && source.is_hole(offset, range);
+      if (throttle && !all_holes) {
+        throttle->pace(range);
+      }
+
+      const uint8_t *input_memory = source.memory() + offset;
+      if (!all_holes && read_memory) {
+        if (!source.read(read_memory, offset, range)) {
+          fail(Status::io_error, "Can't read input at offset " +
+                                     std::to_string(offset) + ": " +
+                                     strerror(errno));
+          return false;
+        }
+        input_memory = read_memory;
+      }
+
+      for (uint64_t position = first; position < end; ++position) {
+        const uint64_t size =
+            position + 1 == block_count ? last_block_size : block_size;
+        const uint64_t block_offset = position * block_size;
+        if (all_holes ||
+            (source.has_holes() && source.is_hole(block_offset, size))) {
+          // every block of every resolution is a hole too
+          for (Resolution &resolution : resolutions) {
+            const uint64_t last =
+                (block_offset + size - 1) / resolution.block_size;
+            for (uint64_t block = block_offset / resolution.block_size;
+                 block <= last; ++block) {
+              const bool last_block = block + 1 == resolution.block_count;
+              memcpy(resolution.writer->hashes() + block * HASH_SIZE,
+                     resolution.zero_hashes + (last_block ? HASH_SIZE : 0),
+                     HASH_SIZE);
+            }
+          }
+          continue;
+        }
+        hash_resolutions(input_memory + (position - first) * block_size,
+                         block_offset, size, states);
+        hashed += size;
+      }
+    }
+    return status_ == 0;
+  } catch (const std::exception &error) {
+    fail(Status::internal_error,
+         std::string("Sorry, something went wrong: ") + error.what());
+  } catch (...) {
+    fail(Status::internal_error, "Sorry, something went wrong");
+  }
+  return false;
+}
+
+void Job::complete() {
+  const Result outcome = result();
+  if (writer) {
+    if (outcome.status == Status::ok) {
+      writer->finish();
+      if (checkpoint) {
+        checkpoint->remove();
+      }
+    } else if (checkpoint) {
+      // whatever is hashed won't be hashed again on resume
+      checkpoint->save(*writer);
+    }
+    writer.reset();
+  }
+  for (Resolution &resolution : resolutions) {
+    if (outcome.status == Status::ok) {
+      resolution.writer->finish();
+    }
+    resolution.writer.reset();
+  }
+  if (on_done) {
+    try {
+      on_done(outcome);
+    } catch (...) {
+      // nobody to report it to
+    }
+  }
+  promise.set_value(outcome);
+#ifdef __linux__
+  if (event_fd != -1) {
+    const uint64_t one = 1;
+    const ssize_t written = ::write(event_fd, &one, sizeof(one));
+    (void)written; // only fails if counter overflows, readers wake up anyway
+  }
+#endif
+}
+
+// Workers besides the calling thread, which helps them only if they run
+// with its priority
+static ThreadPool *make_pool(const Options &options, size_t helpers) {
+  if (options.priority == Priority::normal) {
+    return new ThreadPool(options.threads - helpers, options.verbose);
+  }
+  const Priority priority = options.priority;
+  return new ThreadPool(options.threads, options.verbose,
+                        [priority] { apply_priority(priority); });
+}
+
+Signer::Signer(const Options &options)
+    : options_(resolve_options(options)), pool_(make_pool(options_, 1)),
+      cache_(), error_() {}
+
+Signer::~Signer() = default;
+
+const Options &Signer::options() const { return options_; }
+
+uint64_t Signer::block_count(uint64_t input_size) const {
+  return vsign::block_count(input_size, options_.block_size);
+}
+
+uint64_t Signer::signature_size(uint64_t input_size) const {
+  return HASH_SIZE * block_count(input_size);
+}
+
+const std::string &Signer::error() const { return error_; }
+
+Status run_job(ThreadPool &pool, const std::shared_ptr<Job> &job,
+               uint64_t output_size, std::string &error, Result *result) {
+  if (job->plan(output_size)) {
+    pool.run(job);
+  }
+  const Result outcome = job->result();
+  if (result) {
+    *result = outcome;
+  }
+  if (outcome.status != Status::ok) {
+    error = outcome.error;
+  }
+  return outcome.status;
+}
+
+static std::shared_ptr<Job> make_job(const Options &options) {
+  auto job = std::make_shared<Job>(options.block_size, options.batch);
+  job->key = options.key;
+  job->throttle = options.throttle;
+  job->bypass_cache = options.bypass_cache;
+  job->chunk_size = options.chunk_size;
+  job->algorithm = options.algorithm;
+  return job;
+}
+
+// Signature file of one block size, with checkpoint if options want it
+static Status open_writer(Job &job, const char *output, uint64_t block_size,
+                          const Options &options, std::string &error) {
+  const uint64_t key_id = options.key ? options.key->id : 0;
+  bool resumed = false;
+  bool regular = true;
+#ifndef _MSC_VER
+  // writes to block devices don't touch their times, nothing would tell
+  // that blocks hashed before changed since, so their checkpoints are no use
+  regular = S_ISREG(job.source.identity().type);
+  if (options.resume && !regular) {
+    error = "Only signing of regular files can be resumed, writes to block "
+            "devices don't change anything that tells they were written to";
+    return Status::invalid_argument;
+  }
+#endif
+  if (regular && (options.checkpoint_interval || options.resume)) {
+    job.checkpoint.reset(new Checkpoint());
+    resumed = job.checkpoint->open(
+        output, job.source.identity(), block_size, options.chunk_size,
+        key_id, job.algorithm,
+        vsign::block_count(job.source.size(), block_size),
+        options.checkpoint_interval, options.resume != 0);
+  }
+  job.writer.reset(new SignatureWriter());
+  const Status status =
+      job.writer->open(output, job.source, block_size, options.chunk_size,
+                       key_id, job.algorithm, error, resumed);
+  if (status == Status::ok) {
+    job.output = job.writer->hashes();
+  }
+  return status;
+}
+
+static std::string key_name(uint64_t id) {
+  char name[20];
+  snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(id));
+  return name;
+}
+
+uint64_t tree_chunk_size(const SignatureHeader &header) {
+  return header.flags & SIGNATURE_FLAG_TREE ? header.chunk_size : 0;
+}
+
+Status signature_key(const Options &options, uint64_t key_id,
+                     std::shared_ptr<const Key> &key, std::string &error) {
+  const uint64_t own = options.key ? options.key->id : 0;
+  if (key_id == own) {
+    key = options.key;
+    return Status::ok;
+  }
+  if (!key_id) {
+    // or anyone could replace keyed signature with unkeyed one
+    error = "Signature is not keyed, but key " + key_name(own) + " is given";
+    return Status::mismatch;
+  }
+  if (own) {
+    error = "Signature was made with key " + key_name(key_id) + ", not " +
+            key_name(own);
+    return Status::mismatch;
+  }
+  std::shared_ptr<Key> cached(new Key());
+  if (!find_key(key_id, *cached)) {
+    error = "Signature was made with key " + key_name(key_id) +
+            ", which is not given";
+    return Status::invalid_argument;
+  }
+  key = std::move(cached);
+  return Status::ok;
+}
+
+Status Signer::sign_file(const char *path, void *signature, size_t capacity) {
+  auto job = make_job(options_);
+  Status status = job->source.open(path, options_.engine, 0, error_);
+  if (status != Status::ok)
+    return status;
+  job->output = static_cast<uint8_t *>(signature);
+  return run_job(*pool_, job, capacity, error_);
+}
+
+Status Signer::sign_fd(int file, void *signature, size_t capacity) {
+  auto job = make_job(options_);
+  Status status = job->source.open_fd(file, options_.engine, 0, error_);
+  if (status != Status::ok)
+    return status;
+  job->output = static_cast<uint8_t *>(signature);
+  return run_job(*pool_, job, capacity, error_);
+}
+
+Status Signer::sign_buffer(const void *data, uint64_t size, void *signature,
+                           size_t capacity) {
+  auto job = make_job(options_);
+  job->source.open_memory(data, size);
+  job->output = static_cast<uint8_t *>(signature);
+  return run_job(*pool_, job, capacity, error_);
+}
+
+Status Signer::sign_file(const char *path, const HashCallback &callback) {
+  auto job = make_job(options_);
+  Status status = job->source.open(path, options_.engine, 0, error_);
+  if (status != Status::ok)
+    return status;
+  job->callback = callback;
+  return run_job(*pool_, job, 0, error_);
+}
+
+Status Signer::sign_fd(int file, const HashCallback &callback) {
+  auto job = make_job(options_);
+  Status status = job->source.open_fd(file, options_.engine, 0, error_);
+  if (status != Status::ok)
+    return status;
+  job->callback = callback;
+  return run_job(*pool_, job, 0, error_);
+}
+
+Status Signer::sign_buffer(const void *data, uint64_t size,
+                           const HashCallback &callback) {
+  auto job = make_job(options_);
+  job->source.open_memory(data, size);
+  job->callback = callback;
+  return run_job(*pool_, job, 0, error_);
+}
+
+// Opened on first use, nullptr if disabled or can't be opened
+SignatureCache *Signer::signature_cache() {
+#ifndef _MSC_VER
+  if (options_.cache != CachePolicy::off && !cache_) {
+    std::unique_ptr<SignatureCache> cache(new SignatureCache());
+    std::string error;
+    if (cache->open(cache_directory() + "/signatures.db", error) ==
+        Status::ok) {
+      cache_ = std::move(cache);
+    } else {
+      options_.cache = CachePolicy::off; // signing still works without it
+    }
+  }
+#endif
+  return cache_.get();
+}
+
+Status Signer::sign_to_file(const char *input, const char *output,
+                            bool *skipped) {
+  const uint64_t block_size = options_.block_size;
+  return sign_to_files(input, &block_size, &output, 1, skipped);
+}
+
+Status Signer::sign_to_files(const char *input, const uint64_t *block_sizes,
+                             const char *const *outputs, size_t count,
+                             bool *skipped) {
+  const std::vector<Algorithm> algorithms(count, options_.algorithm);
+  return sign_to_files(input, block_sizes, algorithms.data(), outputs, count,
+                       skipped);
+}
+
+Status Signer::sign_to_files(const char *input, const uint64_t *block_sizes,
+                             const Algorithm *algorithms,
+                             const char *const *outputs, size_t count,
+                             bool *skipped) {
+  if (skipped)
+    *skipped = false;
+  if (!count) {
+    error_ = "No block sizes to sign with";
+    return Status::invalid_argument;
+  }
+  const uint64_t key_id = options_.key ? options_.key->id : 0;
+  SignatureCache *cache = signature_cache();
+  SignatureCache::Entry entry;
+  FileIdentity identity;
+  bool cached = cache && file_identity(input, identity);
+  for (size_t index = 0; cached && index < count; ++index) {
+    cached = SignatureCache::make_entry(identity, outputs[index],
+                                        block_sizes[index],
+                                        options_.chunk_size, key_id,
+                                        algorithms[index], entry) &&
+             cache->find(entry) &&
+             (options_.cache == CachePolicy::trust ||
+              verify_from_file(input, outputs[index]) == Status::ok);
+  }
+  if (cached) {
+    if (skipped)
+      *skipped = true;
+    return Status::ok;
+  }
+
+  if (count > 1 && options_.chunk_size) {
+    error_ = "Tree mode signs one signature at a time";
+    return Status::invalid_argument;
+  }
+  if (options_.chunk_size && block_sizes[0] % options_.chunk_size) {
+    // before an existing signature is overwritten
+    error_ = "Chunk size " + std::to_string(options_.chunk_size) +
+             " doesn't divide block size " + std::to_string(block_sizes[0]);
+    return Status::invalid_argument;
+  }
+  // ascending block sizes, the job steps through input by the largest one
+  std::vector<size_t> order(count);
+  for (size_t index = 0; index < count; ++index) {
+    order[index] = index;
+  }
+  std::sort(order.begin(), order.end(),
+            [block_sizes, algorithms](size_t a, size_t b) {
+              return block_sizes[a] != block_sizes[b]
+                         ? block_sizes[a] < block_sizes[b]
+                         : algorithms[a] < algorithms[b];
+            });
+  for (size_t index = 1; index < count; ++index) {
+    const uint64_t smaller = block_sizes[order[index - 1]];
+    const uint64_t larger = block_sizes[order[index]];
+    const Algorithm algorithm = algorithms[order[index]];
+    if (larger == smaller && algorithm == algorithms[order[index - 1]]) {
+      error_ = "Block size " + std::to_string(larger) + " is given twice " +
+               "with algorithm " +
+               algorithm_name(static_cast<uint32_t>(algorithm));
+      return Status::invalid_argument;
+    }
+    if (smaller < HASH_SIZE || larger % smaller) {
+      error_ = "Block size " + std::to_string(larger) +
+               " is not a multiple of " + std::to_string(smaller);
+      return Status::invalid_argument;
+    }
+  }
+  auto job = std::make_shared<Job>(block_sizes[order.back()], options_.batch);
+  job->key = options_.key;
+  job->throttle = options_.throttle;
+  job->bypass_cache = options_.bypass_cache;
+  job->chunk_size = options_.chunk_size;
+  job->algorithm = algorithms[order[0]];
+  Status status = job->source.open(input, options_.engine, 0, error_);
+  if (status != Status::ok)
+    return status;
+
+  uint64_t output_size = 0;
+  if (count == 1) {
+    status = open_writer(*job, outputs[0], block_sizes[0], options_, error_);
+    if (status != Status::ok)
+      return status;
+    output_size = job->writer->hashes_size();
+  } else {
+    job->resolutions.resize(count);
+    for (size_t index = 0; index < count; ++index) {
+      Resolution &resolution = job->resolutions[index];
+      resolution.block_size = block_sizes[order[index]];
+      resolution.algorithm = algorithms[order[index]];
+      resolution.writer.reset(new SignatureWriter());
+      status = resolution.writer->open(outputs[order[index]], job->source,
+                                       resolution.block_size, 0, key_id,
+                                       resolution.algorithm, error_);
+      if (status != Status::ok)
+        return status;
+    }
+    output_size = job->resolutions.back().writer->hashes_size();
+  }
+  status = run_job(*pool_, job, output_size, error_);
+  // identity as of opening: changes made while hashing go unnoticed
+  for (size_t index = 0; status == Status::ok && cache && index < count;
+       ++index) {
+    if (SignatureCache::make_entry(job->source.identity(), outputs[index],
+                                   block_sizes[index], options_.chunk_size,
+                                   key_id, algorithms[index], entry)) {
+      cache->store(entry);
+    }
+  }
+  return status;
+}
+
+Status Signer::sign_range_to_file(const char *input, const char *output,
+                                  uint64_t offset, uint64_t length) {
+  const uint64_t block_size = options_.block_size;
+  if (options_.chunk_size && block_size % options_.chunk_size) {
+    error_ = "Chunk size " + std::to_string(options_.chunk_size) +
+             " doesn't divide block size " + std::to_string(block_size);
+    return Status::invalid_argument;
+  }
+  FileIdentity identity;
+  if (!file_identity(input, identity)) {
+    error_ = std::string("Can't open input file ") + input + ": " +
+             strerror(errno);
+    return Status::io_error;
+  }
+  if (!length || offset >= identity.size) {
+    error_ = "Range starting at " + std::to_string(offset) +
+             " is outside of input of " + std::to_string(identity.size) +
+             " bytes";
+    return Status::invalid_argument;
+  }
+  if (offset % block_size ||
+      (length % block_size && length < identity.size - offset)) {
+    // START:END, the way --shard takes it
+    const uint64_t end = std::min(length, identity.size - offset) + offset;
+    error_ = "Range " + std::to_string(offset) + ":" + std::to_string(end) +
+             " doesn't start and end at boundaries of blocks of " +
+             std::to_string(block_size) + " bytes";
+    return Status::invalid_argument;
+  }
+  auto job = make_job(options_);
+  job->first_block = offset / block_size;
+  Status status =
+      job->source.open(input, options_.engine, length, error_, offset);
+  if (status != Status::ok)
+    return status;
+  job->writer.reset(new SignatureWriter());
+  status = job->writer->open(output, job->source, block_size,
+                             options_.chunk_size,
+                             options_.key ? options_.key->id : 0,
+                             options_.algorithm, error_, false, true);
+  if (status != Status::ok)
+    return status;
+  job->output = job->writer->hashes();
+  return run_job(*pool_, job, job->writer->hashes_size(), error_);
+}
+
+Status Signer::verify_file(const char *path, const void *signature,
+                           size_t size, Result *result) {
+  auto job = make_job(options_);
+  Status status = job->source.open(path, options_.engine, 0, error_);
+  if (status != Status::ok)
+    return status;
+  job->expected = static_cast<const uint8_t *>(signature);
+  return run_job(*pool_, job, size, error_, result);
+}
+
+Status Signer::verify_buffer(const void *data, uint64_t data_size,
+                             const void *signature, size_t size,
+                             Result *result) {
+  auto job = make_job(options_);
+  job->source.open_memory(data, data_size);
+  job->expected = static_cast<const uint8_t *>(signature);
+  return run_job(*pool_, job, size, error_, result);
+}
+
+Status Signer::verify_from_file(const char *input, const char *signature_file,
+                                Result *result) {
+  Source signature;
+  Status status = signature.open(signature_file, Engine::mmap, 0, error_);
+  if (status != Status::ok)
+    return status;
+  SignatureHeader header;
+  if (!parse_signature_header(signature.memory(), signature.size(), header)) {
+    // bare hashes of old versions
+    return verify_file(input, signature.memory(), signature.size(), result);
+  }
+  auto job = std::make_shared<Job>(header.block_size, options_.batch);
+  job->bypass_cache = options_.bypass_cache;
+  job->throttle = options_.throttle;
+  job->chunk_size = tree_chunk_size(header);
+  job->algorithm = static_cast<Algorithm>(header.algorithm);
+  status = signature_key(options_, header.key_id, job->key, error_);
+  if (status != Status::ok)
+    return status;
+  status = job->source.open(input, options_.engine, 0, error_);
+  if (status != Status::ok)
+    return status;
+  job->expected = signature.memory() + header.header_size;
+  return run_job(*pool_, job, signature.size() - header.header_size, error_,
+                 result);
+}
+
+Status Signer::verify_range(const char *input, const char *signature_file,
+                            uint64_t offset, uint64_t length, Result *result) {
+  SignatureHeader header{};
+  uint64_t block_size = options_.block_size;
+  uint64_t chunk_size = options_.chunk_size;
+  uint64_t hashes_offset = 0; // bare hashes of old versions
+  std::shared_ptr<const Key> key = options_.key;
+  Algorithm algorithm = options_.algorithm;
+  if (read_signature_header(signature_file, header)) {
+    block_size = header.block_size;
+    chunk_size = tree_chunk_size(header);
+    algorithm = static_cast<Algorithm>(header.algorithm);
+    hashes_offset = header.header_size;
+    const Status status =
+        signature_key(options_, header.key_id, key, error_);
+    if (status != Status::ok)
+      return status;
+  }
+  FileIdentity input_file, signature_identity;
+  if (!file_identity(input, input_file)) {
+    error_ = std::string("Can't open input file ") + input + ": " +
+             strerror(errno);
+    return Status::io_error;
+  }
+  if (!file_identity(signature_file, signature_identity)) {
+    error_ = std::string("Can't open signature file ") + signature_file +
+             ": " + strerror(errno);
+    return Status::io_error;
+  }
+  if (!length || offset >= input_file.size ||
+      length > input_file.size - offset) {
+    error_ = "Range " + std::to_string(offset) + ":" + std::to_string(length) +
+             " is outside of input of " + std::to_string(input_file.size) +
+             " bytes";
+    return Status::invalid_argument;
+  }
+
+  // blocks that overlap the range, and their hashes
+  const uint64_t first = offset / block_size;
+  const uint64_t end = (offset + length - 1) / block_size + 1;
+  if (signature_identity.size < hashes_offset + end * HASH_SIZE) {
+    error_ = "Signature has no hash of block " + std::to_string(end - 1);
+    return Status::mismatch;
+  }
+  auto job = std::make_shared<Job>(block_size, options_.batch);
+  job->bypass_cache = options_.bypass_cache;
+  job->throttle = options_.throttle;
+  job->key = key;
+  job->chunk_size = chunk_size;
+  job->algorithm = algorithm;
+  job->first_block = first;
+  Status status = job->source.open(input, options_.engine,
+                                   (end - first) * block_size, error_,
+                                   first * block_size);
+  if (status != Status::ok)
+    return status;
+  Source signature;
+  status = signature.open(signature_file, Engine::mmap,
+                          (end - first) * HASH_SIZE, error_,
+                          hashes_offset + first * HASH_SIZE);
+  if (status != Status::ok)
+    return status;
+  job->expected = signature.memory();
+  return run_job(*pool_, job, signature.size(), error_, result);
+}
+
+// splitmix64, the same sequence on every platform
+static uint64_t next_random(uint64_t &state) {
+  uint64_t value = (state += 0x9e3779b97f4a7c15ull);
+  value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ull;
+  value = (value ^ (value >> 27)) * 0x94d049bb133111ebull;
+  return value ^ (value >> 31);
+}
+
+// `count` distinct blocks of `total` (Floyd's algorithm), sorted
+static std::vector<uint64_t> sample_blocks(uint64_t total, uint64_t count,
+                                           uint64_t seed) {
+  std::vector<uint64_t> blocks;
+  if (count >= total) {
+    blocks.resize(total);
+    for (uint64_t block = 0; block < total; ++block) {
+      blocks[block] = block;
+    }
+    return blocks;
+  }
+  std::unordered_set<uint64_t> chosen;
+  chosen.reserve(count);
+  uint64_t state = seed;
+  for (uint64_t limit = total - count; limit < total; ++limit) {
+    const uint64_t block = next_random(state) % (limit + 1);
+    if (!chosen.insert(block).second) {
+      chosen.insert(limit);
+    }
+  }
+  blocks.assign(chosen.begin(), chosen.end());
+  std::sort(blocks.begin(), blocks.end());
+  return blocks;
+}
+
+double detection_confidence(uint64_t total, uint64_t checked,
+                            double corrupted_fraction) {
+  if (!total || !checked || corrupted_fraction <= 0) {
+    return 0;
+  }
+  const double corrupted = std::min(
+      static_cast<double>(total),
+      std::ceil(corrupted_fraction * static_cast<double>(total)));
+  const double blocks = static_cast<double>(total);
+  const double sample = static_cast<double>(std::min(checked, total));
+  if (sample > blocks - corrupted) {
+    return 1; // can't miss all of them
+  }
+  // 1 - C(total - corrupted, checked) / C(total, checked)
+  const double miss =
+      std::exp(std::lgamma(blocks - corrupted + 1) -
+               std::lgamma(blocks - corrupted - sample + 1) -
+               std::lgamma(blocks + 1) + std::lgamma(blocks - sample + 1));
+  return 1 - miss;
+}
+
+Status Signer::verify_sample(const char *input, const char *signature_file,
+                             const SampleOptions &sample, Result *result,
+                             SampleReport *report) {
+  Source signature;
+  Status status = signature.open(signature_file, Engine::mmap, 0, error_);
+  if (status != Status::ok)
+    return status;
+  SignatureHeader header;
+  uint64_t block_size = options_.block_size;
+  uint64_t chunk_size = options_.chunk_size;
+  uint64_t hashes_offset = 0; // bare hashes of old versions
+  std::shared_ptr<const Key> key = options_.key;
+  Algorithm algorithm = options_.algorithm;
+  if (parse_signature_header(signature.memory(), signature.size(), header)) {
+    block_size = header.block_size;
+    chunk_size = tree_chunk_size(header);
+    algorithm = static_cast<Algorithm>(header.algorithm);
+    hashes_offset = header.header_size;
+    status = signature_key(options_, header.key_id, key, error_);
+    if (status != Status::ok)
+      return status;
+  }
+
+  // blocks are picked at random, read-ahead would only waste bandwidth
+  auto job = std::make_shared<Job>(block_size, options_.batch);
+  job->bypass_cache = options_.bypass_cache;
+  job->throttle = options_.throttle;
+  job->key = key;
+  job->chunk_size = chunk_size;
+  job->algorithm = algorithm;
+  const Engine engine =
+      options_.engine == Engine::direct ? Engine::direct : Engine::read;
+  status = job->source.open(input, engine, 0, error_);
+  if (status != Status::ok)
+    return status;
+#ifndef _MSC_VER
+  ::posix_fadvise(job->source.file(), 0, 0, POSIX_FADV_RANDOM);
+#endif
+  const uint64_t total = vsign::block_count(job->source.size(), block_size);
+  uint64_t count = sample.count;
+  if (!count) {
+    count = static_cast<uint64_t>(
+        std::ceil(static_cast<double>(total) * sample.percent / 100));
+  }
+  // at least one block, empty sample would mean checking all of them
+  job->sample = sample_blocks(total, std::max<uint64_t>(count, 1), sample.seed);
+  if (report) {
+    report->total_blocks = total;
+    report->checked_blocks = job->sample.size();
+  }
+  job->expected = signature.memory() + hashes_offset;
+  return run_job(*pool_, job, signature.size() - hashes_offset, error_,
+                 result);
+}
+
+JobHandle::JobHandle() : job_() {}
+
+JobHandle::JobHandle(const std::shared_ptr<Job> &job) : job_(job) {}
+
+bool JobHandle::valid() const { return job_ != nullptr; }
+
+bool JobHandle::ready() const {
+  return job_->future.wait_for(std::chrono::seconds(0)) ==
+         std::future_status::ready;
+}
+
+const Result &JobHandle::wait() const { return job_->future.get(); }
+
+std::shared_future<Result> JobHandle::future() const { return job_->future; }
+
+void JobHandle::cancel() const { job_->fail(Status::cancelled, "Cancelled"); }
+
+AsyncSigner::AsyncSigner(const Options &options)
+    : options_(resolve_options(options)),
+      pool_(make_pool(options_, 0)),
+      event_fd_(-1), reserved_(0) {
+#ifdef __linux__
+  event_fd_ = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+#endif
+}
+
+AsyncSigner::~AsyncSigner() {
+  pool_.reset();
+#ifndef _MSC_VER
+  if (event_fd_ != -1) {
+    ::close(event_fd_);
+  }
+#endif
+}
+
+const Options &AsyncSigner::options() const { return options_; }
+
+int AsyncSigner::event_fd() const { return event_fd_; }
+
+JobHandle AsyncSigner::submit(const std::shared_ptr<Job> &job,
+                              uint64_t output_size,
+                              const CompletionCallback &done) {
+  job->on_done = done;
+  job->event_fd = event_fd_;
+  if (job->status() == Status::ok && job->plan(output_size)) {
+    pool_->submit(job);
+  } else {
+    // failed before it started, but still finishes the usual way
+    job->complete();
+  }
+  return JobHandle(job);
+}
+
+JobHandle AsyncSigner::sign_file(const char *path, void *signature,
+                                 size_t capacity,
+                                 const CompletionCallback &done) {
+  auto job = make_job(options_);
+  std::string error;
+  if (job->source.open(path, options_.engine, 0, error) != Status::ok)
+    job->fail(Status::io_error, error);
+  job->output = static_cast<uint8_t *>(signature);
+  return submit(job, capacity, done);
+}
+
+JobHandle AsyncSigner::sign_fd(int file, void *signature, size_t capacity,
+                               const CompletionCallback &done) {
+  auto job = make_job(options_);
+  std::string error;
+  if (job->source.open_fd(file, options_.engine, 0, error) != Status::ok)
+    job->fail(Status::io_error, error);
+  job->output = static_cast<uint8_t *>(signature);
+  return submit(job, capacity, done);
+}
+
+JobHandle AsyncSigner::sign_buffer(const void *data, uint64_t size,
+                                   void *signature, size_t capacity,
+                                   const CompletionCallback &done) {
+  auto job = make_job(options_);
+  job->source.open_memory(data, size);
+  job->output = static_cast<uint8_t *>(signature);
+  return submit(job, capacity, done);
+}
+
+JobHandle AsyncSigner::sign_file(const char *path, const HashCallback &hashes,
+                                 const CompletionCallback &done) {
+  auto job = make_job(options_);
+  std::string error;
+  if (job->source.open(path, options_.engine, 0, error) != Status::ok)
+    job->fail(Status::io_error, error);
+  job->callback = hashes;
+  return submit(job, 0, done);
+}
+
+JobHandle AsyncSigner::sign_to_file(const char *input, const char *output,
+                                    const CompletionCallback &done) {
+  auto job = make_job(options_);
+  std::string error;
+  Status status = job->source.open(input, options_.engine, 0, error);
+  if (status == Status::ok) {
+    status = open_writer(*job, output, options_.block_size, options_, error);
+  }
+  if (status != Status::ok) {
+    job->fail(status, error);
+    return submit(job, 0, done);
+  }
+  return submit(job, job->writer->hashes_size(), done);
+}
+
+JobHandle AsyncSigner::verify_file(const char *path, const void *signature,
+                                   size_t size,
+                                   const CompletionCallback &done) {
+  auto job = make_job(options_);
+  std::string error;
+  if (job->source.open(path, options_.engine, 0, error) != Status::ok)
+    job->fail(Status::io_error, error);
+  job->expected = static_cast<const uint8_t *>(signature);
+  return submit(job, size, done);
+}
+
+JobHandle AsyncSigner::verify_buffer(const void *data, uint64_t data_size,
+                                     const void *signature, size_t size,
+                                     const CompletionCallback &done) {
+  auto job = make_job(options_);
+  job->source.open_memory(data, data_size);
+  job->expected = static_cast<const uint8_t *>(signature);
+  return submit(job, size, done);
+}
+
+} // namespace vsign
@@ -0,0 +1,632 @@
+// vsign library, C++ API. See vsign_c.h for the C one.
+//
+// Signature of an input is an array of 16 byte hashes, one per block of
+// input, Meow hashes unless Options::algorithm says otherwise. Signing
+// functions write it into a buffer of the caller or hand it over to a
+// callback block by block, nothing is copied in between.
+// Signature files start with a SignatureHeader that is followed by the hashes.
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace vsign {
+
+// Size of a hash of one block
+constexpr size_t HASH_SIZE = 16;
+
+// How input data gets into memory before hashing
+enum class Engine : int {
+  automatic = 0, // tuned value if there is a profile for the device, or mmap
+  mmap = 1,      // map the whole input, let the kernel page it in
+  read = 2,      // pread() blocks into per-thread buffers
+  direct = 3,    // same with O_DIRECT, bypassing page cache. Linux only,
+                 // block size must be a multiple of device's logical block
+};
+
+// Hash function of blocks, recorded in SignatureHeader::algorithm. Every one
+// gives HASH_SIZE bytes per block.
+enum class Algorithm : uint32_t {
+  meow = 0,   // Meow hash 0.5, with AES-NI: the fastest
+  crc32c = 1, // CRC32C (Castagnoli) with the SSE 4.2 crc32 instruction, in
+              // the first 4 bytes, little endian, the rest are zeros. The
+              // checksum of iSCSI, ext4 and most object stores. Can't be
+              // keyed.
+  xxh3 = 2,   // XXH3 128-bit, low half first, seeded with the first 8 bytes
+              // of the key. Needs no AES.
+  blake3 = 3, // BLAKE3, its first 16 bytes, keyed with the first 32 bytes
+              // of the key: the one that is cryptographic
+};
+
+enum class Status : int {
+  ok = 0,
+  invalid_argument = 1,
+  io_error = 2,
+  buffer_too_small = 3,
+  internal_error = 4,
+  mismatch = 5,  // verification found blocks that differ
+  cancelled = 6, // job was cancelled before it finished
+};
+
+// Whether sign_to_file() may skip files that are already signed, judging by
+// a database of signed files (device, inode, size, mtime, ctime, block size)
+// kept in $VSIGN_CACHE_DIR, $XDG_CACHE_HOME/vsign or ~/.cache/vsign
+enum class CachePolicy : int {
+  off = 0,        // always sign, don't record anything
+  trust = 1,      // skip file if its metadata is unchanged, no reads at all
+  revalidate = 2, // if metadata is unchanged, verify existing signature and
+                  // sign again only if it doesn't match
+};
+
+// How worker threads compete with other processes for disks and cores
+enum class Priority : int {
+  normal = 0,
+  low = 1,  // lowest best-effort I/O priority and nice 19
+  idle = 2, // idle I/O class and SCHED_IDLE: only what nobody else wants
+};
+
+// Limits that keep signing in the background from getting in the way of
+// other work. One throttle may be shared by any number of signers, limits
+// can be changed at any time from any thread.
+class Throttle {
+public:
+  // 0 = no limit
+  explicit Throttle(uint64_t max_bandwidth = 0, unsigned max_cpu = 0);
+  Throttle(const Throttle &) = delete;
+  Throttle &operator=(const Throttle &) = delete;
+
+  // Bytes per second read by all workers together, and percent of time
+  // (1..100) every worker may spend hashing, the rest it sleeps
+  void set(uint64_t max_bandwidth, unsigned max_cpu);
+  uint64_t max_bandwidth() const;
+  unsigned max_cpu() const;
+
+  // Called by a worker before reading `bytes`: sleeps as long as limits
+  // want it to
+  void pace(uint64_t bytes);
+
+private:
+  std::atomic<uint64_t> max_bandwidth_;
+  std::atomic<unsigned> max_cpu_;
+  int reserved_ = 0;
+  std::mutex mutex_;
+  int64_t next_read_ns_ = 0; // when reading is in budget again
+};
+
+// Secret seed of keyed signatures. Anyone without it can't compute hashes
+// of blocks, so can't craft blocks with the same hash either.
+struct Key {
+  uint64_t id = 0; // recorded in signatures, derived from the seed
+  uint8_t seed[128] = {};
+};
+
+// Expands key material (any bytes, best random ones) into a key. Expanded
+// seeds are cached per user by key ID, see find_key().
+Status load_key(const void *material, size_t size, Key &key,
+                std::string &error);
+// Key material is the whole file
+Status load_key_file(const char *path, Key &key, std::string &error);
+// Key that load_key() has cached before, false if there is none
+bool find_key(uint64_t id, Key &key);
+
+// Zero in threads or batch and Engine::automatic mean "not set": the value
+// can be taken from a tuning profile (see apply_device_profile), otherwise a
+// default is used.
+struct Options {
+  unsigned long long block_size = 1024 * 1024;
+  // Tree mode if not 0: blocks are split into chunks of this size, hashed by
+  // different threads, and hash of a block is the hash of its chunks'
+  // hashes. Must divide block_size. Signatures differ from plain ones.
+  unsigned long long chunk_size = 0;
+  unsigned long long threads = 0; // defaults to number of logical cores
+  unsigned long long batch = 0;   // blocks taken by a thread at once, 1
+  Engine engine = Engine::automatic;
+  int verbose = 0;
+  CachePolicy cache = CachePolicy::off;
+  // sign_to_file() saves progress to OUTPUT.checkpoint this often (seconds,
+  // 0 = never), so that an interrupted run can be resumed
+  unsigned checkpoint_interval = 0;
+  std::shared_ptr<const Key> key{}; // nullptr = unkeyed signatures
+  // sign_to_file() continues from OUTPUT.checkpoint if it was saved for the
+  // same input (device, inode, size, mtime) signed the same way, hashing
+  // only blocks that are missing. Otherwise it signs from the start.
+  int resume = 0;
+  // of worker threads; the calling thread doesn't help them unless normal
+  Priority priority = Priority::normal;
+  std::shared_ptr<Throttle> throttle{}; // nullptr = as fast as possible
+  // Prefetch input with non-temporal hints, so that hashing it doesn't evict
+  // what other processes keep in the shared last-level cache
+  int bypass_cache = 0;
+  Algorithm algorithm = Algorithm::meow; // of new signatures
+};
+
+// Receives hashes of blocks [first_block, first_block + count), HASH_SIZE
+// bytes each. Called from several worker threads at once.
+using HashCallback = std::function<void(uint64_t first_block,
+                                        const uint8_t *hashes, size_t count)>;
+
+// Outcome of signing or verification
+struct Result {
+  Status status = Status::ok;
+  int reserved = 0;
+  uint64_t mismatched_blocks = 0; // verification only
+  uint64_t first_mismatch = 0;    // index of the first block that differs
+  std::string error{};
+};
+
+// Signature files written by sign_to_file() start with this header. It is
+// written after all hashes, so an interrupted run leaves no valid header.
+// Numbers are little endian. Files without header (written by old versions)
+// are bare hashes.
+struct SignatureHeader {
+  char magic[8];        // SIGNATURE_MAGIC
+  uint32_t version;     // SIGNATURE_VERSION
+  uint32_t header_size; // sizeof(SignatureHeader), hashes start here
+  uint32_t flags;       // SIGNATURE_FLAG_*
+  uint32_t algorithm;   // Algorithm, keyed with key_id's key
+  uint64_t block_size;
+  uint64_t file_size;   // size of input when it was signed
+  int64_t mtime_ns;     // modification time of input, ns since epoch
+  uint64_t key_id;      // Key::id, 0 = no key and default seed
+  uint64_t chunk_size;  // Options::chunk_size if SIGNATURE_FLAG_TREE is set
+};
+
+constexpr char SIGNATURE_MAGIC[8] = {'V', 'S', 'I', 'G', 'N', 0, '\r', '\n'};
+constexpr uint32_t SIGNATURE_VERSION = 1;
+// Hashes of blocks are made in tree mode, see Options::chunk_size. Headers
+// with flags unknown to this version are not valid.
+constexpr uint32_t SIGNATURE_FLAG_TREE = 1;
+
+// Reads header of signature file. False if the file can't be read or has
+// no valid header.
+bool read_signature_header(const char *signature_file,
+                           SignatureHeader &header);
+
+// Shards written by Signer::sign_range_to_file() start with this header,
+// followed by hashes of blocks [first_block, first_block + block_count) of
+// the input. Shards of one input can be signed by different processes or
+// machines, and merged into its signature file with merge_shards().
+struct ShardHeader {
+  // of the whole input, but magic is SHARD_MAGIC and header_size is
+  // sizeof(ShardHeader)
+  SignatureHeader signature;
+  uint64_t first_block;
+  uint64_t block_count;
+  uint64_t reserved[2];
+};
+
+constexpr char SHARD_MAGIC[8] = {'V', 'S', 'H', 'A', 'R', 'D', '\r', '\n'};
+
+// Writes signature file `output` (with header) of shards that cover the
+// whole input once, in any order. Shards must be signed the same way, from
+// the same size and modification time of input. Hashes are copied with
+// copy_file_range(), which shares extents on filesystems that can. Not
+// available on Windows.
+Status merge_shards(const char *const *shards, size_t count,
+                    const char *output, std::string &error);
+
+// Deltas written by Signer::delta() start with this header, followed by the
+// signature of the new file (block_count hashes, signed the same way as the
+// old one) and op_count DeltaOps that rebuild the new file out of the old
+// one, in order of offsets in the new file. Numbers are little endian.
+struct DeltaHeader {
+  char magic[8];        // DELTA_MAGIC
+  uint32_t version;     // DELTA_VERSION
+  uint32_t header_size; // sizeof(DeltaHeader), hashes start here
+  uint32_t flags;       // SIGNATURE_FLAG_* of both signatures
+  uint32_t algorithm;   // SignatureHeader::algorithm of both signatures
+  uint64_t block_size;
+  uint64_t chunk_size;  // if SIGNATURE_FLAG_TREE is set
+  uint64_t key_id;
+  uint64_t old_size;    // of old file when it was signed
+  int64_t old_mtime_ns;
+  uint64_t new_size;
+  uint64_t block_count; // hashes of new file
+  uint64_t op_count;
+  uint64_t literal_bytes; // of all DELTA_LITERAL ops together
+};
+
+constexpr char DELTA_MAGIC[8] = {'V', 'D', 'E', 'L', 'T', 'A', '\r', '\n'};
+constexpr uint32_t DELTA_VERSION = 1;
+// `length` bytes of old file at `offset`
+constexpr uint32_t DELTA_COPY = 1;
+// `length` bytes that follow the op
+constexpr uint32_t DELTA_LITERAL = 2;
+
+// Next `length` bytes of new file
+struct DeltaOp {
+  uint32_t type; // DELTA_COPY or DELTA_LITERAL
+  uint32_t reserved;
+  uint64_t offset; // in old file, DELTA_COPY only
+  uint64_t length;
+};
+
+// What Signer::delta() has written
+struct DeltaReport {
+  uint64_t new_size = 0;
+  uint64_t copied_bytes = 0;
+  uint64_t literal_bytes = 0;
+  uint64_t op_count = 0;
+};
+
+// What Signer::patch() has done
+struct PatchReport {
+  uint64_t new_size = 0;
+  uint64_t written_bytes = 0;   // literal data, and copies that fell back
+  uint64_t copied_bytes = 0;    // by copy_file_range(), reflinked if it can
+  uint64_t unchanged_bytes = 0; // in place, left where they were
+  int in_place = 0;
+  int reserved = 0;
+};
+
+// Which blocks Signer::verify_sample() checks. The same seed picks the same
+// blocks of the same input.
+struct SampleOptions {
+  double percent = 0; // of all blocks, or
+  uint64_t count = 0; // exactly this many blocks, wins if both are set
+  uint64_t seed = 0;
+};
+
+struct SampleReport {
+  uint64_t total_blocks = 0;
+  uint64_t checked_blocks = 0;
+};
+
+// Chance that checking `checked` of `total` blocks finds corruption, if
+// `corrupted_fraction` (0..1) of blocks are corrupted
+double detection_confidence(uint64_t total, uint64_t checked,
+                            double corrupted_fraction);
+
+// Called once a job is finished, on one of worker threads
+using CompletionCallback = std::function<void(const Result &result)>;
+
+class Job;
+class SignatureCache;
+class ThreadPool;
+
+// Signs any number of inputs with the same options, worker threads are
+// created once and reused by every call. One call at a time.
+class Signer {
+public:
+  explicit Signer(const Options &options = Options());
+  ~Signer();
+  Signer(const Signer &) = delete;
+  Signer &operator=(const Signer &) = delete;
+
+  // Options with defaults filled in
+  const Options &options() const;
+
+  uint64_t block_count(uint64_t input_size) const;
+  // Size of signature in bytes
+  uint64_t signature_size(uint64_t input_size) const;
+
+  // Write signature into `signature` buffer of `capacity` bytes
+  Status sign_file(const char *path, void *signature, size_t capacity);
+  Status sign_fd(int file, void *signature, size_t capacity);
+  Status sign_buffer(const void *data, uint64_t size, void *signature,
+                     size_t capacity);
+
+  // Hand hashes over to callback as soon as they are ready
+  Status sign_file(const char *path, const HashCallback &callback);
+  Status sign_fd(int file, const HashCallback &callback);
+  Status sign_buffer(const void *data, uint64_t size,
+                     const HashCallback &callback);
+
+  // Create (or overwrite) signature file `output` of file `input`. With
+  // Options::cache set, `skipped` (optional) tells if it was up to date.
+  // See Options::resume for continuing interrupted runs.
+  Status sign_to_file(const char *input, const char *output,
+                      bool *skipped = nullptr);
+  // Same for several block sizes at once, reading input only once. Every
+  // block size must divide all larger ones. Options::block_size is ignored.
+  // Checkpoints are made for one block size only.
+  Status sign_to_files(const char *input, const uint64_t *block_sizes,
+                       const char *const *outputs, size_t count,
+                       bool *skipped = nullptr);
+  // Same with algorithms[i] for outputs[i] instead of Options::algorithm.
+  // Outputs may share a block size if their algorithms differ: every block
+  // is read once and hashed with each of them while it is in CPU cache.
+  Status sign_to_files(const char *input, const uint64_t *block_sizes,
+                       const Algorithm *algorithms,
+                       const char *const *outputs, size_t count,
+                       bool *skipped = nullptr);
+
+  // Sign bytes [offset, offset + length) of `input` into shard `output`,
+  // see ShardHeader. The range must start at a block boundary and end at
+  // one or at the end of input. No checkpoints, and the cache is not used.
+  Status sign_range_to_file(const char *input, const char *output,
+                            uint64_t offset, uint64_t length);
+
+  // Check that `signature` of `size` bytes matches the input. Returns
+  // Status::mismatch if it doesn't, `result` (optional) tells where.
+  Status verify_file(const char *path, const void *signature, size_t size,
+                     Result *result = nullptr);
+  Status verify_buffer(const void *data, uint64_t data_size,
+                       const void *signature, size_t size,
+                       Result *result = nullptr);
+  // Same for signature file created by sign_to_file(), with block size taken
+  // from its header
+  Status verify_from_file(const char *input, const char *signature_file,
+                          Result *result = nullptr);
+  // Same for blocks that overlap [offset, offset + length) of input only.
+  // Nothing else of either file is read, so the cost doesn't depend on
+  // their size. Result::first_mismatch counts blocks from start of input.
+  Status verify_range(const char *input, const char *signature_file,
+                      uint64_t offset, uint64_t length,
+                      Result *result = nullptr);
+  // Same for a random sample of blocks, read in order of their offsets
+  Status verify_sample(const char *input, const char *signature_file,
+                       const SampleOptions &sample, Result *result = nullptr,
+                       SampleReport *report = nullptr);
+
+  // Write delta that turns file signed into `old_signature` (with header)
+  // into file `input` to file descriptor `output`, which may be a pipe.
+  // Blocks of input are hashed in parallel and looked up among blocks of
+  // the old file at any block offset, the rest is literal data. `report`
+  // (optional) tells how much is which. Not available on Windows.
+  Status delta(const char *old_signature, const char *input, int output,
+               DeltaReport *report = nullptr);
+  // Rebuild the new file out of `old_file` and `delta` into `output`. With
+  // nullptr output the old file is patched in place if no copy reads what
+  // other ops write, so blocks that stay where they were are never written;
+  // otherwise the new file replaces it. Every piece is verified against
+  // the signature in the delta before it's written, in place all of them
+  // before anything is. Copies go through copy_file_range(), which shares
+  // extents on filesystems that can. Not available on Windows.
+  Status patch(const char *old_file, const char *delta,
+               const char *output = nullptr, PatchReport *report = nullptr);
+
+  // Human readable description of the last failure
+  const std::string &error() const;
+
+private:
+  SignatureCache *signature_cache();
+
+  Options options_;
+  std::unique_ptr<ThreadPool> pool_;
+  std::unique_ptr<SignatureCache> cache_;
+  std::string error_;
+};
+
+// Job submitted to AsyncSigner. Copies refer to the same job.
+class JobHandle {
+public:
+  JobHandle();
+
+  // False for default constructed handle
+  bool valid() const;
+  // True once the job is finished, never blocks
+  bool ready() const;
+  // Blocks until the job is finished
+  const Result &wait() const;
+  std::shared_future<Result> future() const;
+  // Stops the job as soon as possible, it finishes with Status::cancelled
+  void cancel() const;
+
+private:
+  friend class AsyncSigner;
+  explicit JobHandle(const std::shared_ptr<Job> &job);
+  std::shared_ptr<Job> job_;
+};
+
+// Runs any number of sign and verify jobs at once without blocking the
+// caller. All jobs share `threads` workers that take turns between them a few
+// megabytes at a time, so small jobs are not stuck behind big ones.
+// Buffers passed to a job must stay valid until it is finished.
+class AsyncSigner {
+public:
+  explicit AsyncSigner(const Options &options = Options());
+  // Waits for all submitted jobs
+  ~AsyncSigner();
+  AsyncSigner(const AsyncSigner &) = delete;
+  AsyncSigner &operator=(const AsyncSigner &) = delete;
+
+  // Options with defaults filled in
+  const Options &options() const;
+
+  JobHandle sign_file(const char *path, void *signature, size_t capacity,
+                      const CompletionCallback &done = nullptr);
+  JobHandle sign_fd(int file, void *signature, size_t capacity,
+                    const CompletionCallback &done = nullptr);
+  JobHandle sign_buffer(const void *data, uint64_t size, void *signature,
+                        size_t capacity,
+                        const CompletionCallback &done = nullptr);
+  JobHandle sign_file(const char *path, const HashCallback &hashes,
+                      const CompletionCallback &done = nullptr);
+  JobHandle sign_to_file(const char *input, const char *output,
+                         const CompletionCallback &done = nullptr);
+  JobHandle verify_file(const char *path, const void *signature, size_t size,
+                        const CompletionCallback &done = nullptr);
+  JobHandle verify_buffer(const void *data, uint64_t data_size,
+                          const void *signature, size_t size,
+                          const CompletionCallback &done = nullptr);
+
+  // Linux eventfd that is incremented whenever a job is finished, for use
+  // in event loops. -1 on other systems.
+  int event_fd() const;
+
+private:
+  JobHandle submit(const std::shared_ptr<Job> &job, uint64_t output_size,
+                   const CompletionCallback &done);
+
+  Options options_;
+  std::unique_ptr<ThreadPool> pool_;
+  int event_fd_;
+  int reserved_;
+};
+
+const char *engine_name(Engine engine);
+// Engine::automatic for unknown names
+Engine parse_engine(const char *name);
+
+// "unknown" for values that are not an Algorithm
+const char *algorithm_name(uint32_t algorithm);
+// False for unknown names
+bool parse_algorithm(const char *name, Algorithm &algorithm);
+
+// Tuning profiles describe the fastest options for a storage device.
+// They are stored in $VSIGN_CACHE_DIR, $XDG_CACHE_HOME/vsign or
+// ~/.cache/vsign, one per device. Not available on Windows.
+
+// Path of profile for device holding `path`, empty if `path` can't be stat'ed
+std::string device_profile_path(const char *path);
+
+// Fills threads, batch and engine that are not set yet from the profile of
+// device holding `path`. False if there is no usable profile.
+bool apply_device_profile(const char *path, Options &options);
+
+// Reads a part of `path` with different threads, batch and engine, saves the
+// fastest of them as profile of its device and puts them into `best`.
+// Probes are reported to `log` if it's not null.
+Status tune_device(const char *path, Options &best, double &bandwidth,
+                   std::string &error, std::ostream *log = nullptr);
+
+// Keeps signatures of every file under a directory up to date
+struct WatchOptions {
+  // a file is signed once it hasn't been written to for this long
+  unsigned debounce_ms = 1000;
+  // files signed at once, 0 = number of threads
+  unsigned max_jobs = 0;
+  // files of the same disk signed at once, 0 = one for rotational disks,
+  // max_jobs for others. Every disk has its own queue, so a busy one
+  // doesn't hold up the others.
+  unsigned jobs_per_device = 0;
+};
+
+// Signs every file under `root` whose signature (FILE.signature) is missing
+// or doesn't match its size and modification time, then watches the tree
+// with inotify and re-signs files as they change. Returns once `stop` is set
+// and running jobs are finished. Signed files and failures are reported to
+// `log` if it's not null. Linux only.
+Status watch_tree(const char *root, const Options &options,
+                  const WatchOptions &watch, const std::atomic<int> &stop,
+                  std::string &error, std::ostream *log = nullptr);
+
+// How find_duplicates() works
+struct DedupOptions {
+  // bytes of hash tables in memory, shards that don't fit are spilled to
+  // temporary files and counted one by one at the end, in pieces that fit
+  uint64_t memory_budget = 1024ull * 1024 * 1024;
+  std::string spill_directory{}; // $TMPDIR or /tmp if empty
+  uint64_t top = 10;             // largest duplicate sets to report
+};
+
+// Block that occurs more than once
+struct DuplicateSet {
+  uint8_t hash[HASH_SIZE] = {};
+  uint64_t size = 0;  // bytes of the block
+  uint64_t count = 0; // of its occurrences
+  // where it occurs first: index of signature file and block in it
+  uint64_t first_file = UINT64_MAX;
+  uint64_t first_block = 0;
+};
+
+struct DedupReport {
+  uint64_t files = 0;
+  uint64_t blocks = 0;
+  uint64_t bytes = 0;            // of signed files
+  uint64_t unique_blocks = 0;    // distinct ones
+  uint64_t duplicate_blocks = 0; // blocks - unique_blocks
+  uint64_t duplicate_bytes = 0;  // that storing every block once saves
+  uint64_t spilled_shards = 0;
+  std::vector<DuplicateSet> top{}; // that save the most, largest first
+};
+
+// Counts blocks that occur more than once in signature files (with
+// header), within one file or across them. Signatures may differ in block
+// size, but not in key or tree mode. Uses options.threads, blocks are
+// equal if their hashes are. Not available on Windows.
+Status find_duplicates(const char *const *signature_files, size_t count,
+                       const Options &options, const DedupOptions &dedup,
+                       DedupReport &report, std::string &error);
+
+// Filters written by BloomFilter::save() start with this header, followed
+// by line_count lines of BLOOM_LINE bytes. Numbers are little endian.
+struct BloomHeader {
+  char magic[8];        // BLOOM_MAGIC
+  uint32_t version;     // BLOOM_VERSION
+  uint32_t header_size; // sizeof(BloomHeader), lines start here
+  uint32_t flags;       // SIGNATURE_FLAG_* of signatures added
+  uint32_t algorithm;   // SignatureHeader::algorithm of them
+  uint64_t block_size;
+  uint64_t chunk_size; // if SIGNATURE_FLAG_TREE is set
+  uint64_t key_id;
+  uint64_t line_count;
+  uint64_t hash_count; // added so far, repeated ones too
+};
+
+constexpr char BLOOM_MAGIC[8] = {'V', 'B', 'L', 'O', 'O', 'M', '\r', '\n'};
+constexpr uint32_t BLOOM_VERSION = 2;
+// A hash sets one bit in each of 16 words of 32 bits of one line, which is
+// a cache line, so a probe reads one line and tests it with two AVX2 ops
+constexpr uint64_t BLOOM_LINE = 64;
+
+// How build_bloom_filter() sizes a new filter
+struct BloomOptions {
+  double false_positive_rate = 0.01;
+  uint64_t capacity = 0; // hashes, 0 = as many as all signatures have
+};
+
+// Blocked Bloom filter over hashes of blocks: tells that a block is
+// certainly not among those added, or that it probably is. Blocks must be
+// signed the way the filter says (block size, mode, key). Filters of the
+// same size made the same way can be merged, which equals adding hashes of
+// both to one of them.
+class BloomFilter {
+public:
+  BloomFilter();
+  BloomFilter(const BloomFilter &) = delete;
+  BloomFilter &operator=(const BloomFilter &) = delete;
+
+  // Empty filter for blocks signed like `signed_like`, sized so that once
+  // `capacity` distinct hashes are added it finds about
+  // `false_positive_rate` (0..1) of hashes that were not
+  Status create(const SignatureHeader &signed_like, uint64_t capacity,
+                double false_positive_rate, std::string &error);
+  Status load(const char *path, std::string &error);
+  // Written next to `path` first, then renamed over it
+  Status save(const char *path, std::string &error) const;
+
+  void add(const uint8_t *hashes, size_t count);
+  // False if no block with this hash was added, true if one probably was
+  bool contains(const uint8_t *hash) const;
+  // Same for `count` hashes at once, with lines of later ones prefetched:
+  // found[i] is 1 or 0. Returns how many are probably added.
+  size_t contains(const uint8_t *hashes, size_t count, uint8_t *found) const;
+  // Adds everything added to `other`
+  Status merge(const BloomFilter &other, std::string &error);
+
+  const BloomHeader &header() const { return header_; }
+  // Chance to find a hash that was never added, measured from the bits
+  double false_positive_rate() const;
+
+private:
+  friend Status build_bloom_filter(const char *const *, size_t,
+                                   const Options &, const BloomOptions &,
+                                   BloomFilter &, std::string &);
+  void allocate(uint64_t line_count);
+
+  BloomHeader header_;
+  std::vector<uint8_t> memory_;
+  uint8_t *lines_; // in memory_, aligned to BLOOM_LINE
+};
+
+// Builds a filter of `files`: signature files (with header), whose hashes
+// are added, and filters, which are merged. Sized like the first of the
+// filters, or by `bloom` if there is none. All must be made the same way.
+// Threads sort hashes by part of the filter first, then every part is
+// filled by one thread, so the lines it touches stay in its cache.
+Status build_bloom_filter(const char *const *files, size_t count,
+                          const Options &options, const BloomOptions &bloom,
+                          BloomFilter &filter, std::string &error);
+
+} // namespace vsign
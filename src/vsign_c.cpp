@@ -0,0 +1,452 @@
+// C API of vsign library, a thin layer over the C++ one
+
+#include <cstring>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "vsign.h"
+#include "vsign_c.h"
+
+struct vsign_signer {
+  explicit vsign_signer(const vsign::Options &options) : signer(options) {}
+  vsign::Signer signer;
+};
+
+// Fields that the caller's version of vsign_options doesn't have keep their
+// defaults. Loading the key may take a while and fails on empty key.
+static vsign::Options to_options(const vsign_options *options,
+                                 bool with_key = true) {
+  vsign_options known;
+  vsign_options_init(&known);
+  if (options) {
+    const size_t size = options->struct_size < sizeof(known)
+                            ? options->struct_size
+                            : sizeof(known);
+    memcpy(&known, options, size);
+  }
+  vsign::Options result;
+  result.block_size = known.block_size;
+  result.chunk_size = known.chunk_size;
+  result.threads = known.threads;
+  result.batch = known.batch;
+  result.engine = static_cast<vsign::Engine>(known.engine);
+  result.cache = static_cast<vsign::CachePolicy>(known.cache);
+  result.checkpoint_interval = known.checkpoint_interval;
+  result.resume = known.resume;
+  result.priority = static_cast<vsign::Priority>(known.priority);
+  result.bypass_cache = known.bypass_cache;
+  result.algorithm = static_cast<vsign::Algorithm>(known.algorithm);
+  // always there, so that limits can be set later
+  result.throttle = std::make_shared<vsign::Throttle>(known.max_bandwidth,
+                                                      known.max_cpu);
+  if (known.key && with_key) {
+    std::shared_ptr<vsign::Key> key(new vsign::Key());
+    std::string error;
+    if (vsign::load_key(known.key, known.key_size, *key, error) !=
+        vsign::Status::ok) {
+      throw std::invalid_argument(error);
+    }
+    result.key = key;
+  }
+  return result;
+}
+
+static void from_options(const vsign::Options &options,
+                         vsign_options *result) {
+  result->block_size = options.block_size;
+  result->chunk_size = options.chunk_size;
+  result->threads = options.threads;
+  result->batch = options.batch;
+  result->engine = static_cast<int32_t>(options.engine);
+  result->cache = static_cast<int32_t>(options.cache);
+  result->checkpoint_interval = options.checkpoint_interval;
+  result->resume = options.resume;
+  result->priority = static_cast<int32_t>(options.priority);
+  result->bypass_cache = options.bypass_cache;
+  result->algorithm = static_cast<uint32_t>(options.algorithm);
+  if (options.throttle) {
+    result->max_bandwidth = options.throttle->max_bandwidth();
+    result->max_cpu = options.throttle->max_cpu();
+  }
+}
+
+struct vsign_async {
+  explicit vsign_async(const vsign::Options &options) : signer(options) {}
+  vsign::AsyncSigner signer;
+};
+
+struct vsign_bloom {
+  vsign_bloom() : filter() {}
+  vsign::BloomFilter filter;
+};
+
+struct vsign_job {
+  explicit vsign_job(const vsign::JobHandle &job_handle)
+      : handle(job_handle) {}
+  vsign::JobHandle handle;
+};
+
+// Returned by submit functions when memory runs out: finished, without a
+// job behind it, and never released
+static vsign_job unstarted_job(vsign::JobHandle{});
+static const char UNSTARTED_ERROR[] = "Not enough memory to start the job";
+
+template <typename Submit> static vsign_job *submit_job(Submit submit) {
+  try {
+    std::unique_ptr<vsign_job> job(new vsign_job(vsign::JobHandle()));
+    job->handle = submit();
+    return job.release();
+  } catch (...) {
+    return &unstarted_job;
+  }
+}
+
+// Copies as much of result as the caller's version of vsign_result holds
+static void to_result(const vsign::Result &result, vsign_result *output) {
+  if (!output) {
+    return;
+  }
+  vsign_result known;
+  known.struct_size = sizeof(known);
+  known.status = static_cast<int32_t>(result.status);
+  known.mismatched_blocks = result.mismatched_blocks;
+  known.first_mismatch = result.first_mismatch;
+  const size_t size = output->struct_size < sizeof(known)
+                          ? output->struct_size
+                          : sizeof(known);
+  memcpy(reinterpret_cast<uint8_t *>(output) + sizeof(known.struct_size),
+         reinterpret_cast<uint8_t *>(&known) + sizeof(known.struct_size),
+         size > sizeof(known.struct_size) ? size - sizeof(known.struct_size)
+                                          : 0);
+}
+
+static vsign::CompletionCallback
+to_completion(vsign_completion_callback callback, void *context) {
+  if (!callback) {
+    return nullptr;
+  }
+  return [callback, context](const vsign::Result &result) {
+    vsign_result converted;
+    converted.struct_size = sizeof(converted);
+    to_result(result, &converted);
+    callback(context, &converted);
+  };
+}
+
+static vsign::HashCallback to_callback(vsign_hash_callback callback,
+                                       void *context) {
+  return [callback, context](uint64_t first_block, const uint8_t *hashes,
+                             size_t count) {
+    callback(context, first_block, hashes, count);
+  };
+}
+
+extern "C" {
+
+int vsign_abi_version(void) { return VSIGN_ABI_VERSION; }
+
+void vsign_options_init(vsign_options *options) {
+  const vsign::Options defaults;
+  memset(options, 0, sizeof(*options));
+  options->struct_size = sizeof(*options);
+  from_options(defaults, options);
+}
+
+int vsign_options_apply_device_profile(vsign_options *options,
+                                       const char *path) {
+  try {
+    vsign::Options result = to_options(options, false);
+    if (!vsign::apply_device_profile(path, result)) {
+      return 0;
+    }
+    from_options(result, options);
+    return 1;
+  } catch (...) {
+    return 0;
+  }
+}
+
+vsign_signer *vsign_signer_create(const vsign_options *options) {
+  try {
+    return new vsign_signer(to_options(options));
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+void vsign_signer_destroy(vsign_signer *signer) { delete signer; }
+
+uint64_t vsign_signature_size(const vsign_signer *signer,
+                              uint64_t input_size) {
+  return signer->signer.signature_size(input_size);
+}
+
+int vsign_sign_file(vsign_signer *signer, const char *path, void *signature,
+                    size_t capacity) {
+  return static_cast<int>(signer->signer.sign_file(path, signature, capacity));
+}
+
+int vsign_sign_fd(vsign_signer *signer, int file, void *signature,
+                  size_t capacity) {
+  return static_cast<int>(signer->signer.sign_fd(file, signature, capacity));
+}
+
+int vsign_sign_buffer(vsign_signer *signer, const void *data, uint64_t size,
+                      void *signature, size_t capacity) {
+  return static_cast<int>(
+      signer->signer.sign_buffer(data, size, signature, capacity));
+}
+
+int vsign_sign_file_cb(vsign_signer *signer, const char *path,
+                       vsign_hash_callback callback, void *context) {
+  return static_cast<int>(
+      signer->signer.sign_file(path, to_callback(callback, context)));
+}
+
+int vsign_sign_fd_cb(vsign_signer *signer, int file,
+                     vsign_hash_callback callback, void *context) {
+  return static_cast<int>(
+      signer->signer.sign_fd(file, to_callback(callback, context)));
+}
+
+int vsign_sign_buffer_cb(vsign_signer *signer, const void *data,
+                         uint64_t size, vsign_hash_callback callback,
+                         void *context) {
+  return static_cast<int>(
+      signer->signer.sign_buffer(data, size, to_callback(callback, context)));
+}
+
+int vsign_sign_to_file(vsign_signer *signer, const char *input,
+                       const char *output) {
+  return static_cast<int>(signer->signer.sign_to_file(input, output));
+}
+
+int vsign_sign_to_files(vsign_signer *signer, const char *input,
+                        const uint64_t *block_sizes, const char *const *outputs,
+                        size_t count) {
+  return static_cast<int>(
+      signer->signer.sign_to_files(input, block_sizes, outputs, count));
+}
+
+int vsign_sign_to_files_with(vsign_signer *signer, const char *input,
+                             const uint64_t *block_sizes,
+                             const uint32_t *algorithms,
+                             const char *const *outputs, size_t count) {
+  try {
+    std::vector<vsign::Algorithm> converted(count);
+    for (size_t index = 0; index < count; ++index) {
+      converted[index] = static_cast<vsign::Algorithm>(algorithms[index]);
+    }
+    return static_cast<int>(signer->signer.sign_to_files(
+        input, block_sizes, converted.data(), outputs, count));
+  } catch (...) {
+    return VSIGN_ERROR_INTERNAL;
+  }
+}
+
+int vsign_verify_file(vsign_signer *signer, const char *path,
+                      const void *signature, size_t size,
+                      vsign_result *result) {
+  vsign::Result outcome;
+  const vsign::Status status =
+      signer->signer.verify_file(path, signature, size, &outcome);
+  outcome.status = status;
+  to_result(outcome, result);
+  return static_cast<int>(status);
+}
+
+int vsign_verify_buffer(vsign_signer *signer, const void *data,
+                        uint64_t data_size, const void *signature, size_t size,
+                        vsign_result *result) {
+  vsign::Result outcome;
+  const vsign::Status status = signer->signer.verify_buffer(
+      data, data_size, signature, size, &outcome);
+  outcome.status = status;
+  to_result(outcome, result);
+  return static_cast<int>(status);
+}
+
+int vsign_verify_from_file(vsign_signer *signer, const char *input,
+                           const char *signature_file, vsign_result *result) {
+  vsign::Result outcome;
+  const vsign::Status status =
+      signer->signer.verify_from_file(input, signature_file, &outcome);
+  outcome.status = status;
+  to_result(outcome, result);
+  return static_cast<int>(status);
+}
+
+int vsign_verify_range(vsign_signer *signer, const char *input,
+                       const char *signature_file, uint64_t offset,
+                       uint64_t length, vsign_result *result) {
+  vsign::Result outcome;
+  const vsign::Status status = signer->signer.verify_range(
+      input, signature_file, offset, length, &outcome);
+  outcome.status = status;
+  to_result(outcome, result);
+  return static_cast<int>(status);
+}
+
+int vsign_verify_sample(vsign_signer *signer, const char *input,
+                        const char *signature_file, double percent,
+                        uint64_t count, uint64_t seed, vsign_result *result) {
+  vsign::SampleOptions sample;
+  sample.percent = percent;
+  sample.count = count;
+  sample.seed = seed;
+  vsign::Result outcome;
+  const vsign::Status status = signer->signer.verify_sample(
+      input, signature_file, sample, &outcome);
+  outcome.status = status;
+  to_result(outcome, result);
+  return static_cast<int>(status);
+}
+
+int vsign_sign_range_to_file(vsign_signer *signer, const char *input,
+                             const char *output, uint64_t offset,
+                             uint64_t length) {
+  return static_cast<int>(
+      signer->signer.sign_range_to_file(input, output, offset, length));
+}
+
+int vsign_delta(vsign_signer *signer, const char *old_signature,
+                const char *input, int output) {
+  return static_cast<int>(
+      signer->signer.delta(old_signature, input, output));
+}
+
+int vsign_patch(vsign_signer *signer, const char *old_file,
+                const char *delta, const char *output) {
+  return static_cast<int>(signer->signer.patch(old_file, delta, output));
+}
+
+void vsign_signer_set_limits(vsign_signer *signer, uint64_t max_bandwidth,
+                             uint32_t max_cpu) {
+  signer->signer.options().throttle->set(max_bandwidth, max_cpu);
+}
+
+const char *vsign_last_error(const vsign_signer *signer) {
+  return signer->signer.error().c_str();
+}
+
+vsign_async *vsign_async_create(const vsign_options *options) {
+  try {
+    return new vsign_async(to_options(options));
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+void vsign_async_destroy(vsign_async *async) { delete async; }
+
+int vsign_async_event_fd(const vsign_async *async) {
+  return async->signer.event_fd();
+}
+
+void vsign_async_set_limits(vsign_async *async, uint64_t max_bandwidth,
+                            uint32_t max_cpu) {
+  async->signer.options().throttle->set(max_bandwidth, max_cpu);
+}
+
+vsign_job *vsign_async_sign_file(vsign_async *async, const char *path,
+                                 void *signature, size_t capacity,
+                                 vsign_completion_callback callback,
+                                 void *context) {
+  return submit_job([&]() {
+    return async->signer.sign_file(path, signature, capacity,
+                                   to_completion(callback, context));
+  });
+}
+
+vsign_job *vsign_async_sign_buffer(vsign_async *async, const void *data,
+                                   uint64_t size, void *signature,
+                                   size_t capacity,
+                                   vsign_completion_callback callback,
+                                   void *context) {
+  return submit_job([&]() {
+    return async->signer.sign_buffer(data, size, signature, capacity,
+                                     to_completion(callback, context));
+  });
+}
+
+vsign_job *vsign_async_verify_file(vsign_async *async, const char *path,
+                                   const void *signature, size_t size,
+                                   vsign_completion_callback callback,
+                                   void *context) {
+  return submit_job([&]() {
+    return async->signer.verify_file(path, signature, size,
+                                     to_completion(callback, context));
+  });
+}
+
+vsign_job *vsign_async_verify_buffer(vsign_async *async, const void *data,
+                                     uint64_t data_size, const void *signature,
+                                     size_t size,
+                                     vsign_completion_callback callback,
+                                     void *context) {
+  return submit_job([&]() {
+    return async->signer.verify_buffer(data, data_size, signature, size,
+                                       to_completion(callback, context));
+  });
+}
+
+int vsign_job_ready(const vsign_job *job) {
+  return job == &unstarted_job || job->handle.ready();
+}
+
+int vsign_job_wait(vsign_job *job, vsign_result *result) {
+  if (job == &unstarted_job) {
+    vsign::Result outcome;
+    outcome.status = vsign::Status::internal_error;
+    to_result(outcome, result);
+    return VSIGN_ERROR_INTERNAL;
+  }
+  const vsign::Result &outcome = job->handle.wait();
+  to_result(outcome, result);
+  return static_cast<int>(outcome.status);
+}
+
+void vsign_job_cancel(vsign_job *job) {
+  if (job != &unstarted_job) {
+    job->handle.cancel();
+  }
+}
+
+const char *vsign_job_error(vsign_job *job) {
+  if (job == &unstarted_job) {
+    return UNSTARTED_ERROR;
+  }
+  return job->handle.wait().error.c_str();
+}
+
+void vsign_job_release(vsign_job *job) {
+  if (job != &unstarted_job) {
+    delete job;
+  }
+}
+
+vsign_bloom *vsign_bloom_load(const char *path) {
+  std::unique_ptr<vsign_bloom> bloom(new (std::nothrow) vsign_bloom());
+  std::string error;
+  if (!bloom || bloom->filter.load(path, error) != vsign::Status::ok) {
+    return nullptr;
+  }
+  return bloom.release();
+}
+
+void vsign_bloom_destroy(vsign_bloom *bloom) { delete bloom; }
+
+int vsign_bloom_contains(const vsign_bloom *bloom, const void *hash) {
+  return bloom->filter.contains(static_cast<const uint8_t *>(hash));
+}
+
+size_t vsign_bloom_contains_many(const vsign_bloom *bloom, const void *hashes,
+                                 size_t count, uint8_t *found) {
+  return bloom->filter.contains(static_cast<const uint8_t *>(hashes), count,
+                                found);
+}
+
+} // extern "C"
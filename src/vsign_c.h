@@ -0,0 +1,264 @@
+/* vsign library, C API.
+ *
+ * Stable ABI: structs passed by pointer start with their own size, so fields
+ * can be appended in later versions without breaking old callers. Functions
+ * return VSIGN_OK or one of the VSIGN_ERROR_* codes, text of the last error
+ * is kept per signer. Signature of an input is an array of VSIGN_HASH_SIZE
+ * byte hashes, one per block.
+ */
+
+#ifndef VSIGN_C_H
+#define VSIGN_C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(_WIN32)
+#define VSIGN_API
+#else
+#define VSIGN_API __attribute__((visibility("default")))
+#endif
+
+#define VSIGN_ABI_VERSION 1
+#define VSIGN_HASH_SIZE 16
+
+#define VSIGN_OK 0
+#define VSIGN_ERROR_INVALID_ARGUMENT 1
+#define VSIGN_ERROR_IO 2
+#define VSIGN_ERROR_BUFFER_TOO_SMALL 3
+#define VSIGN_ERROR_INTERNAL 4
+#define VSIGN_MISMATCH 5
+#define VSIGN_CANCELLED 6
+
+#define VSIGN_ENGINE_AUTO 0
+#define VSIGN_ENGINE_MMAP 1
+#define VSIGN_ENGINE_READ 2
+#define VSIGN_ENGINE_DIRECT 3
+
+#define VSIGN_PRIORITY_NORMAL 0
+#define VSIGN_PRIORITY_LOW 1
+#define VSIGN_PRIORITY_IDLE 2
+
+#define VSIGN_CACHE_OFF 0
+#define VSIGN_CACHE_TRUST 1
+#define VSIGN_CACHE_REVALIDATE 2
+
+/* Hash of blocks, see vsign::Algorithm */
+#define VSIGN_ALGORITHM_MEOW 0
+#define VSIGN_ALGORITHM_CRC32C 1
+#define VSIGN_ALGORITHM_XXH3 2
+#define VSIGN_ALGORITHM_BLAKE3 3
+
+typedef struct vsign_options {
+  uint32_t struct_size; /* sizeof(vsign_options), set by vsign_options_init */
+  int32_t engine;       /* VSIGN_ENGINE_* */
+  uint64_t block_size;  /* bytes */
+  uint64_t threads;     /* 0 = number of logical cores */
+  uint64_t batch;       /* blocks taken by a thread at once, 0 = 1 */
+  int32_t cache;        /* VSIGN_CACHE_*, see vsign::CachePolicy */
+  int32_t reserved;
+  const void *key;      /* key material of keyed signatures, NULL = none */
+  uint64_t key_size;    /* bytes of key material */
+  uint64_t chunk_size;  /* tree mode if not 0, see vsign::Options */
+  uint32_t checkpoint_interval; /* seconds, 0 = none, see vsign::Options */
+  int32_t resume;               /* 1 = continue from OUTPUT.checkpoint */
+  uint64_t max_bandwidth; /* bytes per second of all workers, 0 = no limit */
+  uint32_t max_cpu;       /* percent of time a worker hashes, 0 = 100 */
+  int32_t priority;       /* VSIGN_PRIORITY_* of worker threads */
+  int32_t bypass_cache;   /* 1 = keep input out of the shared CPU cache */
+  uint32_t algorithm;     /* VSIGN_ALGORITHM_* of new signatures */
+} vsign_options;
+
+/* Outcome of signing or verification */
+typedef struct vsign_result {
+  uint32_t struct_size;       /* sizeof(vsign_result), set by caller */
+  int32_t status;             /* VSIGN_OK or error code */
+  uint64_t mismatched_blocks; /* verification only */
+  uint64_t first_mismatch;    /* index of the first block that differs */
+} vsign_result;
+
+typedef struct vsign_signer vsign_signer;
+typedef struct vsign_async vsign_async;
+typedef struct vsign_job vsign_job;
+typedef struct vsign_bloom vsign_bloom;
+
+/* Receives hashes of blocks [first_block, first_block + count),
+ * VSIGN_HASH_SIZE bytes each. Called from several worker threads at once. */
+typedef void (*vsign_hash_callback)(void *context, uint64_t first_block,
+                                    const uint8_t *hashes, size_t count);
+
+VSIGN_API int vsign_abi_version(void);
+
+/* Fill options with defaults */
+VSIGN_API void vsign_options_init(vsign_options *options);
+
+/* Reads profile of device holding `path` into unset fields of options,
+ * returns 1 if a profile was found, 0 otherwise */
+VSIGN_API int vsign_options_apply_device_profile(vsign_options *options,
+                                                 const char *path);
+
+/* Creates worker threads that are reused by every call. NULL options mean
+ * defaults. Returns NULL on failure, also if options have an empty key. */
+VSIGN_API vsign_signer *vsign_signer_create(const vsign_options *options);
+VSIGN_API void vsign_signer_destroy(vsign_signer *signer);
+
+/* Size of signature in bytes for input of given size */
+VSIGN_API uint64_t vsign_signature_size(const vsign_signer *signer,
+                                        uint64_t input_size);
+
+/* Write signature into `signature` buffer of `capacity` bytes */
+VSIGN_API int vsign_sign_file(vsign_signer *signer, const char *path,
+                              void *signature, size_t capacity);
+VSIGN_API int vsign_sign_fd(vsign_signer *signer, int file, void *signature,
+                            size_t capacity);
+VSIGN_API int vsign_sign_buffer(vsign_signer *signer, const void *data,
+                                uint64_t size, void *signature,
+                                size_t capacity);
+
+/* Hand hashes over to callback as soon as they are ready */
+VSIGN_API int vsign_sign_file_cb(vsign_signer *signer, const char *path,
+                                 vsign_hash_callback callback, void *context);
+VSIGN_API int vsign_sign_fd_cb(vsign_signer *signer, int file,
+                               vsign_hash_callback callback, void *context);
+VSIGN_API int vsign_sign_buffer_cb(vsign_signer *signer, const void *data,
+                                   uint64_t size, vsign_hash_callback callback,
+                                   void *context);
+
+/* Create (or overwrite) signature file `output` of file `input`: 64 byte
+ * header (SignatureHeader in vsign.h) followed by hashes */
+VSIGN_API int vsign_sign_to_file(vsign_signer *signer, const char *input,
+                                 const char *output);
+/* Same for `count` block sizes at once, into outputs[i] with block_sizes[i],
+ * reading input once. Every block size must divide all larger ones. */
+VSIGN_API int vsign_sign_to_files(vsign_signer *signer, const char *input,
+                                  const uint64_t *block_sizes,
+                                  const char *const *outputs, size_t count);
+/* Same with algorithms[i] (VSIGN_ALGORITHM_*) for outputs[i] instead of the
+ * one of options. Outputs may share a block size if their algorithms differ:
+ * every block is read once and hashed with each of them.
+ * VSIGN_ERROR_INTERNAL without error text if memory runs out. */
+VSIGN_API int vsign_sign_to_files_with(vsign_signer *signer, const char *input,
+                                       const uint64_t *block_sizes,
+                                       const uint32_t *algorithms,
+                                       const char *const *outputs,
+                                       size_t count);
+
+/* Check signature of `size` bytes against the input, VSIGN_MISMATCH if it
+ * doesn't match. `result` may be NULL. */
+VSIGN_API int vsign_verify_file(vsign_signer *signer, const char *path,
+                                const void *signature, size_t size,
+                                vsign_result *result);
+VSIGN_API int vsign_verify_buffer(vsign_signer *signer, const void *data,
+                                  uint64_t data_size, const void *signature,
+                                  size_t size, vsign_result *result);
+/* Same for signature file created by vsign_sign_to_file */
+VSIGN_API int vsign_verify_from_file(vsign_signer *signer, const char *input,
+                                     const char *signature_file,
+                                     vsign_result *result);
+/* Same for blocks that overlap [offset, offset + length) of input only */
+VSIGN_API int vsign_verify_range(vsign_signer *signer, const char *input,
+                                 const char *signature_file, uint64_t offset,
+                                 uint64_t length, vsign_result *result);
+/* Same for `count` blocks chosen at random by `seed`; 0 count means
+ * `percent` of all blocks */
+VSIGN_API int vsign_verify_sample(vsign_signer *signer, const char *input,
+                                  const char *signature_file, double percent,
+                                  uint64_t count, uint64_t seed,
+                                  vsign_result *result);
+
+/* Sign bytes [offset, offset + length) of `input` into shard `output`, see
+ * vsign::Signer::sign_range_to_file */
+VSIGN_API int vsign_sign_range_to_file(vsign_signer *signer, const char *input,
+                                       const char *output, uint64_t offset,
+                                       uint64_t length);
+
+/* Write delta that turns file signed into `old_signature` into file `input`
+ * to file descriptor `output`, see vsign::Signer::delta */
+VSIGN_API int vsign_delta(vsign_signer *signer, const char *old_signature,
+                          const char *input, int output);
+
+/* Rebuild new file out of `old_file` and `delta` into `output`, or patch
+ * `old_file` if `output` is NULL, see vsign::Signer::patch */
+VSIGN_API int vsign_patch(vsign_signer *signer, const char *old_file,
+                          const char *delta, const char *output);
+
+/* Changes max_bandwidth and max_cpu of options, also while jobs are
+ * running. May be called from any thread. */
+VSIGN_API void vsign_signer_set_limits(vsign_signer *signer,
+                                       uint64_t max_bandwidth,
+                                       uint32_t max_cpu);
+
+/* Text of the last error of this signer, valid until the next call */
+VSIGN_API const char *vsign_last_error(const vsign_signer *signer);
+
+/* Asynchronous jobs. All jobs of one vsign_async share its worker threads.
+ * Submit functions never block on hashing and never return NULL: a job that
+ * fails to start is finished right away. If memory runs out, it finishes
+ * with VSIGN_ERROR_INTERNAL and its callback is not called. Buffers must
+ * stay valid until the job is finished, and every job must be released. */
+
+/* Called once a job is finished, on one of worker threads */
+typedef void (*vsign_completion_callback)(void *context,
+                                          const vsign_result *result);
+
+VSIGN_API vsign_async *vsign_async_create(const vsign_options *options);
+/* Waits for all submitted jobs */
+VSIGN_API void vsign_async_destroy(vsign_async *async);
+/* Linux eventfd incremented whenever a job is finished, -1 elsewhere */
+VSIGN_API int vsign_async_event_fd(const vsign_async *async);
+/* Same as vsign_signer_set_limits */
+VSIGN_API void vsign_async_set_limits(vsign_async *async,
+                                      uint64_t max_bandwidth,
+                                      uint32_t max_cpu);
+
+/* `callback` may be NULL */
+VSIGN_API vsign_job *vsign_async_sign_file(vsign_async *async,
+                                           const char *path, void *signature,
+                                           size_t capacity,
+                                           vsign_completion_callback callback,
+                                           void *context);
+VSIGN_API vsign_job *vsign_async_sign_buffer(
+    vsign_async *async, const void *data, uint64_t size, void *signature,
+    size_t capacity, vsign_completion_callback callback, void *context);
+VSIGN_API vsign_job *vsign_async_verify_file(
+    vsign_async *async, const char *path, const void *signature, size_t size,
+    vsign_completion_callback callback, void *context);
+VSIGN_API vsign_job *vsign_async_verify_buffer(
+    vsign_async *async, const void *data, uint64_t data_size,
+    const void *signature, size_t size, vsign_completion_callback callback,
+    void *context);
+
+/* 1 if job is finished, never blocks */
+VSIGN_API int vsign_job_ready(const vsign_job *job);
+/* Blocks until job is finished, returns its status. `result` may be NULL. */
+VSIGN_API int vsign_job_wait(vsign_job *job, vsign_result *result);
+/* Job finishes with VSIGN_CANCELLED as soon as possible */
+VSIGN_API void vsign_job_cancel(vsign_job *job);
+/* Error text of finished job, valid until it is released */
+VSIGN_API const char *vsign_job_error(vsign_job *job);
+/* Forget about job, it still runs to completion if it's not finished */
+VSIGN_API void vsign_job_release(vsign_job *job);
+
+/* Bloom filters written by `vsign bloom`, see vsign::BloomFilter. Queries
+ * may run on any number of threads at once. */
+
+/* NULL if the file is not a valid filter or doesn't fit into memory */
+VSIGN_API vsign_bloom *vsign_bloom_load(const char *path);
+VSIGN_API void vsign_bloom_destroy(vsign_bloom *bloom);
+/* 0 if no block with this hash was added, 1 if one probably was */
+VSIGN_API int vsign_bloom_contains(const vsign_bloom *bloom, const void *hash);
+/* Same for `count` hashes of VSIGN_HASH_SIZE bytes: found[i] is 0 or 1.
+ * Returns how many are probably added. */
+VSIGN_API size_t vsign_bloom_contains_many(const vsign_bloom *bloom,
+                                           const void *hashes, size_t count,
+                                           uint8_t *found);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* VSIGN_C_H */
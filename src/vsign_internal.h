@@ -0,0 +1,387 @@
+// Parts of vsign library shared between its translation units
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "pool.h"
+#include "vsign.h"
+
+// Cross-platform memory mapping:
+#include "portable-memory-mapping/MemoryMapped.h"
+
+namespace vsign {
+
+// What tells whether contents of a file changed, without reading it
+struct FileIdentity {
+  uint64_t device = 0;
+  uint64_t inode = 0;
+  uint64_t size = 0;
+  int64_t mtime_ns = 0;
+  int64_t ctime_ns = 0;
+  uint32_t type = 0; // S_IFMT bits of mode
+  uint32_t reserved = 0;
+};
+
+// False if `path` can't be stat'ed. Size of block devices is their size.
+bool file_identity(const char *path, FileIdentity &identity);
+
+// Input opened for one of the engines: either mapped (or caller's) memory,
+// or a file descriptor for pread(). Regular file or block device.
+class Source {
+public:
+  Source();
+  ~Source();
+  Source(const Source &) = delete;
+  Source &operator=(const Source &) = delete;
+
+  // Map at most max_size bytes of input (0 = everything) starting at offset
+  Status open(const char *path, Engine engine, uint64_t max_size,
+              std::string &error, uint64_t offset = 0);
+  // Caller keeps ownership of `file`
+  Status open_fd(int file, Engine engine, uint64_t max_size,
+                 std::string &error, uint64_t offset = 0);
+  void open_memory(const void *data, uint64_t size);
+
+  const uint8_t *memory() const { return memory_; }
+  uint64_t size() const { return size_; }
+  // Where in the file memory()[0] and pread() offset 0 are
+  uint64_t offset() const { return offset_; }
+  // File at the moment it was opened, zeros for memory
+  const FileIdentity &identity() const { return identity_; }
+  // True if [offset, offset + size) of source (not file) lies in a hole of
+  // sparse file, so reading it would only give zeros
+  bool is_hole(uint64_t offset, uint64_t size) const;
+  bool has_holes() const { return !holes_.empty(); }
+  int file() const { return file_; }
+  Engine engine() const { return engine_; }
+  // Offsets and sizes of direct reads are multiples of this
+  uint32_t alignment() const { return alignment_; }
+  // pread() [offset, offset + size) of source until everything is read,
+  // false on I/O error or unexpected EOF. Direct reads need `buffer` aligned
+  // to READ_BUFFER_ALIGNMENT with room for size rounded up to alignment().
+  bool read(uint8_t *buffer, uint64_t offset, uint64_t size) const;
+
+private:
+  void find_holes(int file);
+
+  MemoryMapped mapping_;
+  std::vector<std::pair<uint64_t, uint64_t>> holes_; // [begin, end), sorted
+  const uint8_t *memory_;
+  uint64_t size_;
+  uint64_t offset_;
+  FileIdentity identity_;
+  int file_;
+  int owns_file_;
+  Engine engine_;
+  uint32_t alignment_;
+};
+
+// Enough for direct reads from any device
+constexpr uint64_t READ_BUFFER_ALIGNMENT = 4096;
+
+// Per-thread read buffer of at least `size` bytes, aligned for direct reads
+uint8_t *read_buffer(std::vector<uint8_t> &buffer, uint64_t size);
+
+// Signature file being written. Hashes go right after the header, which is
+// filled in by finish() once all of them are there.
+class SignatureWriter {
+public:
+  SignatureWriter();
+  SignatureWriter(const SignatureWriter &) = delete;
+  SignatureWriter &operator=(const SignatureWriter &) = delete;
+
+  // `resume` keeps hashes of existing file of the same size. A `shard`
+  // holds hashes of the part of the file that input is.
+  Status open(const char *path, const Source &input, uint64_t block_size,
+              uint64_t chunk_size, uint64_t key_id, Algorithm algorithm,
+              std::string &error, bool resume = false, bool shard = false);
+  uint8_t *hashes();
+  uint64_t hashes_size() const;
+  // Hashes written so far are on disk once it returns true
+  bool flush();
+  void finish();
+
+private:
+  MemoryMapped mapping_;
+  ShardHeader header_; // only its signature if it's not a shard
+};
+
+// Persistent record of files signed with sign_to_file(), one database per
+// user in cache_directory(), shared by processes. Lets unchanged files be
+// skipped without reading them. Not available on Windows.
+class SignatureCache {
+public:
+  // What a file was signed with and into. Slot is free if signature is 0.
+  struct Entry {
+    FileIdentity file{};
+    uint64_t block_size = 0;
+    uint64_t signature = 0; // hash of absolute path of signature file
+    uint64_t key_id = 0;
+    uint32_t version = 0; // SIGNATURE_VERSION
+    uint32_t algorithm = 0;
+    uint64_t chunk_size = 0; // tree mode if not 0
+    // signature file as it was written, so that one replaced or changed
+    // since then isn't trusted
+    FileIdentity output{};
+  };
+
+  SignatureCache();
+  ~SignatureCache();
+  SignatureCache(const SignatureCache &) = delete;
+  SignatureCache &operator=(const SignatureCache &) = delete;
+
+  Status open(const std::string &path, std::string &error);
+  // True if the same file was signed into the same signature the same way
+  bool find(const Entry &entry);
+  void store(const Entry &entry);
+  // Entry for signing `input` into existing file `output`, false if either
+  // can't be trusted to be unchanged
+  static bool make_entry(const FileIdentity &input, const char *output,
+                         uint64_t block_size, uint64_t chunk_size,
+                         uint64_t key_id, Algorithm algorithm, Entry &entry);
+
+private:
+  bool lock(int operation);
+  void unlock();
+  bool map();
+  Entry *slot(const Entry &entry);
+  bool grow();
+
+  uint8_t *memory_ = nullptr;
+  uint64_t mapped_size_ = 0;
+  int file_ = -1;
+  int reserved_ = 0;
+};
+
+// Which blocks of a job signing into a file are hashed, saved next to the
+// file every few seconds after hashes are flushed. Lets an interrupted job
+// be resumed. Not available on Windows.
+class Checkpoint {
+public:
+  Checkpoint();
+  Checkpoint(const Checkpoint &) = delete;
+  Checkpoint &operator=(const Checkpoint &) = delete;
+
+  // Checkpoint of a job signing `input` into `output`, saved every
+  // `interval` seconds. With `resume`, loads progress saved by interrupted
+  // job that signed the same input the same way, and returns true if there
+  // is any. Best effort: checkpoints that can't be saved are not.
+  bool open(const char *output, const FileIdentity &input,
+            uint64_t block_size, uint64_t chunk_size, uint64_t key_id,
+            Algorithm algorithm, uint64_t block_count, unsigned interval,
+            bool resume);
+  // True if all blocks [first, end) are hashed
+  bool done(uint64_t first, uint64_t end) const;
+  // Marks blocks [first, end) as hashed, their hashes must be in `writer`.
+  // Saves progress if it's time to.
+  void mark(uint64_t first, uint64_t end, SignatureWriter &writer);
+  void save(SignatureWriter &writer);
+  // Job is finished, checkpoint is not needed any more
+  void remove();
+
+private:
+  struct Record {
+    char magic[8] = {};
+    uint32_t version = 0;
+    uint32_t record_size = 0;
+    FileIdentity input{};
+    uint64_t block_size = 0;
+    uint64_t chunk_size = 0;
+    uint64_t key_id = 0;
+    uint32_t algorithm = 0;
+    uint32_t reserved = 0;
+    uint64_t block_count = 0;
+  };
+
+  std::string path_;
+  Record record_;
+  std::unique_ptr<std::atomic<uint64_t>[]> bits_;
+  std::atomic<int64_t> next_save_{INT64_MAX}; // steady clock, ns
+  std::mutex save_mutex_;
+  int64_t interval_ = 0; // ns
+};
+
+// sysfs name of the disk (like "sda" or "nvme0n1") holding filesystem on
+// `device` (st_dev): partitions resolve to their disk, LVM and md on top of
+// one disk to that disk. Empty if it's not a block device, like tmpfs or
+// NFS. Linux only.
+std::string physical_device(uint64_t device);
+// True if sysfs says the disk has spinning platters
+bool is_rotational(const std::string &disk);
+
+std::string cache_directory();
+// mkdir -p
+bool make_directories(const std::string &path);
+
+// Algorithms known to this version are below this
+constexpr uint32_t ALGORITHM_COUNT = 4;
+
+// False if memory doesn't start with a valid header
+bool parse_signature_header(const uint8_t *memory, uint64_t size,
+                            SignatureHeader &header);
+
+// Every bit of the result depends on every bit of `value` (finalizer of
+// MurmurHash3). Hashes of blocks are uniform in all their bits, except
+// CRC32C ones that have 32 bits and zeros after them, so where bits of a
+// hash are picked they are mixed first.
+inline uint64_t mix_bits(uint64_t value) {
+  value ^= value >> 33;
+  value *= 0xff51afd7ed558ccdull;
+  value ^= value >> 33;
+  value *= 0xc4ceb9fe1a85ec53ull;
+  return value ^ (value >> 33);
+}
+
+// Options::chunk_size that signature with this header was made with
+uint64_t tree_chunk_size(const SignatureHeader &header);
+// Key that signature with key_id in its header was made with: the one of
+// options, or one that load_key() has cached before
+Status signature_key(const Options &options, uint64_t key_id,
+                     std::shared_ptr<const Key> &key, std::string &error);
+
+struct HasherStates; // hashers.h
+
+// One of signatures of a job that signs with several block sizes or
+// algorithms at once
+struct Resolution {
+  uint64_t block_size = 0;
+  Algorithm algorithm = Algorithm::meow;
+  uint32_t reserved = 0;
+  uint64_t block_count = 0;
+  uint64_t last_block_size = 0;
+  std::unique_ptr<SignatureWriter> writer{};
+  // hashes of all-zero block and last block, for holes of sparse files
+  uint8_t zero_hashes[2 * HASH_SIZE] = {};
+};
+
+// Hash every block of source, then either put hashes into output memory,
+// pass them to callback, or compare them with expected ones. Threads take
+// `batch` blocks at a time and return to ThreadPool after a few megabytes,
+// so jobs sharing a pool take turns.
+class Job : public Task {
+public:
+  Job(uint64_t block_size, uint64_t batch);
+  Job(const Job &) = delete;
+  Job &operator=(const Job &) = delete;
+
+  // Call once source is opened and output chosen, before running the job.
+  // False (and failed job) if output doesn't fit the source.
+  bool plan(uint64_t output_size);
+
+  bool step() override;
+  void complete() override;
+
+  // First failure wins, workers stop as soon as they notice it
+  void fail(Status status, const std::string &message);
+  Status status() const;
+  Result result() const;
+
+  Source source;
+  uint8_t *output = nullptr;         // sign into memory,
+  HashCallback callback;             // or hand hashes over,
+  const uint8_t *expected = nullptr; // or verify against them
+  std::vector<uint64_t> sample;      // only these blocks if not empty, sorted
+  std::shared_ptr<const Key> key;    // nullptr = default seed
+  std::shared_ptr<Throttle> throttle; // may be null
+  // or sign into all of them, by ascending block size, block_size is the
+  // largest one
+  std::vector<Resolution> resolutions;
+  std::unique_ptr<SignatureWriter> writer; // owns output if it's a file
+  std::unique_ptr<Checkpoint> checkpoint;  // of writer, may be null
+  CompletionCallback on_done;
+  std::promise<Result> promise;
+  std::shared_future<Result> future;
+  const uint64_t block_size;
+  const uint64_t batch;
+  uint64_t first_block = 0; // of source in the whole input, for reports
+  uint64_t block_count = 0;
+  uint64_t last_block_size = 0;
+  uint64_t window = 0; // of resolutions, hashed while it's in cache
+  // tree mode if chunk_size is not 0: threads take chunks instead of blocks,
+  // whoever hashes the last chunk of a block hashes the block. Chunk hashes
+  // of blocks in flight are kept in a ring of tree_slots blocks, block N in
+  // slot N % tree_slots once slot_blocks says the slot is N's.
+  uint64_t chunk_size = 0;
+  uint64_t chunk_count = 0;
+  uint64_t tree_slots = 0;
+  std::unique_ptr<uint8_t[]> chunk_hashes;
+  std::unique_ptr<std::atomic<uint64_t>[]> pending_chunks; // per slot
+  std::unique_ptr<std::atomic<uint64_t>[]> slot_blocks;
+  std::atomic<uint64_t> next_block{0};
+  std::atomic<uint64_t> mismatched_blocks{0};
+  std::atomic<uint64_t> first_mismatch{UINT64_MAX};
+  // hashes of all-zero block and last block (chunks in tree mode), for
+  // holes of sparse files
+  uint8_t zero_hashes[2 * HASH_SIZE] = {};
+  int event_fd = -1; // written to on completion if not -1
+  // non-temporal prefetches, see Options::bypass_cache
+  int bypass_cache = 0;
+  Algorithm algorithm = Algorithm::meow;
+
+private:
+  // Steps below are instantiated for every hasher of hashers.h, step()
+  // picks one by algorithm
+  template <class Hasher> bool step_with();
+  template <class Hasher> bool step_blocks();
+  template <class Hasher> bool step_sample();
+  bool plan_resolutions();
+  bool plan_tree();
+  void report_mismatch(uint64_t block);
+  template <class Hasher> bool step_tree();
+  template <class Hasher> void finish_tree_block(uint64_t block);
+  // Chunks of a block in tree mode, the last one's may be fewer
+  uint64_t chunks_of(uint64_t block) const;
+  // Waits for the slot of block to be its, false if the job failed meanwhile
+  bool wait_for_slot(uint64_t block) const;
+  // Hash of input, with prefetches of bypass_cache
+  template <class Hasher>
+  void hash_input(const uint8_t *memory, uint64_t size, uint8_t *hash);
+  // Hash of one whole block, in tree mode too
+  template <class Hasher>
+  void hash_block(const uint8_t *memory, uint64_t size, uint8_t *hash);
+  // Resolutions may differ in algorithm, they pick their hasher themselves
+  bool step_resolutions();
+  void hash_resolutions(const uint8_t *memory, uint64_t offset, uint64_t size,
+                        HasherStates &states);
+  template <class Hasher>
+  void absorb_window(Resolution &resolution, typename Hasher::State &state,
+                     const uint8_t *memory, uint64_t position,
+                     uint64_t length, bool last);
+  // Hash of zeros, for holes
+  void hash_zeros(const uint8_t *zeros, uint64_t size, uint8_t *hash) const;
+
+  std::atomic<int> status_{0};
+  mutable std::mutex error_mutex_;
+  std::string error_;
+};
+
+uint64_t block_count(uint64_t input_size, uint64_t block_size);
+
+// Plan job and run it on the pool with help of the calling thread
+Status run_job(ThreadPool &pool, const std::shared_ptr<Job> &job,
+               uint64_t output_size, std::string &error,
+               Result *result = nullptr);
+
+// pwrite() until everything is written, false on error
+bool write_fully_at(int file, const uint8_t *data, uint64_t size,
+                    uint64_t offset);
+// copy_file_range() shares extents on filesystems that can (Btrfs, XFS)
+// and copies in the kernel elsewhere. False if it doesn't work, then data
+// has to be written. Not available on Windows.
+bool copy_range(int from, uint64_t source, int to, uint64_t offset,
+                uint64_t size);
+
+// Defaults for everything that is not set in options
+Options resolve_options(const Options &options);
+
+// Sets priority of the calling thread
+void apply_priority(Priority priority);
+
+} // namespace vsign
@@ -0,0 +1,439 @@
+// Daemon that keeps signatures of a directory tree up to date. Linux only.
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <queue>
+#include <set>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "vsign_internal.h"
+
+namespace vsign {
+
+#ifdef __linux__
+
+using Clock = std::chrono::steady_clock;
+
+static const std::string SIGNATURE_SUFFIX = ".signature";
+
+// Events that may mean new contents of a file, or a new subdirectory
+constexpr uint32_t WATCH_MASK = IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB |
+                                IN_CREATE | IN_MOVED_TO | IN_DELETE |
+                                IN_MOVED_FROM | IN_ONLYDIR | IN_DONT_FOLLOW |
+                                IN_EXCL_UNLINK;
+
+// A file that is written to all the time still gets signed this often
+constexpr unsigned MAX_DELAY_DEBOUNCES = 10;
+
+// What vsign writes next to signed files: X.signature, and the same
+// followed by any of .SIZE, .ALGORITHM, .checkpoint and .PID of temporary
+// files. They are not signed, nor would anyone want them to be.
+static bool is_signature(const std::string &path) {
+  const size_t name = path.rfind('/') + 1;
+  const size_t suffix = path.rfind(SIGNATURE_SUFFIX);
+  if (suffix == std::string::npos || suffix < name) {
+    return false;
+  }
+  for (size_t start = suffix + SIGNATURE_SUFFIX.size(); start < path.size();) {
+    if (path[start] != '.') {
+      return false;
+    }
+    const size_t end = std::min(path.find('.', start + 1), path.size());
+    const std::string part = path.substr(start + 1, end - start - 1);
+    Algorithm algorithm;
+    if (part.empty() ||
+        (part.find_first_not_of("0123456789") != std::string::npos &&
+         part != "checkpoint" && !parse_algorithm(part.c_str(), algorithm))) {
+      return false;
+    }
+    start = end;
+  }
+  return true;
+}
+
+// Watched directories, files waiting for writes to them to settle, files
+// waiting for their disk and files being signed right now. Everything but
+// finished_ belongs to the thread that calls run().
+class Watcher {
+public:
+  Watcher(const Options &options, const WatchOptions &watch,
+          std::ostream *log);
+  ~Watcher();
+  Watcher(const Watcher &) = delete;
+  Watcher &operator=(const Watcher &) = delete;
+
+  Status start(const char *root, std::string &error);
+  Status run(const std::atomic<int> &stop, std::string &error);
+
+private:
+  struct Pending {
+    Clock::time_point due{};
+    Clock::time_point first_seen{};
+  };
+  using Due = std::pair<Clock::time_point, std::string>;
+  // Files that are ready to be signed, in the order they got ready
+  struct Disk {
+    std::deque<std::string> ready{};
+    size_t running = 0;
+    size_t limit = 0; // files signed at once
+  };
+
+  void add_directory(const std::string &path);
+  void schedule(const std::string &path, Clock::time_point now);
+  bool read_events();
+  void collect_finished();
+  Disk &disk(uint64_t device);
+  void sign_due_files();
+  void start_jobs();
+  bool up_to_date(const std::string &path) const;
+
+  const Options options_;
+  const std::chrono::milliseconds debounce_;
+  const size_t max_jobs_;
+  const size_t jobs_per_device_;
+  std::ostream *log_;
+  std::string root_;
+  int inotify_ = -1;
+  int reserved_ = 0;
+  std::map<int, std::string> directories_;
+  std::map<std::string, Pending> pending_;
+  // earliest due first, entries that were rescheduled since are skipped
+  std::priority_queue<Due, std::vector<Due>, std::greater<Due>> queue_;
+  std::map<uint64_t, std::string> disk_names_; // by st_dev
+  std::map<std::string, Disk> disks_;
+  std::set<std::string> ready_; // files in queues of disks
+  std::map<std::string, std::string> running_; // file, its disk
+  std::mutex finished_mutex_;
+  std::vector<std::pair<std::string, Result>> finished_;
+  // last member, so running jobs finish before the rest is destroyed
+  AsyncSigner signer_;
+};
+
+Watcher::Watcher(const Options &options, const WatchOptions &watch,
+                 std::ostream *log)
+    : options_(resolve_options(options)),
+      debounce_(watch.debounce_ms),
+      max_jobs_(watch.max_jobs ? watch.max_jobs : options_.threads),
+      jobs_per_device_(watch.jobs_per_device), log_(log), root_(),
+      directories_(), pending_(), queue_(), disk_names_(), disks_(), ready_(),
+      running_(), finished_mutex_(), finished_(), signer_(options_) {}
+
+Watcher::~Watcher() {
+  if (inotify_ != -1) {
+    ::close(inotify_);
+  }
+}
+
+Status Watcher::start(const char *root, std::string &error) {
+  struct stat info;
+  if (::stat(root, &info) != 0 || !S_ISDIR(info.st_mode)) {
+    error = std::string("Can't watch ") + root + ": not a directory";
+    return Status::invalid_argument;
+  }
+  inotify_ = ::inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+  if (inotify_ == -1) {
+    error = std::string("Can't initialize inotify: ") + strerror(errno);
+    return Status::io_error;
+  }
+  root_ = root;
+  add_directory(root_);
+  return Status::ok;
+}
+
+// Watches directory and its subdirectories, every file in them gets checked
+void Watcher::add_directory(const std::string &path) {
+  const int watch = ::inotify_add_watch(inotify_, path.c_str(), WATCH_MASK);
+  if (watch == -1) {
+    if (log_) {
+      *log_ << "Can't watch " << path << ": " << strerror(errno)
+            << (errno == ENOSPC ? " (see fs.inotify.max_user_watches)" : "")
+            << "\n";
+    }
+    return;
+  }
+  // moved directory keeps its watch, so this may be an update
+  directories_[watch] = path;
+
+  DIR *directory = ::opendir(path.c_str());
+  if (!directory) {
+    return;
+  }
+  const Clock::time_point now = Clock::now();
+  while (const dirent *entry = ::readdir(directory)) {
+    if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+      continue;
+    }
+    const std::string child = path + "/" + entry->d_name;
+    unsigned char type = entry->d_type;
+    if (type == DT_UNKNOWN) {
+      struct stat info;
+      if (::lstat(child.c_str(), &info) != 0) {
+        continue;
+      }
+      type = S_ISDIR(info.st_mode) ? DT_DIR
+                                   : S_ISREG(info.st_mode) ? DT_REG : DT_LNK;
+    }
+    if (type == DT_DIR) {
+      add_directory(child);
+    } else if (type == DT_REG && !is_signature(child)) {
+      // files that are already there have nothing to wait for
+      pending_[child] = Pending{now, now};
+      queue_.emplace(now, child);
+    }
+  }
+  ::closedir(directory);
+}
+
+// Postpones signing of file until it's left alone for a while
+void Watcher::schedule(const std::string &path, Clock::time_point now) {
+  auto inserted = pending_.emplace(path, Pending{now, now});
+  Pending &pending = inserted.first->second;
+  pending.due = std::min(now + debounce_,
+                         pending.first_seen + debounce_ * MAX_DELAY_DEBOUNCES);
+  queue_.emplace(pending.due, path);
+}
+
+// False if events were lost and the whole tree has to be checked again
+bool Watcher::read_events() {
+  alignas(inotify_event) char buffer[64 * 1024];
+  bool complete = true;
+  const Clock::time_point now = Clock::now();
+  for (;;) {
+    const ssize_t size = ::read(inotify_, buffer, sizeof(buffer));
+    if (size <= 0) {
+      return complete;
+    }
+    for (const char *position = buffer; position < buffer + size;) {
+      const inotify_event *event =
+          reinterpret_cast<const inotify_event *>(position);
+      position += sizeof(inotify_event) + event->len;
+      if (event->mask & IN_Q_OVERFLOW) {
+        complete = false;
+        continue;
+      }
+      auto directory = directories_.find(event->wd);
+      if (directory == directories_.end()) {
+        continue;
+      }
+      if (event->mask & IN_IGNORED) {
+        directories_.erase(directory);
+        continue;
+      }
+      if (!event->len) {
+        continue;
+      }
+      const std::string path = directory->second + "/" + event->name;
+      if (event->mask & IN_ISDIR) {
+        if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+          add_directory(path);
+        }
+      } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        pending_.erase(path);
+      } else if (!is_signature(path)) {
+        schedule(path, now);
+      }
+    }
+  }
+}
+
+void Watcher::collect_finished() {
+  std::vector<std::pair<std::string, Result>> finished;
+  {
+    std::lock_guard<std::mutex> lock(finished_mutex_);
+    finished.swap(finished_);
+  }
+  for (const auto &job : finished) {
+    auto running = running_.find(job.first);
+    --disks_[running->second].running;
+    running_.erase(running);
+    if (!log_) {
+      continue;
+    }
+    if (job.second.status != Status::ok) {
+      *log_ << "Can't sign " << job.first << ": " << job.second.error << "\n";
+    } else if (options_.verbose) {
+      *log_ << "Signed " << job.first << "\n";
+    }
+  }
+  if (log_ && !finished.empty()) {
+    log_->flush(); // daemon's log is usually a file or a pipe
+  }
+}
+
+// Signature header records size and modification time of the signed file
+bool Watcher::up_to_date(const std::string &path) const {
+  struct stat info;
+  SignatureHeader header;
+  if (::stat(path.c_str(), &info) != 0 ||
+      !read_signature_header((path + SIGNATURE_SUFFIX).c_str(), header)) {
+    return false;
+  }
+  const int64_t mtime_ns =
+      static_cast<int64_t>(info.st_mtim.tv_sec) * 1000000000 +
+      info.st_mtim.tv_nsec;
+  return header.file_size == static_cast<uint64_t>(info.st_size) &&
+         header.mtime_ns == mtime_ns &&
+         header.block_size == options_.block_size &&
+         header.chunk_size == options_.chunk_size &&
+         header.algorithm == static_cast<uint32_t>(options_.algorithm) &&
+         header.key_id == (options_.key ? options_.key->id : 0);
+}
+
+// Queue of the disk holding filesystem `device`, created on first use
+Watcher::Disk &Watcher::disk(uint64_t device) {
+  auto known = disk_names_.find(device);
+  if (known == disk_names_.end()) {
+    std::string name = physical_device(device);
+    if (name.empty()) {
+      // not backed by a local disk, a queue of its own
+      name = "device " + std::to_string(device);
+    }
+    known = disk_names_.emplace(device, name).first;
+  }
+  auto found = disks_.find(known->second);
+  if (found == disks_.end()) {
+    found = disks_.emplace(known->second, Disk()).first;
+    Disk &added = found->second;
+    // concurrent reads of different files make a spinning disk seek
+    added.limit = jobs_per_device_
+                      ? jobs_per_device_
+                      : is_rotational(known->second) ? 1 : max_jobs_;
+    if (log_ && options_.verbose) {
+      *log_ << "Disk " << known->second
+            << ", files signed at once: " << added.limit << "\n";
+    }
+  }
+  return found->second;
+}
+
+void Watcher::sign_due_files() {
+  const Clock::time_point now = Clock::now();
+  // files that are left alone long enough go to queues of their disks
+  while (!queue_.empty() && queue_.top().first <= now) {
+    const std::string path = queue_.top().second;
+    const Clock::time_point due = queue_.top().first;
+    queue_.pop();
+    auto pending = pending_.find(path);
+    if (pending == pending_.end() || pending->second.due != due) {
+      continue; // rescheduled or gone
+    }
+    if (running_.count(path)) {
+      // changed while being signed, try again once it's done
+      pending->second.due = now + debounce_;
+      queue_.emplace(pending->second.due, path);
+      continue;
+    }
+    pending_.erase(pending);
+
+    struct stat info;
+    if (::lstat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode) ||
+        !ready_.insert(path).second) {
+      continue;
+    }
+    disk(info.st_dev).ready.push_back(path);
+  }
+  start_jobs();
+}
+
+// Disks take turns, one file each, until they or the signer are busy
+void Watcher::start_jobs() {
+  for (bool started = true; started && running_.size() < max_jobs_;) {
+    started = false;
+    for (auto &entry : disks_) {
+      Disk &disk = entry.second;
+      while (!disk.ready.empty() && disk.running < disk.limit &&
+             running_.size() < max_jobs_) {
+        const std::string path = disk.ready.front();
+        disk.ready.pop_front();
+        ready_.erase(path);
+        if (pending_.count(path) || running_.count(path) ||
+            up_to_date(path)) {
+          continue; // written to again, it will be back once it's due
+        }
+        ++disk.running;
+        running_.emplace(path, entry.first);
+        signer_.sign_to_file(
+            path.c_str(), (path + SIGNATURE_SUFFIX).c_str(),
+            [this, path](const Result &result) {
+              std::lock_guard<std::mutex> lock(finished_mutex_);
+              finished_.emplace_back(path, result);
+            });
+        started = true;
+        break;
+      }
+    }
+  }
+}
+
+Status Watcher::run(const std::atomic<int> &stop, std::string &error) {
+  while (!stop) {
+    // wake up at least once a second to notice stop
+    Clock::duration timeout = std::chrono::seconds(1);
+    if (!queue_.empty()) {
+      timeout = std::min(timeout, queue_.top().first - Clock::now());
+    }
+    const int timeout_ms = static_cast<int>(std::max<int64_t>(
+        0, std::chrono::duration_cast<std::chrono::milliseconds>(timeout)
+               .count()));
+
+    pollfd files[2] = {{inotify_, POLLIN, 0}, {signer_.event_fd(), POLLIN, 0}};
+    if (::poll(files, 2, timeout_ms) < 0 && errno != EINTR) {
+      error = std::string("Can't wait for events: ") + strerror(errno);
+      return Status::io_error;
+    }
+    if (files[1].revents & POLLIN) {
+      uint64_t count;
+      const ssize_t size = ::read(signer_.event_fd(), &count, sizeof(count));
+      (void)size; // counter only wakes us up
+    }
+    if ((files[0].revents & POLLIN) && !read_events()) {
+      // some events were lost, cheap to check everything again
+      if (log_) {
+        *log_ << "inotify queue overflow, rescanning\n";
+      }
+      add_directory(root_);
+    }
+    collect_finished();
+    sign_due_files();
+  }
+  return Status::ok;
+}
+
+Status watch_tree(const char *root, const Options &options,
+                  const WatchOptions &watch, const std::atomic<int> &stop,
+                  std::string &error, std::ostream *log) {
+  Watcher watcher(options, watch, log);
+  const Status status = watcher.start(root, error);
+  if (status != Status::ok) {
+    return status;
+  }
+  return watcher.run(stop, error);
+}
+
+#else
+
+Status watch_tree(const char *, const Options &, const WatchOptions &,
+                  const std::atomic<int> &, std::string &error,
+                  std::ostream *) {
+  error = "Watching directories is supported on Linux only";
+  return Status::invalid_argument;
+}
+
+#endif
+
+} // namespace vsign